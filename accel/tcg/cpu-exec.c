@@ -242,6 +242,28 @@ static TranslationBlock *tb_htable_lookup(CPUState *cpu, target_ulong pc,
     return qht_lookup_custom(&tb_ctx.htable, &desc, h, tb_lookup_cmp);
 }
 
+//// --- Begin LibAFL code ---
+
+extern uint32_t libafl_hook_generation;
+
+/*
+ * A TB instrumented under an older hook set is invalidated on lookup, so
+ * it gets retranslated with the current hooks the next time it runs.
+ */
+static inline bool libafl_tb_is_stale(TranslationBlock *tb)
+{
+    if (likely(tb->libafl_hook_gen == qatomic_read(&libafl_hook_generation))) {
+        return false;
+    }
+
+    mmap_lock();
+    tb_phys_invalidate(tb, -1);
+    mmap_unlock();
+    return true;
+}
+
+//// --- End LibAFL code ---
+
 /* Might cause an exception, so have a longjmp destination ready */
 static inline TranslationBlock *tb_lookup(CPUState *cpu, target_ulong pc,
                                           target_ulong cs_base,
@@ -264,12 +286,22 @@ static inline TranslationBlock *tb_lookup(CPUState *cpu, target_ulong pc,
                tb->flags == flags &&
                tb->trace_vcpu_dstate == *cpu->trace_dstate &&
                tb_cflags(tb) == cflags)) {
+        //// --- Begin LibAFL code ---
+        if (unlikely(libafl_tb_is_stale(tb))) {
+            return NULL;
+        }
+        //// --- End LibAFL code ---
         return tb;
     }
     tb = tb_htable_lookup(cpu, pc, cs_base, flags, cflags);
     if (tb == NULL) {
         return NULL;
     }
+    //// --- Begin LibAFL code ---
+    if (unlikely(libafl_tb_is_stale(tb))) {
+        return NULL;
+    }
+    //// --- End LibAFL code ---
     tb_jmp_cache_set(jc, hash, tb, pc);
     return tb;
 }
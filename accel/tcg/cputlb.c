@@ -1347,6 +1347,264 @@ static inline void cpu_transaction_failed(CPUState *cpu, hwaddr physaddr,
     }
 }
 
+//// --- Begin LibAFL code ---
+
+/*
+ * Binary MMIO trace
+ *
+ * Every access that reaches a device through io_readx() or io_writex() is
+ * appended to a ring owned by the accessing vCPU. A ring has a single
+ * producer, so recording takes no lock: the event is filled in and then
+ * published by advancing the ring head with release semantics. The head is
+ * a running event count, the newest event sits at (head - 1) % entries.
+ *
+ * The rings live in a shared mapping, either of a file or anonymous (for a
+ * parent that forked us), and are laid out as
+ *
+ *   struct libafl_mmio_trace_header
+ *   char names[LIBAFL_MMIO_TRACE_MAX_DEVS][LIBAFL_MMIO_TRACE_NAME_LEN]
+ *   struct libafl_mmio_trace_event rings[num_cpus][entries]
+ *
+ * scripts/decode-mmio-trace.py turns a trace file back into text.
+ */
+
+#include "qemu/timer.h"
+#include "sysemu/cpu-timers.h"
+#include "qemu/cutils.h"
+
+#define LIBAFL_MMIO_TRACE_MAGIC     0x544d4d4c /* "LMMT" */
+#define LIBAFL_MMIO_TRACE_VERSION   1
+#define LIBAFL_MMIO_TRACE_MAX_CPUS  64
+#define LIBAFL_MMIO_TRACE_MAX_DEVS  256
+#define LIBAFL_MMIO_TRACE_NAME_LEN  64
+
+/* Header flags */
+#define LIBAFL_MMIO_TRACE_ICOUNT    1 /* Events carry icount, else virtual ns */
+
+/* Event flags */
+#define LIBAFL_MMIO_TRACE_WRITE     1
+#define LIBAFL_MMIO_TRACE_FAILED    2
+
+struct libafl_mmio_trace_event {
+    uint64_t icount;
+    uint64_t pc;
+    uint64_t offset;
+    uint64_t value;
+    uint16_t device;
+    uint8_t size;
+    uint8_t flags;
+    uint32_t reserved;
+};
+
+struct libafl_mmio_trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t num_cpus;
+    uint32_t entries;
+    uint32_t event_size;
+    uint32_t num_devices;
+    uint32_t name_len;
+    uint64_t names_offset;
+    uint64_t rings_offset;
+    uint64_t heads[LIBAFL_MMIO_TRACE_MAX_CPUS];
+};
+
+struct libafl_mmio_trace {
+    uint8_t *map;
+    size_t map_size;
+    struct libafl_mmio_trace_header *header;
+    char (*names)[LIBAFL_MMIO_TRACE_NAME_LEN];
+    struct libafl_mmio_trace_event *rings;
+    uint32_t mask;
+};
+
+static struct libafl_mmio_trace libafl_mmio_trace;
+
+/*
+ * Device ids outlive a trace session (they are cached in the MemoryRegion),
+ * so the names are kept here as well and copied into every new mapping.
+ * The last id is shared by all regions once the table is full.
+ */
+static char libafl_mmio_trace_names[LIBAFL_MMIO_TRACE_MAX_DEVS]
+                                   [LIBAFL_MMIO_TRACE_NAME_LEN];
+static uint32_t libafl_mmio_trace_num_devices;
+
+target_ulong libafl_tb_insn_pc(uintptr_t host_pc);
+
+/* Called with the iothread lock held */
+static uint16_t libafl_mmio_trace_device(MemoryRegion *mr)
+{
+    struct libafl_mmio_trace *t = &libafl_mmio_trace;
+    uint32_t id;
+
+    if (likely(mr->libafl_trace_id)) {
+        return mr->libafl_trace_id - 1;
+    }
+
+    if (libafl_mmio_trace_num_devices < LIBAFL_MMIO_TRACE_MAX_DEVS - 1) {
+        id = libafl_mmio_trace_num_devices++;
+        pstrcpy(libafl_mmio_trace_names[id], LIBAFL_MMIO_TRACE_NAME_LEN,
+                memory_region_name(mr) ?: "");
+    } else {
+        id = LIBAFL_MMIO_TRACE_MAX_DEVS - 1;
+        pstrcpy(libafl_mmio_trace_names[id], LIBAFL_MMIO_TRACE_NAME_LEN,
+                "<other>");
+        libafl_mmio_trace_num_devices = LIBAFL_MMIO_TRACE_MAX_DEVS;
+    }
+    memcpy(t->names[id], libafl_mmio_trace_names[id],
+           LIBAFL_MMIO_TRACE_NAME_LEN);
+    t->header->num_devices = libafl_mmio_trace_num_devices;
+
+    mr->libafl_trace_id = id + 1;
+    return id;
+}
+
+/* Called with the iothread lock held */
+static void libafl_mmio_trace_record(CPUState *cpu, MemoryRegion *mr,
+                                     hwaddr offset, uint64_t value,
+                                     MemOp op, uintptr_t retaddr,
+                                     uint8_t flags)
+{
+    struct libafl_mmio_trace *t = &libafl_mmio_trace;
+    struct libafl_mmio_trace_event *e;
+    uint64_t head;
+
+    if (unlikely(cpu->cpu_index >= t->header->num_cpus)) {
+        return;
+    }
+
+    head = t->header->heads[cpu->cpu_index];
+    e = &t->rings[(size_t)cpu->cpu_index * t->header->entries +
+                  (head & t->mask)];
+
+    if (t->header->flags & LIBAFL_MMIO_TRACE_ICOUNT) {
+        e->icount = icount_get_raw();
+    } else {
+        e->icount = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    }
+    e->pc = libafl_tb_insn_pc(retaddr);
+    e->offset = offset;
+    e->value = value;
+    e->device = libafl_mmio_trace_device(mr);
+    e->size = memop_size(op);
+    e->flags = flags;
+
+    qatomic_store_release(&t->header->heads[cpu->cpu_index], head + 1);
+}
+
+/*
+ * Start recording into "path", or into an anonymous shared mapping if path
+ * is NULL. "entries" is the per vCPU ring size and is rounded up to a power
+ * of two. Must be called with the vCPUs stopped or the iothread lock held.
+ * Returns 1 on success.
+ */
+int libafl_qemu_mmio_trace_start(const char *path, size_t entries);
+int libafl_qemu_mmio_trace_start(const char *path, size_t entries)
+{
+    struct libafl_mmio_trace *t = &libafl_mmio_trace;
+    struct libafl_mmio_trace_header *h;
+    uint64_t names_offset, rings_offset;
+    uint32_t num_cpus = 0;
+    CPUState *cpu;
+    size_t size;
+    void *map;
+    int fd = -1;
+
+    if (t->map) {
+        error_report("libafl: MMIO trace already running");
+        return 0;
+    }
+    if (entries == 0 || entries > (1U << 31)) {
+        error_report("libafl: invalid MMIO trace ring size %zu", entries);
+        return 0;
+    }
+    entries = pow2ceil(entries);
+
+    CPU_FOREACH(cpu) {
+        num_cpus = MAX(num_cpus, cpu->cpu_index + 1);
+    }
+    num_cpus = MIN(num_cpus, LIBAFL_MMIO_TRACE_MAX_CPUS);
+
+    names_offset = QEMU_ALIGN_UP(sizeof(*h), 64);
+    rings_offset = QEMU_ALIGN_UP(names_offset + sizeof(libafl_mmio_trace_names),
+                                 qemu_real_host_page_size());
+    size = rings_offset +
+           (size_t)num_cpus * entries * sizeof(struct libafl_mmio_trace_event);
+
+    if (path) {
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            error_report("libafl: cannot create MMIO trace %s: %s", path,
+                         strerror(errno));
+            return 0;
+        }
+        if (ftruncate(fd, size) < 0) {
+            error_report("libafl: cannot size MMIO trace %s: %s", path,
+                         strerror(errno));
+            close(fd);
+            return 0;
+        }
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    } else {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+    if (map == MAP_FAILED) {
+        error_report("libafl: cannot map MMIO trace: %s", strerror(errno));
+        return 0;
+    }
+
+    h = map;
+    h->magic = LIBAFL_MMIO_TRACE_MAGIC;
+    h->version = LIBAFL_MMIO_TRACE_VERSION;
+    h->flags = icount_enabled() ? LIBAFL_MMIO_TRACE_ICOUNT : 0;
+    h->num_cpus = num_cpus;
+    h->entries = entries;
+    h->event_size = sizeof(struct libafl_mmio_trace_event);
+    h->num_devices = libafl_mmio_trace_num_devices;
+    h->name_len = LIBAFL_MMIO_TRACE_NAME_LEN;
+    h->names_offset = names_offset;
+    h->rings_offset = rings_offset;
+
+    t->map_size = size;
+    t->header = h;
+    t->names = map + names_offset;
+    t->rings = map + rings_offset;
+    t->mask = entries - 1;
+    memcpy(t->names, libafl_mmio_trace_names, sizeof(libafl_mmio_trace_names));
+
+    /* Enables recording in io_readx() and io_writex() */
+    qatomic_store_release(&t->map, map);
+    return 1;
+}
+
+/* Must be called with the vCPUs stopped or the iothread lock held */
+void libafl_qemu_mmio_trace_stop(void);
+void libafl_qemu_mmio_trace_stop(void)
+{
+    struct libafl_mmio_trace *t = &libafl_mmio_trace;
+    uint8_t *map = t->map;
+
+    if (!map) {
+        return;
+    }
+    qatomic_set(&t->map, NULL);
+    munmap(map, t->map_size);
+    memset(t, 0, sizeof(*t));
+}
+
+/* Returns the mapping of the running trace, for an in-process reader */
+void *libafl_qemu_mmio_trace_buffer(size_t *size);
+void *libafl_qemu_mmio_trace_buffer(size_t *size)
+{
+    *size = libafl_mmio_trace.map_size;
+    return libafl_mmio_trace.map;
+}
+
+//// --- End LibAFL code ---
+
 static uint64_t io_readx(CPUArchState *env, CPUTLBEntryFull *full,
                          int mmu_idx, target_ulong addr, uintptr_t retaddr,
                          MMUAccessType access_type, MemOp op)
@@ -1380,6 +1638,12 @@ static uint64_t io_readx(CPUArchState *env, CPUTLBEntryFull *full,
         cpu_transaction_failed(cpu, physaddr, addr, memop_size(op), access_type,
                                mmu_idx, full->attrs, r, retaddr);
     }
+    //// --- Begin LibAFL code ---
+    if (unlikely(qatomic_read(&libafl_mmio_trace.map))) {
+        libafl_mmio_trace_record(cpu, mr, mr_offset, val, op, retaddr,
+                                 r != MEMTX_OK ? LIBAFL_MMIO_TRACE_FAILED : 0);
+    }
+    //// --- End LibAFL code ---
     if (locked) {
         qemu_mutex_unlock_iothread();
     }
@@ -1441,6 +1705,13 @@ static void io_writex(CPUArchState *env, CPUTLBEntryFull *full,
                                MMU_DATA_STORE, mmu_idx, full->attrs, r,
                                retaddr);
     }
+    //// --- Begin LibAFL code ---
+    if (unlikely(qatomic_read(&libafl_mmio_trace.map))) {
+        libafl_mmio_trace_record(cpu, mr, mr_offset, val, op, retaddr,
+                                 LIBAFL_MMIO_TRACE_WRITE |
+                                 (r != MEMTX_OK ? LIBAFL_MMIO_TRACE_FAILED : 0));
+    }
+    //// --- End LibAFL code ---
     if (locked) {
         qemu_mutex_unlock_iothread();
     }
@@ -62,6 +62,94 @@ static void mttcg_force_rcu(Notifier *notify, void *data)
  * current CPUState for a given thread.
  */
 
+//// --- Begin LibAFL code ---
+
+#define EXCP_LIBAFL_BP 0xf4775747
+
+extern void (*libafl_start_vcpu)(CPUState *cpu);
+
+void libafl_mttcg_cpu_loop(void);
+
+/*
+ * LibAFL under MTTCG
+ *
+ * The thread of the first vCPU runs the harness, like the single thread
+ * does with RR: libafl_start_vcpu() is called on it, and each call to
+ * libafl_cpu_thread_fn() runs the machine until a vCPU stops at a LibAFL
+ * breakpoint. That vCPU parks itself and pokes the harness thread, which
+ * pauses all vCPUs and returns to the harness with current_cpu set to the
+ * vCPU that stopped, as it would be with RR. The next call resumes them.
+ *
+ * Both variables are protected by the iothread lock.
+ */
+static CPUState *libafl_mttcg_bp_cpu;
+static bool libafl_mttcg_paused;
+
+static void libafl_mttcg_notify(CPUState *cpu, run_on_cpu_data data)
+{
+    /* Only queued to get the harness thread out of qemu_wait_io_event() */
+}
+
+static void libafl_mttcg_breakpoint(CPUState *cpu)
+{
+    if (libafl_mttcg_bp_cpu == NULL) {
+        libafl_mttcg_bp_cpu = cpu;
+    }
+    if (cpu != first_cpu) {
+        cpu->stop = true;
+        async_run_on_cpu(first_cpu, libafl_mttcg_notify, RUN_ON_CPU_NULL);
+    }
+}
+
+/* Called on the thread of first_cpu with the iothread lock held */
+void libafl_mttcg_cpu_loop(void)
+{
+    CPUState *cpu = first_cpu;
+
+    current_cpu = cpu;
+    if (libafl_mttcg_paused) {
+        libafl_mttcg_paused = false;
+        libafl_mttcg_bp_cpu = NULL;
+        resume_all_vcpus();
+    }
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            int r;
+            qemu_mutex_unlock_iothread();
+            r = tcg_cpus_exec(cpu);
+            qemu_mutex_lock_iothread();
+            switch (r) {
+            case EXCP_LIBAFL_BP:
+                libafl_mttcg_breakpoint(cpu);
+                break;
+            case EXCP_DEBUG:
+                cpu_handle_guest_debug(cpu);
+                break;
+            case EXCP_ATOMIC:
+                qemu_mutex_unlock_iothread();
+                cpu_exec_step_atomic(cpu);
+                qemu_mutex_lock_iothread();
+                break;
+            default:
+                break;
+            }
+        }
+
+        if (libafl_mttcg_bp_cpu) {
+            pause_all_vcpus();
+            libafl_mttcg_paused = true;
+            current_cpu = libafl_mttcg_bp_cpu;
+            return;
+        }
+
+        qatomic_mb_set(&cpu->exit_request, 0);
+        qemu_wait_io_event(cpu);
+    }
+}
+
+//// --- End LibAFL code ---
+
 static void *mttcg_cpu_thread_fn(void *arg)
 {
     MttcgForceRcuNotifier force_rcu;
@@ -90,6 +178,23 @@ static void *mttcg_cpu_thread_fn(void *arg)
     /* process any pending work */
     cpu->exit_request = 1;
 
+    //// --- Begin LibAFL code ---
+
+    if (cpu == first_cpu) {
+        /* wait for initial kick-off after machine start */
+        while (cpu->stopped) {
+            qemu_cond_wait_iothread(cpu->halt_cond);
+        }
+
+        libafl_start_vcpu(cpu);
+
+        rcu_remove_force_rcu_notifier(&force_rcu.notifier);
+        rcu_unregister_thread();
+        return NULL;
+    }
+
+    //// --- End LibAFL code ---
+
     do {
         if (cpu_can_run(cpu)) {
             int r;
@@ -100,9 +205,8 @@ static void *mttcg_cpu_thread_fn(void *arg)
 
 //// --- Begin LibAFL code ---
 
-#define EXCP_LIBAFL_BP 0xf4775747
-
             case EXCP_LIBAFL_BP:
+                libafl_mttcg_breakpoint(cpu);
                 break;
 
 //// --- End LibAFL code ---
@@ -151,8 +151,201 @@ static void default_libafl_start_vcpu(CPUState *cpu) {
 
 void (*libafl_start_vcpu)(CPUState *cpu) = default_libafl_start_vcpu;
 
+struct libafl_fast_snapshot;
+struct libafl_fast_snapshot *libafl_qemu_fast_snapshot_new(void);
+void libafl_qemu_fast_snapshot_restore(struct libafl_fast_snapshot *snapshot);
+void libafl_qemu_fast_snapshot_free(struct libafl_fast_snapshot *snapshot);
+
+size_t libafl_qemu_cpu_state_size(CPUState* cpu);
+size_t libafl_qemu_save_cpu_state(CPUState* cpu, void* buf);
+int libafl_qemu_restore_cpu_state(CPUState* cpu, const void* buf);
+
+size_t libafl_qemu_set_hook(target_ulong pc, void (*callback)(target_ulong, uint64_t),
+                            uint64_t data, int invalidate);
+int libafl_qemu_remove_hook(size_t num, int invalidate);
+
+extern int libafl_qemu_fork_child;
+
+/*
+ * A fork server child has no main loop thread, so do its job here: run
+ * the bottom halves and timers that became due while the vCPU executed.
+ */
+static void libafl_fork_child_poll(void)
+{
+    aio_bh_poll(qemu_get_aio_context());
+    qemu_clock_run_all_timers();
+}
+
+/*
+ * Persistent mode.
+ *
+ * The first time the guest reaches start_pc, memory, devices and the CPU
+ * are snapshotted. Every time it reaches exit_pc they are rolled back and
+ * the guest re-runs from start_pc, without returning from
+ * libafl_cpu_thread_fn. After the rollback input_ready is called to place
+ * the next input. Returning 0 from it hands control back to the fuzzer as
+ * a breakpoint at start_pc, in the restored state, so the fuzzer can place
+ * an input itself and resume.
+ *
+ * Runs are grouped in batches of "iterations" runs (0 for no limit). At
+ * the end of a batch control goes back to the fuzzer as a normal
+ * breakpoint at exit_pc, with the state the last run ended in. Resuming
+ * from there starts the next batch.
+ */
+
+#define LIBAFL_PERSISTENT_HIT_NONE 0
+#define LIBAFL_PERSISTENT_HIT_START 1
+#define LIBAFL_PERSISTENT_HIT_EXIT 2
+
+struct libafl_persistent {
+    int (*input_ready)(CPUState* cpu, uint64_t data);
+    uint64_t data;
+    target_ulong start_pc;
+    target_ulong exit_pc;
+    uint64_t iterations;
+    uint64_t done;
+    /* Runs completed in the current batch */
+    uint64_t batch_done;
+    size_t start_hook;
+    size_t exit_hook;
+    int start_hooked;
+    int active;
+    int hit;
+    struct libafl_fast_snapshot* snapshot;
+    void* cpu_state;
+};
+
+static struct libafl_persistent libafl_persistent;
+
+int libafl_qemu_set_persistent(int (*input_ready)(CPUState* cpu, uint64_t data),
+                               target_ulong start_pc, target_ulong exit_pc,
+                               uint64_t iterations, uint64_t data);
+void libafl_qemu_clear_persistent(void);
+uint64_t libafl_qemu_persistent_iterations(void);
+
+static void libafl_persistent_start_hook(target_ulong pc, uint64_t data)
+{
+    libafl_persistent.hit = LIBAFL_PERSISTENT_HIT_START;
+    current_cpu->exception_index = EXCP_LIBAFL_BP;
+    /* The snapshot needs the exact state at start_pc */
+    cpu_loop_exit_restore(current_cpu, GETPC());
+}
+
+static void libafl_persistent_exit_hook(target_ulong pc, uint64_t data)
+{
+    libafl_persistent.hit = LIBAFL_PERSISTENT_HIT_EXIT;
+    current_cpu->exception_index = EXCP_LIBAFL_BP;
+    cpu_loop_exit_restore(current_cpu, GETPC());
+}
+
+int libafl_qemu_set_persistent(int (*input_ready)(CPUState* cpu, uint64_t data),
+                               target_ulong start_pc, target_ulong exit_pc,
+                               uint64_t iterations, uint64_t data)
+{
+    if (libafl_qemu_cpu_state_size(first_cpu) == 0) {
+        return 0;
+    }
+
+    /* The restart loop lives in the RR vCPU loop */
+    if (qemu_tcg_mttcg_enabled()) {
+        return 0;
+    }
+
+    libafl_qemu_clear_persistent();
+
+    libafl_persistent.input_ready = input_ready;
+    libafl_persistent.data = data;
+    libafl_persistent.start_pc = start_pc;
+    libafl_persistent.exit_pc = exit_pc;
+    libafl_persistent.iterations = iterations;
+    libafl_persistent.done = 0;
+    libafl_persistent.batch_done = 0;
+    libafl_persistent.start_hook = libafl_qemu_set_hook(start_pc,
+        libafl_persistent_start_hook, 0, 1);
+    libafl_persistent.start_hooked = 1;
+    libafl_persistent.exit_hook = libafl_qemu_set_hook(exit_pc,
+        libafl_persistent_exit_hook, 0, 1);
+    libafl_persistent.active = 1;
+    return 1;
+}
+
+void libafl_qemu_clear_persistent(void)
+{
+    if (!libafl_persistent.active) {
+        return;
+    }
+
+    if (libafl_persistent.start_hooked) {
+        libafl_qemu_remove_hook(libafl_persistent.start_hook, 1);
+        libafl_persistent.start_hooked = 0;
+    }
+    libafl_qemu_remove_hook(libafl_persistent.exit_hook, 1);
+
+    if (libafl_persistent.snapshot) {
+        libafl_qemu_fast_snapshot_free(libafl_persistent.snapshot);
+        libafl_persistent.snapshot = NULL;
+    }
+    free(libafl_persistent.cpu_state);
+    libafl_persistent.cpu_state = NULL;
+
+    libafl_persistent.hit = LIBAFL_PERSISTENT_HIT_NONE;
+    libafl_persistent.active = 0;
+}
+
+/* Number of runs completed in persistent mode since it was set */
+uint64_t libafl_qemu_persistent_iterations(void)
+{
+    return libafl_persistent.done;
+}
+
+/*
+ * Called with the iothread lock held after EXCP_LIBAFL_BP. Returns true
+ * if the CPU was set up for another run and should be resumed in place.
+ */
+static bool libafl_persistent_step(CPUState *cpu)
+{
+    struct libafl_persistent* p = &libafl_persistent;
+    int hit = p->hit;
+
+    p->hit = LIBAFL_PERSISTENT_HIT_NONE;
+    if (!p->active || hit == LIBAFL_PERSISTENT_HIT_NONE) {
+        return false;
+    }
+
+    if (hit == LIBAFL_PERSISTENT_HIT_START) {
+        p->snapshot = libafl_qemu_fast_snapshot_new();
+        p->cpu_state = malloc(libafl_qemu_cpu_state_size(cpu));
+        libafl_qemu_save_cpu_state(cpu, p->cpu_state);
+        /* Runs restart exactly at start_pc, don't trap there again */
+        libafl_qemu_remove_hook(p->start_hook, 1);
+        p->start_hooked = 0;
+    } else {
+        if (p->snapshot == NULL) {
+            return false;
+        }
+        p->done++;
+        p->batch_done++;
+        if (p->iterations && p->batch_done >= p->iterations) {
+            /* Leave the state of the last run to the fuzzer */
+            p->batch_done = 0;
+            return false;
+        }
+        libafl_qemu_fast_snapshot_restore(p->snapshot);
+        libafl_qemu_restore_cpu_state(cpu, p->cpu_state);
+    }
+
+    return p->input_ready(cpu, p->data) != 0;
+}
+
+void libafl_mttcg_cpu_loop(void);
+
 void libafl_cpu_thread_fn(CPUState *cpu)
 {
+    if (qemu_tcg_mttcg_enabled()) {
+        libafl_mttcg_cpu_loop();
+        return;
+    }
+
     rr_start_kick_timer();
     
     while (1) {
@@ -197,8 +390,15 @@ void libafl_cpu_thread_fn(CPUState *cpu)
                 }
                 qemu_mutex_lock_iothread();
 
+                if (libafl_qemu_fork_child) {
+                    libafl_fork_child_poll();
+                }
+
                 // TODO(libafl) should we have the iothread lock on?
                 if (r == EXCP_LIBAFL_BP) {
+                    if (libafl_persistent_step(cpu)) {
+                        continue;
+                    }
                     rr_stop_kick_timer();
                     return;
                 }
@@ -86,7 +86,8 @@ static bool default_mttcg_enabled(void)
 
 //// --- Begin LibAFL code ---
 
-    // Only the RR ops works with libafl_qemu, so avoid MTTCG by default
+    // RR stays the default. MTTCG (-accel tcg,thread=multi) runs the
+    // harness on the first vCPU thread, see tcg-accel-ops-mttcg.c
     return false;
 
 //// --- End LibAFL code ---
@@ -83,6 +83,348 @@ void libafl_load_qemu_snapshot(char *name)
     aio_bh_schedule_oneshot_full(qemu_get_aio_context(), load_snapshot_cb, (void*)name, "load_snapshot");
 }
 
+/*
+ * Fast in-memory snapshots.
+ *
+ * Unlike the named snapshots above, these never leave the process: every
+ * RAMBlock is copied once into a pristine buffer and the device state is
+ * serialized into a flat buffer. On restore only the pages marked in the
+ * DIRTY_MEMORY_MIGRATION bitmap since the last save/restore are copied back.
+ * Must be called from the vCPU thread with the iothread lock held, i.e. while
+ * the CPU is parked after EXCP_LIBAFL_BP.
+ */
+
+#include "exec/memory.h"
+#include "exec/ram_addr.h"
+#include "qemu/cutils.h"
+#include "io/channel-buffer.h"
+#include "migration/qemu-file.h"
+#include "migration/savevm.h"
+
+#define LIBAFL_DEV_STATE_BASE_SIZE (64 * 1024)
+
+struct libafl_ram_snapshot {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    ram_addr_t used_length;
+    uint8_t *pristine;
+};
+
+struct libafl_fast_snapshot {
+    struct libafl_ram_snapshot *blocks;
+    size_t num_blocks;
+    uint8_t *dev_state;
+    size_t dev_state_len;
+};
+
+/* The snapshot the dirty bitmap is currently relative to */
+static struct libafl_fast_snapshot *libafl_fast_snapshot_current = NULL;
+
+struct libafl_fast_snapshot *libafl_qemu_fast_snapshot_new(void);
+void libafl_qemu_fast_snapshot_restore(struct libafl_fast_snapshot *snapshot);
+void libafl_qemu_fast_snapshot_free(struct libafl_fast_snapshot *snapshot);
+
+static void libafl_fast_snapshot_save_ram(struct libafl_fast_snapshot *snapshot)
+{
+    RAMBlock *rb;
+    size_t i = 0;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH(rb) {
+        snapshot->num_blocks++;
+    }
+    snapshot->blocks = g_new0(struct libafl_ram_snapshot, snapshot->num_blocks);
+
+    RAMBLOCK_FOREACH(rb) {
+        struct libafl_ram_snapshot *rs = &snapshot->blocks[i++];
+        uint8_t *host = qemu_map_ram_ptr(rb, 0);
+        ram_addr_t off;
+
+        rs->rb = rb;
+        rs->offset = rb->offset;
+        rs->used_length = rb->used_length;
+        /* Untouched zero pages of the copy stay unbacked */
+        rs->pristine = g_malloc0(rs->used_length);
+        for (off = 0; off < rs->used_length; off += TARGET_PAGE_SIZE) {
+            size_t len = MIN(TARGET_PAGE_SIZE, rs->used_length - off);
+            if (!buffer_is_zero(host + off, len)) {
+                memcpy(rs->pristine + off, host + off, len);
+            }
+        }
+        cpu_physical_memory_test_and_clear_dirty(rs->offset, rs->used_length,
+                                                 DIRTY_MEMORY_MIGRATION);
+    }
+}
+
+static void libafl_fast_snapshot_restore_block(struct libafl_ram_snapshot *rs,
+                                               bool full)
+{
+    DirtyMemoryBlocks *blocks;
+    uint8_t *host = qemu_map_ram_ptr(rs->rb, 0);
+    unsigned long page, end;
+
+    blocks = qatomic_rcu_read(&ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION]);
+
+    page = rs->offset >> TARGET_PAGE_BITS;
+    end = TARGET_PAGE_ALIGN(rs->offset + rs->used_length) >> TARGET_PAGE_BITS;
+
+    while (page < end) {
+        unsigned long idx = page / DIRTY_MEMORY_BLOCK_SIZE;
+        unsigned long first = page % DIRTY_MEMORY_BLOCK_SIZE;
+        unsigned long last = first + MIN(end - page,
+                                         DIRTY_MEMORY_BLOCK_SIZE - first);
+        unsigned long bit = full ? first
+                                 : find_next_bit(blocks->blocks[idx], last, first);
+
+        while (bit < last) {
+            ram_addr_t addr = (idx * DIRTY_MEMORY_BLOCK_SIZE + bit)
+                              << TARGET_PAGE_BITS;
+            ram_addr_t rel = addr - rs->offset;
+            size_t len = MIN(TARGET_PAGE_SIZE, rs->used_length - rel);
+
+            memcpy(host + rel, rs->pristine + rel, len);
+            /* TBs translated from the modified page are stale now */
+            if (!cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_CODE)) {
+                tb_invalidate_phys_range(addr, addr + len);
+            }
+
+            bit = full ? bit + 1
+                       : find_next_bit(blocks->blocks[idx], last, bit + 1);
+        }
+        page += last - first;
+    }
+
+    cpu_physical_memory_test_and_clear_dirty(rs->offset, rs->used_length,
+                                             DIRTY_MEMORY_MIGRATION);
+}
+
+static void libafl_fast_snapshot_save_devices(struct libafl_fast_snapshot *snapshot)
+{
+    QIOChannelBuffer *bioc = qio_channel_buffer_new(LIBAFL_DEV_STATE_BASE_SIZE);
+    QEMUFile *f = qemu_file_new_output(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    if (qemu_save_device_state(f) < 0) {
+        error_report("Could not save device state for the fast snapshot");
+    }
+    qemu_fflush(f);
+
+    snapshot->dev_state_len = bioc->usage;
+    snapshot->dev_state = g_memdup2(bioc->data, bioc->usage);
+    qemu_fclose(f);
+}
+
+static void libafl_fast_snapshot_restore_devices(struct libafl_fast_snapshot *snapshot)
+{
+    QIOChannelBuffer *bioc = qio_channel_buffer_new(snapshot->dev_state_len);
+    QEMUFile *f;
+
+    memcpy(bioc->data, snapshot->dev_state, snapshot->dev_state_len);
+    bioc->usage = snapshot->dev_state_len;
+    f = qemu_file_new_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    /* qemu_save_device_state writes a file header qemu_load_device_state skips */
+    qemu_get_be32(f); /* QEMU_VM_FILE_MAGIC */
+    qemu_get_be32(f); /* QEMU_VM_FILE_VERSION */
+    if (qemu_load_device_state(f) < 0) {
+        error_report("Could not restore device state from the fast snapshot");
+    }
+    qemu_fclose(f);
+}
+
+struct libafl_fast_snapshot *libafl_qemu_fast_snapshot_new(void)
+{
+    struct libafl_fast_snapshot *snapshot = g_new0(struct libafl_fast_snapshot, 1);
+
+    /* Make DMA writes (e.g. by the CCP) show up in the dirty bitmap as well */
+    memory_global_dirty_log_start(GLOBAL_DIRTY_LIBAFL);
+
+    libafl_fast_snapshot_save_ram(snapshot);
+    libafl_fast_snapshot_save_devices(snapshot);
+
+    libafl_fast_snapshot_current = snapshot;
+    return snapshot;
+}
+
+void libafl_qemu_fast_snapshot_restore(struct libafl_fast_snapshot *snapshot)
+{
+    /* The dirty bitmap only describes changes since the current snapshot */
+    bool full = snapshot != libafl_fast_snapshot_current;
+    size_t i;
+
+    memory_global_dirty_log_start(GLOBAL_DIRTY_LIBAFL);
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        for (i = 0; i < snapshot->num_blocks; i++) {
+            libafl_fast_snapshot_restore_block(&snapshot->blocks[i], full);
+        }
+    }
+
+    libafl_fast_snapshot_restore_devices(snapshot);
+
+    libafl_fast_snapshot_current = snapshot;
+}
+
+void libafl_qemu_fast_snapshot_free(struct libafl_fast_snapshot *snapshot)
+{
+    size_t i;
+
+    if (snapshot == libafl_fast_snapshot_current) {
+        libafl_fast_snapshot_current = NULL;
+        memory_global_dirty_log_stop(GLOBAL_DIRTY_LIBAFL);
+    }
+
+    for (i = 0; i < snapshot->num_blocks; i++) {
+        g_free(snapshot->blocks[i].pristine);
+    }
+    g_free(snapshot->blocks);
+    g_free(snapshot->dev_state);
+    g_free(snapshot);
+}
+
+/*
+ * Fork server.
+ *
+ * Once the firmware has booted up to a breakpoint, the parked vCPU thread
+ * can fork one child per input. Guest RAM and the translated code are
+ * private anonymous mappings, so the kernel shares them copy-on-write and
+ * every child starts from the same post-boot state.
+ *
+ * Only the vCPU thread survives fork(), so everything that runs elsewhere
+ * is quiesced first:
+ *  - devices registered with libafl_qemu_add_fork_notifier() finish the
+ *    jobs they handed to other threads;
+ *  - the thread pool of the main loop is torn down, both processes create
+ *    a new one on the next submission;
+ *  - the clocks are disabled, which waits for timer callbacks running in
+ *    other threads, and enabled again after fork().
+ * The parked vCPU holds the iothread lock, so the main loop thread is then
+ * either polling or waiting for the lock. The child does not use the main
+ * loop at all: the vCPU thread runs expired timers and bottom halves itself
+ * (see libafl_cpu_thread_fn), and the call_rcu thread is recreated by the
+ * RCU atfork handlers.
+ */
+
+#include "qemu/madvise.h"
+#include "qemu/error-report.h"
+#include "qemu/notify.h"
+#include "block/aio.h"
+#include "block/thread-pool.h"
+
+int libafl_qemu_fork_child = 0;
+
+static NotifierList libafl_fork_notifiers =
+    NOTIFIER_LIST_INITIALIZER(libafl_fork_notifiers);
+
+void libafl_qemu_add_fork_notifier(Notifier *n);
+int libafl_qemu_fork_server_prepare(void);
+pid_t libafl_qemu_fork(void);
+
+/*
+ * Notified from the vCPU thread with the iothread lock held, before each
+ * fork(). Devices must finish all their work in other threads.
+ */
+void libafl_qemu_add_fork_notifier(Notifier *n)
+{
+    notifier_list_add(&libafl_fork_notifiers, n);
+}
+
+static void libafl_fork_quiesce(void)
+{
+    AioContext *ctx = qemu_get_aio_context();
+    QEMUClockType type;
+
+    notifier_list_notify(&libafl_fork_notifiers, NULL);
+
+    /* The workers would be gone in the child, with the pool still
+     * counting them. Nothing is queued once the notifiers returned.
+     */
+    thread_pool_free(ctx->thread_pool);
+    ctx->thread_pool = NULL;
+
+    /* The fork server runs with the VM running, so all clocks are on */
+    for (type = 0; type < QEMU_CLOCK_MAX; type++) {
+        qemu_clock_enable(type, false);
+    }
+}
+
+static void libafl_fork_resume(void)
+{
+    QEMUClockType type;
+
+    for (type = 0; type < QEMU_CLOCK_MAX; type++) {
+        qemu_clock_enable(type, true);
+    }
+}
+
+int libafl_qemu_fork_server_prepare(void)
+{
+    static int prepared = 0;
+    RAMBlock *rb;
+
+    if (prepared) {
+        return 1;
+    }
+
+    /* A child only keeps the thread that forked, not the other vCPUs */
+    if (qemu_tcg_mttcg_enabled() && first_cpu && CPU_NEXT(first_cpu)) {
+        error_report("libafl: fork server does not work with several MTTCG "
+                     "vCPUs");
+        return 0;
+    }
+
+    /* Children would write through to the parent's code buffer */
+    if (tcg_splitwx_diff) {
+        error_report("libafl: fork server does not work with split w^x TCG");
+        return 0;
+    }
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH(rb) {
+            if (!rb->host) {
+                continue;
+            }
+            /* Writes to shared memory would leak into the parent */
+            if (qemu_ram_is_shared(rb)) {
+                error_report("libafl: fork server needs private guest RAM, "
+                             "%s is shared", qemu_ram_get_idstr(rb));
+                return 0;
+            }
+            /* Undo the MADV_DONTFORK set up for KVM in ram_block_add() */
+            qemu_madvise(rb->host, rb->max_length, QEMU_MADV_DOFORK);
+        }
+    }
+
+    /* qemu_init() disables these, see tests/qtest/fuzz/fuzz.c */
+    rcu_enable_atfork();
+
+    prepared = 1;
+    return 1;
+}
+
+/*
+ * Must be called from the parked vCPU thread with the iothread lock held.
+ * Returns like fork(); in the child the vCPU can be resumed right away.
+ */
+pid_t libafl_qemu_fork(void)
+{
+    pid_t pid;
+
+    if (!libafl_qemu_fork_server_prepare()) {
+        return -1;
+    }
+
+    libafl_fork_quiesce();
+    pid = fork();
+    if (pid == 0) {
+        libafl_qemu_fork_child = 1;
+    }
+    libafl_fork_resume();
+    return pid;
+}
+
 #endif
 
 #define EXCP_LIBAFL_BP 0xf4775747
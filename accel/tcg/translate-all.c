@@ -68,8 +68,43 @@
 #include "tcg/tcg-op.h"
 #include "tcg/tcg-internal.h"
 #include "exec/helper-head.h"
+#include "qemu/error-report.h"
+#include "qemu/madvise.h"
+#include "qemu/thread.h"
 
-target_ulong libafl_gen_cur_pc;
+/* Guest pc of the instruction being translated by this thread */
+__thread target_ulong libafl_gen_cur_pc;
+
+/*
+ * Bumped whenever the set of instrumentation hooks changes. TBs translated
+ * under an older generation are dropped lazily when next looked up, see
+ * tb_lookup(), instead of flushing the whole code cache. Chained TBs never
+ * go through tb_lookup(), so every bump also unlinks all direct jumps and
+ * clears the jump caches, see libafl_unlink_tbs().
+ */
+uint32_t libafl_hook_generation;
+static bool libafl_unlink_pending;
+
+static void libafl_unlink_tbs(CPUState *cpu, run_on_cpu_data data);
+
+void libafl_invalidate_hooks(void);
+void libafl_invalidate_hooks(void)
+{
+    CPUState *cpu = current_cpu ? current_cpu : first_cpu;
+
+    qatomic_inc(&libafl_hook_generation);
+
+    /* No vCPU yet means no TB yet; one unlink covers a burst of bumps */
+    if (!tcg_enabled() || !cpu || qatomic_xchg(&libafl_unlink_pending, true)) {
+        return;
+    }
+
+    if (cpu_in_exclusive_context(cpu)) {
+        libafl_unlink_tbs(cpu, RUN_ON_CPU_NULL);
+    } else {
+        async_safe_run_on_cpu(cpu, libafl_unlink_tbs, RUN_ON_CPU_NULL);
+    }
+}
 
 void libafl_helper_table_add(TCGHelperInfo* info);
 TranslationBlock *libafl_gen_edge(CPUState *cpu, target_ulong src_block,
@@ -80,9 +115,32 @@ void libafl_gen_read(TCGv addr, MemOp ot);
 void libafl_gen_read_N(TCGv addr, size_t size);
 void libafl_gen_write(TCGv addr, MemOp ot);
 void libafl_gen_write_N(TCGv addr, size_t size);
+void libafl_gen_shadow_check(TCGv addr, MemOp ot, bool is_write);
 void libafl_gen_cmp(target_ulong pc, TCGv op0, TCGv op1, MemOp ot);
 void libafl_gen_backdoor(target_ulong pc);
 
+/*
+ * The hook lists below are only ever prepended to. With MTTCG every vCPU
+ * thread walks them while translating, without a lock, while the harness
+ * may add hooks. A hook is therefore set up completely, helpers included,
+ * before it is published, and readers use qatomic_rcu_read. Hooks are never
+ * removed, so there is nothing to reclaim. Writers serialize on
+ * libafl_gen_hooks_lock.
+ */
+static QemuMutex libafl_gen_hooks_lock;
+
+static void __attribute__((__constructor__)) libafl_gen_hooks_init(void)
+{
+    qemu_mutex_init(&libafl_gen_hooks_lock);
+}
+
+#define LIBAFL_PUBLISH_HOOK(head, hook) do {        \
+        qemu_mutex_lock(&libafl_gen_hooks_lock);    \
+        (hook)->next = (head);                      \
+        qatomic_rcu_set(&(head), (hook));           \
+        qemu_mutex_unlock(&libafl_gen_hooks_lock);  \
+    } while (0)
+
 static TCGHelperInfo libafl_exec_edge_hook_info = {
     .func = NULL, .name = "libafl_exec_edge_hook", \
     .flags = dh_callflag(void), \
@@ -93,7 +151,6 @@ struct libafl_edge_hook {
     uint64_t (*gen)(target_ulong src, target_ulong dst, uint64_t data);
     void (*exec)(uint64_t id, uint64_t data);
     uint64_t data;
-    uint64_t cur_id;
     TCGHelperInfo helper_info;
     struct libafl_edge_hook* next;
 };
@@ -107,23 +164,82 @@ void libafl_add_edge_hook(uint64_t (*gen)(target_ulong src, target_ulong dst, ui
                           void (*exec)(uint64_t id, uint64_t data),
                           uint64_t data)
 {
-    CPUState *cpu;
-    CPU_FOREACH(cpu) {
-        tb_flush(cpu);
-    }
-
     struct libafl_edge_hook* hook = malloc(sizeof(struct libafl_edge_hook));
     hook->gen = gen;
     hook->exec = exec;
     hook->data = data;
-    hook->next = libafl_edge_hooks;
-    libafl_edge_hooks = hook;
     
     if (exec) {
         memcpy(&hook->helper_info, &libafl_exec_edge_hook_info, sizeof(TCGHelperInfo));
         hook->helper_info.func = exec;
         libafl_helper_table_add(&hook->helper_info);
     }
+
+    LIBAFL_PUBLISH_HOOK(libafl_edge_hooks, hook);
+    libafl_invalidate_hooks();
+}
+
+struct libafl_edge_map_hook {
+    uint64_t (*gen)(target_ulong src, target_ulong dst, uint64_t data);
+    uint8_t *map;
+    size_t map_size;
+    int neverzero;
+    uint64_t data;
+    struct libafl_edge_map_hook* next;
+};
+
+struct libafl_edge_map_hook* libafl_edge_map_hooks;
+
+/*
+ * Ids the gen callbacks returned for the edge this thread translates, in
+ * list order, edge hooks first
+ */
+static __thread uint64_t* libafl_edge_ids;
+static __thread size_t libafl_edge_ids_size;
+
+/*
+ * Coverage map hook: the hit counter at map[gen(src, dst) % map_size] is
+ * incremented by TCG ops inlined in the edge TB, without any helper call.
+ * When gen is NULL the index is derived from the edge addresses.
+ */
+void libafl_add_edge_map_hook(uint64_t (*gen)(target_ulong src, target_ulong dst, uint64_t data),
+                              uint8_t *map, size_t map_size, int neverzero,
+                              uint64_t data);
+void libafl_add_edge_map_hook(uint64_t (*gen)(target_ulong src, target_ulong dst, uint64_t data),
+                              uint8_t *map, size_t map_size, int neverzero,
+                              uint64_t data)
+{
+    assert(map != NULL && map_size != 0);
+
+    struct libafl_edge_map_hook* hook = malloc(sizeof(struct libafl_edge_map_hook));
+    hook->gen = gen;
+    hook->map = map;
+    hook->map_size = map_size;
+    hook->neverzero = neverzero;
+    hook->data = data;
+
+    LIBAFL_PUBLISH_HOOK(libafl_edge_map_hooks, hook);
+    libafl_invalidate_hooks();
+}
+
+static void libafl_gen_edge_map_inc(struct libafl_edge_map_hook* hook,
+                                    uint64_t cur_id)
+{
+    TCGv_ptr ptr = tcg_constant_ptr(hook->map + (cur_id % hook->map_size));
+    TCGv_i32 cnt = tcg_temp_new_i32();
+
+    tcg_gen_ld8u_i32(cnt, ptr, 0);
+    tcg_gen_addi_i32(cnt, cnt, 1);
+    if (hook->neverzero) {
+        /* Add the carry out of the byte so the counter skips 0 on wrap */
+        TCGv_i32 carry = tcg_temp_new_i32();
+        tcg_gen_shri_i32(carry, cnt, 8);
+        tcg_gen_add_i32(cnt, cnt, carry);
+        tcg_temp_free_i32(carry);
+    }
+    tcg_gen_st8_i32(cnt, ptr, 0);
+
+    tcg_temp_free_i32(cnt);
 }
 
 static TCGHelperInfo libafl_exec_block_hook_info = {
@@ -149,23 +265,19 @@ void libafl_add_block_hook(uint64_t (*gen)(target_ulong pc, uint64_t data),
                            void (*exec)(uint64_t id, uint64_t data),
                            uint64_t data)
 {
-    CPUState *cpu;
-    CPU_FOREACH(cpu) {
-        tb_flush(cpu);
-    }
-
     struct libafl_block_hook* hook = malloc(sizeof(struct libafl_block_hook));
     hook->gen = gen;
     hook->exec = exec;
     hook->data = data;
-    hook->next = libafl_block_hooks;
-    libafl_block_hooks = hook;
     
     if (exec) {
         memcpy(&hook->helper_info, &libafl_exec_block_hook_info, sizeof(TCGHelperInfo));
         hook->helper_info.func = exec;
         libafl_helper_table_add(&hook->helper_info);
     }
+
+    LIBAFL_PUBLISH_HOOK(libafl_block_hooks, hook);
+    libafl_invalidate_hooks();
 }
 
 static TCGHelperInfo libafl_exec_read_hook1_info = {
@@ -221,6 +333,12 @@ static TCGHelperInfo libafl_exec_write_hookN_info = {
                 | dh_typemask(i64, 3)
 };
 
+/* Half-open guest address range [start, end) */
+struct libafl_addr_range {
+    target_ulong start;
+    target_ulong end;
+};
+
 struct libafl_rw_hook {
     uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data);
     void (*exec1)(uint64_t id, target_ulong addr, uint64_t data);
@@ -234,31 +352,22 @@ struct libafl_rw_hook {
     TCGHelperInfo helper_info4;
     TCGHelperInfo helper_info8;
     TCGHelperInfo helper_infoN;
+    struct libafl_addr_range* ranges;
+    size_t num_ranges;
+    bool filtered;
     struct libafl_rw_hook* next;
 };
 
 struct libafl_rw_hook* libafl_read_hooks;
 
-void libafl_add_read_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data),
-                         void (*exec1)(uint64_t id, target_ulong addr, uint64_t data),
-                         void (*exec2)(uint64_t id, target_ulong addr, uint64_t data),
-                         void (*exec4)(uint64_t id, target_ulong addr, uint64_t data),
-                         void (*exec8)(uint64_t id, target_ulong addr, uint64_t data),
-                         void (*execN)(uint64_t id, target_ulong addr, size_t size, uint64_t data),
-                         uint64_t data);
-void libafl_add_read_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data),
-                         void (*exec1)(uint64_t id, target_ulong addr, uint64_t data),
-                         void (*exec2)(uint64_t id, target_ulong addr, uint64_t data),
-                         void (*exec4)(uint64_t id, target_ulong addr, uint64_t data),
-                         void (*exec8)(uint64_t id, target_ulong addr, uint64_t data),
-                         void (*execN)(uint64_t id, target_ulong addr, size_t size, uint64_t data),
-                         uint64_t data)
+static struct libafl_rw_hook* libafl_new_read_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data),
+                                                   void (*exec1)(uint64_t id, target_ulong addr, uint64_t data),
+                                                   void (*exec2)(uint64_t id, target_ulong addr, uint64_t data),
+                                                   void (*exec4)(uint64_t id, target_ulong addr, uint64_t data),
+                                                   void (*exec8)(uint64_t id, target_ulong addr, uint64_t data),
+                                                   void (*execN)(uint64_t id, target_ulong addr, size_t size, uint64_t data),
+                                                   uint64_t data)
 {
-    CPUState *cpu;
-    CPU_FOREACH(cpu) {
-        tb_flush(cpu);
-    }
-
     struct libafl_rw_hook* hook = malloc(sizeof(struct libafl_rw_hook));
     hook->gen = gen;
     hook->exec1 = exec1;
@@ -267,8 +376,9 @@ void libafl_add_read_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t
     hook->exec8 = exec8;
     hook->execN = execN;
     hook->data = data;
-    hook->next = libafl_read_hooks;
-    libafl_read_hooks = hook;
+    hook->ranges = NULL;
+    hook->num_ranges = 0;
+    hook->filtered = false;
     
     if (exec1) {
         memcpy(&hook->helper_info1, &libafl_exec_read_hook1_info, sizeof(TCGHelperInfo));
@@ -295,6 +405,225 @@ void libafl_add_read_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t
         hook->helper_infoN.func = execN;
         libafl_helper_table_add(&hook->helper_infoN);
     }
+
+    return hook;
+}
+
+void libafl_add_read_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data),
+                          void (*exec1)(uint64_t id, target_ulong addr, uint64_t data),
+                          void (*exec2)(uint64_t id, target_ulong addr, uint64_t data),
+                          void (*exec4)(uint64_t id, target_ulong addr, uint64_t data),
+                          void (*exec8)(uint64_t id, target_ulong addr, uint64_t data),
+                          void (*execN)(uint64_t id, target_ulong addr, size_t size, uint64_t data),
+                          uint64_t data);
+void libafl_add_read_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data),
+                          void (*exec1)(uint64_t id, target_ulong addr, uint64_t data),
+                          void (*exec2)(uint64_t id, target_ulong addr, uint64_t data),
+                          void (*exec4)(uint64_t id, target_ulong addr, uint64_t data),
+                          void (*exec8)(uint64_t id, target_ulong addr, uint64_t data),
+                          void (*execN)(uint64_t id, target_ulong addr, size_t size, uint64_t data),
+                          uint64_t data)
+{
+    struct libafl_rw_hook* hook = libafl_new_read_hook(gen, exec1, exec2, exec4,
+                                                       exec8, execN, data);
+
+    LIBAFL_PUBLISH_HOOK(libafl_read_hooks, hook);
+    libafl_invalidate_hooks();
+}
+
+/*
+ * Temps of kind TEMP_NORMAL die at every branch and label, but the
+ * translator that called us may still read them after the memory op.
+ * Labels created for the inline checks are recorded per translation, and
+ * once the guest code is translated libafl_scope_inline_branches promotes
+ * only the normal temps whose value is read across one of them.
+ */
+#define LIBAFL_INLINE_LABELS_MAX (1 << 14)
+
+static __thread DECLARE_BITMAP(libafl_inline_labels, LIBAFL_INLINE_LABELS_MAX);
+static __thread bool libafl_inline_labels_used;
+
+static TCGLabel* libafl_gen_inline_label(void)
+{
+    TCGLabel* l = gen_new_label();
+
+    set_bit(l->id, libafl_inline_labels);
+    libafl_inline_labels_used = true;
+    return l;
+}
+
+static void libafl_reset_inline_labels(void)
+{
+    if (libafl_inline_labels_used) {
+        bitmap_zero(libafl_inline_labels, LIBAFL_INLINE_LABELS_MAX);
+        libafl_inline_labels_used = false;
+    }
+}
+
+static TCGLabel* libafl_op_label(TCGOp* op)
+{
+    switch (op->opc) {
+    case INDEX_op_set_label:
+    case INDEX_op_br:
+        return arg_label(op->args[0]);
+    case INDEX_op_brcond_i32:
+    case INDEX_op_brcond_i64:
+        return arg_label(op->args[3]);
+    case INDEX_op_brcond2_i32:
+        return arg_label(op->args[5]);
+    default:
+        return NULL;
+    }
+}
+
+static void libafl_scope_inline_branches(TCGContext* s)
+{
+    /* Segment of the last reference to each temp, 0 if not referenced */
+    uint32_t* seen;
+    uint32_t seg = 1;
+    TCGOp* op;
+    int i;
+
+    if (!libafl_inline_labels_used) {
+        return;
+    }
+
+    seen = tcg_malloc(s->nb_temps * sizeof(uint32_t));
+    memset(seen, 0, s->nb_temps * sizeof(uint32_t));
+
+    QTAILQ_FOREACH(op, &s->ops, link) {
+        TCGLabel* l = libafl_op_label(op);
+        int nb_oargs, nb_iargs;
+
+        if (op->opc == INDEX_op_call) {
+            nb_oargs = TCGOP_CALLO(op);
+            nb_iargs = TCGOP_CALLI(op);
+        } else {
+            nb_oargs = tcg_op_defs[op->opc].nb_oargs;
+            nb_iargs = tcg_op_defs[op->opc].nb_iargs;
+        }
+
+        /* A value read in a later segment than it was set in must live on */
+        for (i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
+            TCGTemp* ts = arg_temp(op->args[i]);
+            if (ts && ts->kind == TEMP_NORMAL) {
+                size_t idx = temp_idx(ts);
+                if (seen[idx] && seen[idx] != seg) {
+                    ts->kind = TEMP_LOCAL;
+                }
+                seen[idx] = seg;
+            }
+        }
+        for (i = 0; i < nb_oargs; i++) {
+            TCGTemp* ts = arg_temp(op->args[i]);
+            if (ts->kind == TEMP_NORMAL) {
+                seen[temp_idx(ts)] = seg;
+            }
+        }
+
+        if (l && test_bit(l->id, libafl_inline_labels)) {
+            seg++;
+        }
+    }
+}
+
+/*
+ * For hooks registered with address ranges, emit an inline check that
+ * branches over the helper call unless [addr, addr + size) overlaps one of
+ * the ranges. Returns the label to be set after the call, or NULL.
+ */
+static TCGLabel* libafl_gen_rw_ranges_begin(struct libafl_rw_hook* hook,
+                                             TCGv addr, size_t size)
+{
+    TCGLabel* hit;
+    TCGLabel* done;
+    TCGv off;
+    size_t i;
+
+    if (hook->num_ranges == 0) {
+        return NULL;
+    }
+
+    hit = libafl_gen_inline_label();
+    done = libafl_gen_inline_label();
+    off = tcg_temp_new();
+
+    for (i = 0; i < hook->num_ranges; ++i) {
+        target_ulong start = hook->ranges[i].start - (size - 1);
+        target_ulong len = hook->ranges[i].end - start;
+        tcg_gen_subi_tl(off, addr, start);
+        tcg_gen_brcondi_tl(TCG_COND_LTU, off, len, hit);
+    }
+
+    tcg_temp_free(off);
+    tcg_gen_br(done);
+    gen_set_label(hit);
+
+    return done;
+}
+
+static void libafl_gen_rw_ranges_end(TCGLabel* done)
+{
+    if (done) {
+        gen_set_label(done);
+    }
+}
+
+static void libafl_rw_hook_set_ranges(struct libafl_rw_hook* hook,
+                                      const struct libafl_addr_range* ranges,
+                                      size_t num_ranges)
+{
+    size_t i, n = 0;
+
+    /* A filter without non-empty ranges matches nothing */
+    hook->filtered = true;
+    for (i = 0; i < num_ranges; ++i) {
+        if (ranges[i].end > ranges[i].start) {
+            n++;
+        }
+    }
+    if (n == 0) {
+        return;
+    }
+
+    hook->ranges = malloc(n * sizeof(struct libafl_addr_range));
+    n = 0;
+    for (i = 0; i < num_ranges; ++i) {
+        if (ranges[i].end > ranges[i].start) {
+            hook->ranges[n++] = ranges[i];
+        }
+    }
+    hook->num_ranges = n;
+}
+
+/* Like libafl_add_read_hook, but the helpers only run for accesses that
+ * overlap one of the given guest address ranges.
+ */
+void libafl_add_read_hook_ranges(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data),
+                                 void (*exec1)(uint64_t id, target_ulong addr, uint64_t data),
+                                 void (*exec2)(uint64_t id, target_ulong addr, uint64_t data),
+                                 void (*exec4)(uint64_t id, target_ulong addr, uint64_t data),
+                                 void (*exec8)(uint64_t id, target_ulong addr, uint64_t data),
+                                 void (*execN)(uint64_t id, target_ulong addr, size_t size, uint64_t data),
+                                 uint64_t data,
+                                 const struct libafl_addr_range* ranges,
+                                 size_t num_ranges);
+void libafl_add_read_hook_ranges(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data),
+                                 void (*exec1)(uint64_t id, target_ulong addr, uint64_t data),
+                                 void (*exec2)(uint64_t id, target_ulong addr, uint64_t data),
+                                 void (*exec4)(uint64_t id, target_ulong addr, uint64_t data),
+                                 void (*exec8)(uint64_t id, target_ulong addr, uint64_t data),
+                                 void (*execN)(uint64_t id, target_ulong addr, size_t size, uint64_t data),
+                                 uint64_t data,
+                                 const struct libafl_addr_range* ranges,
+                                 size_t num_ranges)
+{
+    struct libafl_rw_hook* hook = libafl_new_read_hook(gen, exec1, exec2, exec4,
+                                                       exec8, execN, data);
+
+    libafl_rw_hook_set_ranges(hook, ranges, num_ranges);
+    LIBAFL_PUBLISH_HOOK(libafl_read_hooks, hook);
+    libafl_invalidate_hooks();
 }
 
 void libafl_gen_read(TCGv addr, MemOp ot)
@@ -317,10 +646,12 @@ void libafl_gen_read(TCGv addr, MemOp ot)
         return;
     }
 
-    struct libafl_rw_hook* hook = libafl_read_hooks;
+    struct libafl_rw_hook* hook = qatomic_rcu_read(&libafl_read_hooks);
     while (hook) {
         uint64_t cur_id = 0;
-        if (hook->gen)
+        if (hook->filtered && hook->num_ranges == 0)
+            cur_id = (uint64_t)-1;
+        else if (hook->gen)
             cur_id = hook->gen(libafl_gen_cur_pc, size, hook->data);
         void* func = NULL;
         if (size == 1) func = hook->exec1;
@@ -328,6 +659,7 @@ void libafl_gen_read(TCGv addr, MemOp ot)
         else if (size == 4) func = hook->exec4;
         else if (size == 8) func = hook->exec8;
         if (cur_id != (uint64_t)-1 && func) {
+            TCGLabel* done = libafl_gen_rw_ranges_begin(hook, addr, size);
             TCGv_i64 tmp0 = tcg_const_i64(cur_id);
             TCGv_i64 tmp1 = tcg_const_i64(hook->data);
             TCGTemp *tmp2[3] = { tcgv_i64_temp(tmp0), 
@@ -340,19 +672,23 @@ void libafl_gen_read(TCGv addr, MemOp ot)
             tcg_gen_callN(func, NULL, 3, tmp2);
             tcg_temp_free_i64(tmp0);
             tcg_temp_free_i64(tmp1);
+            libafl_gen_rw_ranges_end(done);
         }
-        hook = hook->next;
+        hook = qatomic_rcu_read(&hook->next);
     }
 }
 
 void libafl_gen_read_N(TCGv addr, size_t size)
 {
-    struct libafl_rw_hook* hook = libafl_read_hooks;
+    struct libafl_rw_hook* hook = qatomic_rcu_read(&libafl_read_hooks);
     while (hook) {
         uint64_t cur_id = 0;
-        if (hook->gen)
+        if (hook->filtered && hook->num_ranges == 0)
+            cur_id = (uint64_t)-1;
+        else if (hook->gen)
             cur_id = hook->gen(libafl_gen_cur_pc, size, hook->data);
         if (cur_id != (uint64_t)-1 && hook->execN) {
+            TCGLabel* done = libafl_gen_rw_ranges_begin(hook, addr, size);
             TCGv_i64 tmp0 = tcg_const_i64(cur_id);
             TCGv tmp1 = tcg_const_tl(size);
             TCGv_i64 tmp2 = tcg_const_i64(hook->data);
@@ -373,33 +709,22 @@ void libafl_gen_read_N(TCGv addr, size_t size)
             tcg_temp_free_i64(tmp1);
 #endif
             tcg_temp_free_i64(tmp2);
+            libafl_gen_rw_ranges_end(done);
         }
-        hook = hook->next;
+        hook = qatomic_rcu_read(&hook->next);
     }
 }
 
 struct libafl_rw_hook* libafl_write_hooks;
 
-void libafl_add_write_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data),
-                         void (*exec1)(uint64_t id, target_ulong addr, uint64_t data),
-                         void (*exec2)(uint64_t id, target_ulong addr, uint64_t data),
-                         void (*exec4)(uint64_t id, target_ulong addr, uint64_t data),
-                         void (*exec8)(uint64_t id, target_ulong addr, uint64_t data),
-                         void (*execN)(uint64_t id, target_ulong addr, size_t size, uint64_t data),
-                         uint64_t data);
-void libafl_add_write_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data),
-                         void (*exec1)(uint64_t id, target_ulong addr, uint64_t data),
-                         void (*exec2)(uint64_t id, target_ulong addr, uint64_t data),
-                         void (*exec4)(uint64_t id, target_ulong addr, uint64_t data),
-                         void (*exec8)(uint64_t id, target_ulong addr, uint64_t data),
-                         void (*execN)(uint64_t id, target_ulong addr, size_t size, uint64_t data),
-                         uint64_t data)
+static struct libafl_rw_hook* libafl_new_write_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data),
+                                                    void (*exec1)(uint64_t id, target_ulong addr, uint64_t data),
+                                                    void (*exec2)(uint64_t id, target_ulong addr, uint64_t data),
+                                                    void (*exec4)(uint64_t id, target_ulong addr, uint64_t data),
+                                                    void (*exec8)(uint64_t id, target_ulong addr, uint64_t data),
+                                                    void (*execN)(uint64_t id, target_ulong addr, size_t size, uint64_t data),
+                                                    uint64_t data)
 {
-    CPUState *cpu;
-    CPU_FOREACH(cpu) {
-        tb_flush(cpu);
-    }
-
     struct libafl_rw_hook* hook = malloc(sizeof(struct libafl_rw_hook));
     hook->gen = gen;
     hook->exec1 = exec1;
@@ -408,8 +733,9 @@ void libafl_add_write_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_
     hook->exec8 = exec8;
     hook->execN = execN;
     hook->data = data;
-    hook->next = libafl_write_hooks;
-    libafl_write_hooks = hook;
+    hook->ranges = NULL;
+    hook->num_ranges = 0;
+    hook->filtered = false;
     
     if (exec1) {
         memcpy(&hook->helper_info1, &libafl_exec_write_hook1_info, sizeof(TCGHelperInfo));
@@ -436,6 +762,60 @@ void libafl_add_write_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_
         hook->helper_infoN.func = execN;
         libafl_helper_table_add(&hook->helper_infoN);
     }
+
+    return hook;
+}
+
+void libafl_add_write_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data),
+                           void (*exec1)(uint64_t id, target_ulong addr, uint64_t data),
+                           void (*exec2)(uint64_t id, target_ulong addr, uint64_t data),
+                           void (*exec4)(uint64_t id, target_ulong addr, uint64_t data),
+                           void (*exec8)(uint64_t id, target_ulong addr, uint64_t data),
+                           void (*execN)(uint64_t id, target_ulong addr, size_t size, uint64_t data),
+                           uint64_t data);
+void libafl_add_write_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data),
+                           void (*exec1)(uint64_t id, target_ulong addr, uint64_t data),
+                           void (*exec2)(uint64_t id, target_ulong addr, uint64_t data),
+                           void (*exec4)(uint64_t id, target_ulong addr, uint64_t data),
+                           void (*exec8)(uint64_t id, target_ulong addr, uint64_t data),
+                           void (*execN)(uint64_t id, target_ulong addr, size_t size, uint64_t data),
+                           uint64_t data)
+{
+    struct libafl_rw_hook* hook = libafl_new_write_hook(gen, exec1, exec2, exec4,
+                                                        exec8, execN, data);
+
+    LIBAFL_PUBLISH_HOOK(libafl_write_hooks, hook);
+    libafl_invalidate_hooks();
+}
+
+/* Like libafl_add_write_hook, but the helpers only run for accesses that
+ * overlap one of the given guest address ranges.
+ */
+void libafl_add_write_hook_ranges(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data),
+                                  void (*exec1)(uint64_t id, target_ulong addr, uint64_t data),
+                                  void (*exec2)(uint64_t id, target_ulong addr, uint64_t data),
+                                  void (*exec4)(uint64_t id, target_ulong addr, uint64_t data),
+                                  void (*exec8)(uint64_t id, target_ulong addr, uint64_t data),
+                                  void (*execN)(uint64_t id, target_ulong addr, size_t size, uint64_t data),
+                                  uint64_t data,
+                                  const struct libafl_addr_range* ranges,
+                                  size_t num_ranges);
+void libafl_add_write_hook_ranges(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data),
+                                  void (*exec1)(uint64_t id, target_ulong addr, uint64_t data),
+                                  void (*exec2)(uint64_t id, target_ulong addr, uint64_t data),
+                                  void (*exec4)(uint64_t id, target_ulong addr, uint64_t data),
+                                  void (*exec8)(uint64_t id, target_ulong addr, uint64_t data),
+                                  void (*execN)(uint64_t id, target_ulong addr, size_t size, uint64_t data),
+                                  uint64_t data,
+                                  const struct libafl_addr_range* ranges,
+                                  size_t num_ranges)
+{
+    struct libafl_rw_hook* hook = libafl_new_write_hook(gen, exec1, exec2, exec4,
+                                                        exec8, execN, data);
+
+    libafl_rw_hook_set_ranges(hook, ranges, num_ranges);
+    LIBAFL_PUBLISH_HOOK(libafl_write_hooks, hook);
+    libafl_invalidate_hooks();
 }
 
 void libafl_gen_write(TCGv addr, MemOp ot)
@@ -458,10 +838,12 @@ void libafl_gen_write(TCGv addr, MemOp ot)
         return;
     }
 
-    struct libafl_rw_hook* hook = libafl_write_hooks;
+    struct libafl_rw_hook* hook = qatomic_rcu_read(&libafl_write_hooks);
     while (hook) {
         uint64_t cur_id = 0;
-        if (hook->gen)
+        if (hook->filtered && hook->num_ranges == 0)
+            cur_id = (uint64_t)-1;
+        else if (hook->gen)
             cur_id = hook->gen(libafl_gen_cur_pc, size, hook->data);
         void* func = NULL;
         if (size == 1) func = hook->exec1;
@@ -469,6 +851,7 @@ void libafl_gen_write(TCGv addr, MemOp ot)
         else if (size == 4) func = hook->exec4;
         else if (size == 8) func = hook->exec8;
         if (cur_id != (uint64_t)-1 && func) {
+            TCGLabel* done = libafl_gen_rw_ranges_begin(hook, addr, size);
             TCGv_i64 tmp0 = tcg_const_i64(cur_id);
             TCGv_i64 tmp1 = tcg_const_i64(hook->data);
             TCGTemp *tmp2[3] = { tcgv_i64_temp(tmp0), 
@@ -481,19 +864,23 @@ void libafl_gen_write(TCGv addr, MemOp ot)
             tcg_gen_callN(func, NULL, 3, tmp2);
             tcg_temp_free_i64(tmp0);
             tcg_temp_free_i64(tmp1);
+            libafl_gen_rw_ranges_end(done);
         }
-        hook = hook->next;
+        hook = qatomic_rcu_read(&hook->next);
     }
 }
 
 void libafl_gen_write_N(TCGv addr, size_t size)
 {
-    struct libafl_rw_hook* hook = libafl_write_hooks;
+    struct libafl_rw_hook* hook = qatomic_rcu_read(&libafl_write_hooks);
     while (hook) {
         uint64_t cur_id = 0;
-        if (hook->gen)
+        if (hook->filtered && hook->num_ranges == 0)
+            cur_id = (uint64_t)-1;
+        else if (hook->gen)
             cur_id = hook->gen(libafl_gen_cur_pc, size, hook->data);
         if (cur_id != (uint64_t)-1 && hook->execN) {
+            TCGLabel* done = libafl_gen_rw_ranges_begin(hook, addr, size);
             TCGv_i64 tmp0 = tcg_const_i64(cur_id);
             TCGv tmp1 = tcg_const_tl(size);
             TCGv_i64 tmp2 = tcg_const_i64(hook->data);
@@ -514,11 +901,284 @@ void libafl_gen_write_N(TCGv addr, size_t size)
             tcg_temp_free_i64(tmp1);
 #endif
             tcg_temp_free_i64(tmp2);
+            libafl_gen_rw_ranges_end(done);
         }
-        hook = hook->next;
+        hook = qatomic_rcu_read(&hook->next);
     }
 }
 
+/*
+ * Shadow memory sanitizer
+ *
+ * As in ASan, one shadow byte describes an 8 byte granule of guest virtual
+ * addresses: 0 means the granule is addressable, 1..7 that only that many
+ * leading bytes are, negative values that it is poisoned. With the checks
+ * enabled, every guest load and store inlines a lookup of the shadow bytes
+ * of the granules holding its first and last byte, and only calls
+ * libafl_shadow_slow_path() if either is not 0.
+ *
+ * The shadow covers the whole guest address space. It is reserved on the
+ * first poisoning and never moves, since its address is baked into the
+ * generated code; the host only backs the pages that were written.
+ */
+
+#define LIBAFL_SHADOW_SHIFT 3
+#define LIBAFL_SHADOW_GRANULE (1 << LIBAFL_SHADOW_SHIFT)
+
+#if TARGET_VIRT_ADDR_SPACE_BITS < TARGET_LONG_BITS
+#define LIBAFL_SHADOW_ADDR_BITS TARGET_VIRT_ADDR_SPACE_BITS
+#else
+#define LIBAFL_SHADOW_ADDR_BITS TARGET_LONG_BITS
+#endif
+#define LIBAFL_SHADOW_SIZE \
+    (1ULL << (LIBAFL_SHADOW_ADDR_BITS - LIBAFL_SHADOW_SHIFT))
+
+static int8_t* libafl_shadow;
+static bool libafl_shadow_checks;
+
+/* Called on an invalid access. Without it, QEMU reports and aborts. */
+void (*libafl_shadow_report_hook)(target_ulong addr, size_t size,
+                                  bool is_write, target_ulong pc);
+
+static void libafl_shadow_slow_path(target_ulong addr, target_ulong pc,
+                                    uint32_t info);
+
+static TCGHelperInfo libafl_shadow_slow_path_info = {
+    .func = libafl_shadow_slow_path, .name = "libafl_shadow_slow_path", \
+    .flags = dh_callflag(void), \
+    .typemask = dh_typemask(void, 0) | dh_typemask(tl, 1)
+    | dh_typemask(tl, 2) | dh_typemask(i32, 3)
+};
+
+static inline uint64_t libafl_shadow_index(target_ulong addr)
+{
+    return (addr >> LIBAFL_SHADOW_SHIFT) & (LIBAFL_SHADOW_SIZE - 1);
+}
+
+static bool libafl_shadow_init(void)
+{
+    void* p;
+
+    if (libafl_shadow) {
+        return true;
+    }
+
+    if (LIBAFL_SHADOW_SIZE - 1 > SIZE_MAX) {
+        error_report("libafl: the guest address space is too large for "
+                     "shadow memory on this host");
+        return false;
+    }
+    p = mmap(NULL, LIBAFL_SHADOW_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        error_report("libafl: cannot reserve %llu bytes of shadow memory: %s",
+                     LIBAFL_SHADOW_SIZE, strerror(errno));
+        return false;
+    }
+
+    libafl_helper_table_add(&libafl_shadow_slow_path_info);
+    libafl_shadow = p;
+    return true;
+}
+
+/* Set the shadow bytes [start, end) to val, dropping whole zero pages */
+static void libafl_shadow_fill(uint64_t start, uint64_t end, int8_t val)
+{
+    uintptr_t page = qemu_real_host_page_size();
+    uintptr_t lo, hi;
+
+    end = MIN(end, LIBAFL_SHADOW_SIZE);
+    if (start >= end) {
+        return;
+    }
+
+    lo = ROUND_UP((uintptr_t)(libafl_shadow + start), page);
+    hi = ROUND_DOWN((uintptr_t)(libafl_shadow + end), page);
+    if (val || lo >= hi) {
+        memset(libafl_shadow + start, val, end - start);
+        return;
+    }
+
+    memset(libafl_shadow + start, 0, (int8_t*)lo - (libafl_shadow + start));
+    qemu_madvise((void*)lo, hi - lo, QEMU_MADV_DONTNEED);
+    memset((void*)hi, 0, (libafl_shadow + end) - (int8_t*)hi);
+}
+
+/*
+ * Mark [addr, addr + len) as invalid to access. Only the end of a granule
+ * can be poisoned, so a range ending inside a granule leaves that granule
+ * addressable.
+ */
+void libafl_shadow_poison(target_ulong addr, size_t len);
+void libafl_shadow_poison(target_ulong addr, size_t len)
+{
+    target_ulong last = addr + len - 1;
+    uint64_t head = addr >> LIBAFL_SHADOW_SHIFT;
+    uint64_t end = (last >> LIBAFL_SHADOW_SHIFT)
+                   + ((last & (LIBAFL_SHADOW_GRANULE - 1))
+                      == LIBAFL_SHADOW_GRANULE - 1);
+    int8_t keep = addr & (LIBAFL_SHADOW_GRANULE - 1);
+    int8_t* s;
+
+    if (!len || !libafl_shadow_init()) {
+        return;
+    }
+
+    if (keep && end > head) {
+        s = &libafl_shadow[libafl_shadow_index(addr)];
+        if (*s == 0 || *s > keep) {
+            *s = keep;
+        }
+        head++;
+    }
+    libafl_shadow_fill(head, end, -1);
+}
+
+/*
+ * Mark [addr, addr + len) as valid again. A granule only partly covered at
+ * the start of the range becomes fully addressable.
+ */
+void libafl_shadow_unpoison(target_ulong addr, size_t len);
+void libafl_shadow_unpoison(target_ulong addr, size_t len)
+{
+    target_ulong last = addr + len - 1;
+    int8_t tail = (last & (LIBAFL_SHADOW_GRANULE - 1)) + 1;
+    int8_t* s;
+
+    if (!len || !libafl_shadow) {
+        return;
+    }
+
+    libafl_shadow_fill(addr >> LIBAFL_SHADOW_SHIFT,
+                       last >> LIBAFL_SHADOW_SHIFT, 0);
+    s = &libafl_shadow[libafl_shadow_index(last)];
+    if (tail == LIBAFL_SHADOW_GRANULE) {
+        *s = 0;
+    } else if (*s < 0 || (*s > 0 && *s < tail)) {
+        *s = tail;
+    }
+}
+
+/*
+ * Turn the inline checks on or off. Code translated before is dropped.
+ * Returns 0 if the shadow memory could not be reserved.
+ */
+int libafl_shadow_enable(bool enable);
+int libafl_shadow_enable(bool enable)
+{
+    if (enable && !libafl_shadow_init()) {
+        return 0;
+    }
+    if (libafl_shadow_checks != enable) {
+        libafl_shadow_checks = enable;
+        libafl_invalidate_hooks();
+    }
+    return 1;
+}
+
+static bool libafl_shadow_poisoned(target_ulong addr, size_t size)
+{
+    target_ulong a;
+    int8_t s;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        a = addr + i;
+        s = libafl_shadow[libafl_shadow_index(a)];
+        if (s < 0 || (s > 0 && (a & (LIBAFL_SHADOW_GRANULE - 1)) >= s)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void libafl_shadow_slow_path(target_ulong addr, target_ulong pc,
+                                    uint32_t info)
+{
+    size_t size = info & 0xff;
+    bool is_write = info >> 8;
+
+    if (!libafl_shadow_poisoned(addr, size)) {
+        return;
+    }
+
+    if (libafl_shadow_report_hook) {
+        libafl_shadow_report_hook(addr, size, is_write, pc);
+        return;
+    }
+    error_report("libafl: invalid %zu byte %s at 0x" TARGET_FMT_lx
+                 ", pc 0x" TARGET_FMT_lx, size, is_write ? "write" : "read",
+                 addr, pc);
+    abort();
+}
+
+/* Load the shadow byte of the granule holding addr into ret */
+static void libafl_gen_shadow_load(TCGv_i32 ret, TCGv addr)
+{
+    TCGv idx = tcg_temp_new();
+    TCGv_ptr ptr = tcg_temp_new_ptr();
+
+    tcg_gen_shri_tl(idx, addr, LIBAFL_SHADOW_SHIFT);
+#if LIBAFL_SHADOW_ADDR_BITS < TARGET_LONG_BITS
+    tcg_gen_andi_tl(idx, idx, LIBAFL_SHADOW_SIZE - 1);
+#endif
+#if TARGET_LONG_BITS == 32
+    /* The shift cleared the sign bit */
+    tcg_gen_ext_i32_ptr(ptr, idx);
+#else
+    tcg_gen_trunc_i64_ptr(ptr, idx);
+#endif
+    tcg_gen_addi_ptr(ptr, ptr, (intptr_t)libafl_shadow);
+    tcg_gen_ld8u_i32(ret, ptr, 0);
+    tcg_temp_free_ptr(ptr);
+    tcg_temp_free(idx);
+}
+
+void libafl_gen_shadow_check(TCGv addr, MemOp ot, bool is_write)
+{
+    TCGLabel* done;
+    TCGv_i32 shadow;
+    TCGv last;
+    TCGv_i32 tail;
+
+    if (!libafl_shadow_checks || (ot & MO_SIZE) > MO_64) {
+        return;
+    }
+
+    done = libafl_gen_inline_label();
+    shadow = tcg_temp_new_i32();
+    libafl_gen_shadow_load(shadow, addr);
+
+    /* An unaligned access can reach into the next granule */
+    if (memop_size(ot) > 1) {
+        last = tcg_temp_new();
+        tail = tcg_temp_new_i32();
+        tcg_gen_addi_tl(last, addr, memop_size(ot) - 1);
+        libafl_gen_shadow_load(tail, last);
+        tcg_gen_or_i32(shadow, shadow, tail);
+        tcg_temp_free_i32(tail);
+        tcg_temp_free(last);
+    }
+
+    tcg_gen_brcondi_i32(TCG_COND_EQ, shadow, 0, done);
+    tcg_temp_free_i32(shadow);
+
+    TCGv pc = tcg_const_tl(libafl_gen_cur_pc);
+    TCGv_i32 info = tcg_const_i32(memop_size(ot) | (is_write << 8));
+    TCGTemp *args[3] = {
+#if TARGET_LONG_BITS == 32
+                         tcgv_i32_temp(addr), tcgv_i32_temp(pc),
+#else
+                         tcgv_i64_temp(addr), tcgv_i64_temp(pc),
+#endif
+                         tcgv_i32_temp(info) };
+    tcg_gen_callN(libafl_shadow_slow_path, NULL, 3, args);
+    tcg_temp_free(pc);
+    tcg_temp_free_i32(info);
+
+    gen_set_label(done);
+}
+
 static TCGHelperInfo libafl_exec_cmp_hook1_info = {
     .func = NULL, .name = "libafl_exec_cmp_hook1", \
     .flags = dh_callflag(void), \
@@ -573,11 +1233,6 @@ void libafl_add_cmp_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t
                          void (*exec8)(uint64_t id, uint64_t v0, uint64_t v1, uint64_t data),
                          uint64_t data)
 {
-    CPUState *cpu;
-    CPU_FOREACH(cpu) {
-        tb_flush(cpu);
-    }
-
     struct libafl_cmp_hook* hook = malloc(sizeof(struct libafl_cmp_hook));
     hook->gen = gen;
     hook->exec1 = exec1;
@@ -585,8 +1240,6 @@ void libafl_add_cmp_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t
     hook->exec4 = exec4;
     hook->exec8 = exec8;
     hook->data = data;
-    hook->next = libafl_cmp_hooks;
-    libafl_cmp_hooks = hook;
     
     if (exec1) {
         memcpy(&hook->helper_info1, &libafl_exec_cmp_hook1_info, sizeof(TCGHelperInfo));
@@ -608,8 +1261,116 @@ void libafl_add_cmp_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t
         hook->helper_info8.func = exec8;
         libafl_helper_table_add(&hook->helper_info8);
     }
+
+    LIBAFL_PUBLISH_HOOK(libafl_cmp_hooks, hook);
+    libafl_invalidate_hooks();
+}
+
+/*
+ * In-emulator cmplog: the generated code records the operands into a slot
+ * of a shared cmp map with plain stores. The slot is selected at
+ * translation time as map[gen(pc, size) % num_slots], and every execution
+ * writes its operand pair into the way selected by the hit counter.
+ */
+#define LIBAFL_CMPLOG_WAYS 32
+
+struct libafl_cmplog_slot {
+    uint32_t hits;
+    uint32_t size;
+    uint64_t ops[LIBAFL_CMPLOG_WAYS][2];
+};
+
+struct libafl_cmp_map_hook {
+    uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data);
+    struct libafl_cmplog_slot* map;
+    size_t num_slots;
+    uint64_t data;
+    struct libafl_cmp_map_hook* next;
+};
+
+struct libafl_cmp_map_hook* libafl_cmp_map_hooks;
+
+void libafl_add_cmp_map_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data),
+                             void *map, size_t num_slots, uint64_t data);
+void libafl_add_cmp_map_hook(uint64_t (*gen)(target_ulong pc, size_t size, uint64_t data),
+                             void *map, size_t num_slots, uint64_t data)
+{
+    assert(map != NULL && num_slots != 0);
+
+    struct libafl_cmp_map_hook* hook = malloc(sizeof(struct libafl_cmp_map_hook));
+    hook->gen = gen;
+    hook->map = map;
+    hook->num_slots = num_slots;
+    hook->data = data;
+
+    LIBAFL_PUBLISH_HOOK(libafl_cmp_map_hooks, hook);
+    libafl_invalidate_hooks();
+}
+
+static void libafl_gen_cmp_map_store(struct libafl_cmplog_slot* slot,
+                                     TCGv op0, TCGv op1, size_t size)
+{
+    TCGv_ptr base = tcg_constant_ptr(slot);
+    TCGv_i32 hits = tcg_temp_new_i32();
+    TCGv_i32 next = tcg_temp_new_i32();
+    TCGv_ptr way = tcg_temp_new_ptr();
+    TCGv_i64 val = tcg_temp_new_i64();
+
+    tcg_gen_ld_i32(hits, base, offsetof(struct libafl_cmplog_slot, hits));
+    tcg_gen_addi_i32(next, hits, 1);
+    tcg_gen_st_i32(next, base, offsetof(struct libafl_cmplog_slot, hits));
+    tcg_gen_st_i32(tcg_constant_i32(size), base,
+                   offsetof(struct libafl_cmplog_slot, size));
+
+    tcg_gen_andi_i32(hits, hits, LIBAFL_CMPLOG_WAYS - 1);
+    tcg_gen_shli_i32(hits, hits, 4);
+    tcg_gen_ext_i32_ptr(way, hits);
+    tcg_gen_add_ptr(way, way, base);
+
+    tcg_gen_extu_tl_i64(val, op0);
+    if (size < 8) {
+        tcg_gen_andi_i64(val, val, MAKE_64BIT_MASK(0, size * 8));
+    }
+    tcg_gen_st_i64(val, way, offsetof(struct libafl_cmplog_slot, ops));
+    tcg_gen_extu_tl_i64(val, op1);
+    if (size < 8) {
+        tcg_gen_andi_i64(val, val, MAKE_64BIT_MASK(0, size * 8));
+    }
+    tcg_gen_st_i64(val, way, offsetof(struct libafl_cmplog_slot, ops) + 8);
+
+    tcg_temp_free_i64(val);
+    tcg_temp_free_ptr(way);
+    tcg_temp_free_i32(next);
+    tcg_temp_free_i32(hits);
 }
 
+/*
+ * A comparison between two constants, or against the constant 0 or 1, gives
+ * the fuzzer nothing to solve. Such comparisons are not instrumented.
+ */
+static bool libafl_cmp_is_trivial(TCGv op0, TCGv op1)
+{
+#if TARGET_LONG_BITS == 32
+    TCGTemp *t0 = tcgv_i32_temp(op0);
+    TCGTemp *t1 = tcgv_i32_temp(op1);
+#else
+    TCGTemp *t0 = tcgv_i64_temp(op0);
+    TCGTemp *t1 = tcgv_i64_temp(op1);
+#endif
+    bool c0 = t0->kind == TEMP_CONST;
+    bool c1 = t1->kind == TEMP_CONST;
+
+    if (c0 && c1) {
+        return true;
+    }
+    if (c0 && (uint64_t)t0->val <= 1) {
+        return true;
+    }
+    if (c1 && (uint64_t)t1->val <= 1) {
+        return true;
+    }
+    return false;
+}
 
 void libafl_gen_cmp(target_ulong pc, TCGv op0, TCGv op1, MemOp ot)
 {
@@ -631,7 +1392,22 @@ void libafl_gen_cmp(target_ulong pc, TCGv op0, TCGv op1, MemOp ot)
         return;
     }
 
-    struct libafl_cmp_hook* hook = libafl_cmp_hooks;
+    if (libafl_cmp_is_trivial(op0, op1))
+        return;
+
+    struct libafl_cmp_map_hook* map_hook = qatomic_rcu_read(&libafl_cmp_map_hooks);
+    while (map_hook) {
+        uint64_t cur_id = (uint64_t)pc;
+        if (map_hook->gen)
+            cur_id = map_hook->gen(pc, size, map_hook->data);
+        if (cur_id != (uint64_t)-1) {
+            libafl_gen_cmp_map_store(&map_hook->map[cur_id % map_hook->num_slots],
+                                     op0, op1, size);
+        }
+        map_hook = qatomic_rcu_read(&map_hook->next);
+    }
+
+    struct libafl_cmp_hook* hook = qatomic_rcu_read(&libafl_cmp_hooks);
     while (hook) {
         uint64_t cur_id = 0;
         if (hook->gen)
@@ -655,7 +1431,7 @@ void libafl_gen_cmp(target_ulong pc, TCGv op0, TCGv op1, MemOp ot)
             tcg_temp_free_i64(tmp0);
             tcg_temp_free_i64(tmp1);
         }
-        hook = hook->next;
+        hook = qatomic_rcu_read(&hook->next);
     }
 }
 
@@ -682,12 +1458,13 @@ void libafl_add_backdoor_hook(void (*exec)(target_ulong id, uint64_t data),
     struct libafl_backdoor_hook* hook = malloc(sizeof(struct libafl_backdoor_hook));
     hook->exec = exec;
     hook->data = data;
-    hook->next = libafl_backdoor_hooks;
-    libafl_backdoor_hooks = hook;
     
     memcpy(&hook->helper_info, &libafl_exec_backdoor_hook_info, sizeof(TCGHelperInfo));
     hook->helper_info.func = exec;
     libafl_helper_table_add(&hook->helper_info);
+
+    LIBAFL_PUBLISH_HOOK(libafl_backdoor_hooks, hook);
+    libafl_invalidate_hooks();
 }
 
 //// --- End LibAFL code ---
@@ -1029,6 +1806,51 @@ bool cpu_restore_state(CPUState *cpu, uintptr_t host_pc, bool will_exit)
     return false;
 }
 
+//// --- Begin LibAFL code ---
+
+/*
+ * Like cpu_restore_state(), but only decode the guest pc of the instruction
+ * at host_pc instead of restoring it into the CPU. Returns 0 if host_pc is
+ * not inside a TB.
+ */
+target_ulong libafl_tb_insn_pc(uintptr_t host_pc);
+target_ulong libafl_tb_insn_pc(uintptr_t host_pc)
+{
+    target_ulong data[TARGET_INSN_START_WORDS];
+    TranslationBlock *tb;
+    uintptr_t tb_host_pc;
+    const uint8_t *p;
+    int i, j;
+
+    if (TARGET_TB_PCREL ||
+        !in_code_gen_buffer((const void *)(host_pc - tcg_splitwx_diff))) {
+        return 0;
+    }
+    tb = tcg_tb_lookup(host_pc);
+    if (!tb) {
+        return 0;
+    }
+
+    host_pc -= GETPC_ADJ;
+    tb_host_pc = (uintptr_t)tb->tc.ptr;
+    p = tb->tc.ptr + tb->tc.size;
+
+    memset(data, 0, sizeof(data));
+    data[0] = tb_pc(tb);
+    for (i = 0; i < tb->icount; ++i) {
+        for (j = 0; j < TARGET_INSN_START_WORDS; ++j) {
+            data[j] += decode_sleb128(&p);
+        }
+        tb_host_pc += decode_sleb128(&p);
+        if (tb_host_pc > host_pc) {
+            return data[0];
+        }
+    }
+    return tb_pc(tb);
+}
+
+//// --- End LibAFL code ---
+
 void page_init(void)
 {
     page_size_init();
@@ -1782,6 +2604,45 @@ static inline void tb_jmp_unlink(TranslationBlock *dest)
     qemu_spin_unlock(&dest->jmp_lock);
 }
 
+//// --- Begin LibAFL code ---
+
+static gboolean libafl_unlink_tbs_iter(gpointer key, gpointer value,
+                                       gpointer data)
+{
+    TranslationBlock *tb = value;
+    TranslationBlock *dest;
+    int n;
+
+    /* Edge TBs are not in the tree, reach them through their callers */
+    for (n = 0; n < 2; n++) {
+        dest = (TranslationBlock *)(qatomic_read(&tb->jmp_dest[n]) & ~1);
+        if (dest) {
+            tb_jmp_unlink(dest);
+        }
+    }
+    tb_jmp_unlink(tb);
+    return false;
+}
+
+/*
+ * Runs exclusively, so no vCPU can chain a TB it looked up under the old
+ * generation after the walk. Afterwards every TB exits to the main loop at
+ * its end, where tb_lookup() drops it if it is stale.
+ */
+static void libafl_unlink_tbs(CPUState *cpu, run_on_cpu_data data)
+{
+    qatomic_set(&libafl_unlink_pending, false);
+
+    mmap_lock();
+    tcg_tb_foreach(libafl_unlink_tbs_iter, NULL);
+    CPU_FOREACH(cpu) {
+        tcg_flush_jmp_cache(cpu);
+    }
+    mmap_unlock();
+}
+
+//// --- End LibAFL code ---
+
 static void tb_jmp_cache_inval_tb(TranslationBlock *tb)
 {
     CPUState *cpu;
@@ -2021,16 +2882,44 @@ TranslationBlock *libafl_gen_edge(CPUState *cpu, target_ulong src_block,
     (void)existing_tb;
 
     assert_memory_lock();
-    
-    struct libafl_edge_hook* hook = libafl_edge_hooks;
+
+    /* Hooks added from now on are left for the next edge, both walks
+     * below start at these heads and see the same hooks.
+     */
+    struct libafl_edge_hook* hooks = qatomic_rcu_read(&libafl_edge_hooks);
+    struct libafl_edge_map_hook* map_hooks = qatomic_rcu_read(&libafl_edge_map_hooks);
+    struct libafl_edge_hook* hook;
+    struct libafl_edge_map_hook* map_hook;
+    size_t num_ids = 0, i;
+
+    for (hook = hooks; hook; hook = qatomic_rcu_read(&hook->next))
+        num_ids++;
+    for (map_hook = map_hooks; map_hook; map_hook = qatomic_rcu_read(&map_hook->next))
+        num_ids++;
+    if (num_ids > libafl_edge_ids_size) {
+        libafl_edge_ids = realloc(libafl_edge_ids, num_ids * sizeof(uint64_t));
+        libafl_edge_ids_size = num_ids;
+    }
+
     int no_exec_hook = 1;
-    while (hook) {
-        hook->cur_id = 0;
+    i = 0;
+    for (hook = hooks; hook; hook = qatomic_rcu_read(&hook->next)) {
+        uint64_t cur_id = 0;
         if (hook->gen)
-            hook->cur_id = hook->gen(src_block, dst_block, hook->data);
-        if (hook->cur_id != (uint64_t)-1 && hook->exec)
+            cur_id = hook->gen(src_block, dst_block, hook->data);
+        if (cur_id != (uint64_t)-1 && hook->exec)
+            no_exec_hook = 0;
+        libafl_edge_ids[i++] = cur_id;
+    }
+    for (map_hook = map_hooks; map_hook; map_hook = qatomic_rcu_read(&map_hook->next)) {
+        uint64_t cur_id;
+        if (map_hook->gen)
+            cur_id = map_hook->gen(src_block, dst_block, map_hook->data);
+        else
+            cur_id = (uint64_t)((src_block >> 1) ^ dst_block);
+        if (cur_id != (uint64_t)-1)
             no_exec_hook = 0;
-        hook = hook->next;
+        libafl_edge_ids[i++] = cur_id;
     }
     if (no_exec_hook)
         return NULL;
@@ -2069,6 +2958,7 @@ TranslationBlock *libafl_gen_edge(CPUState *cpu, target_ulong src_block,
     tb->flags = flags;
     tb->cflags = cflags;
     tb->trace_vcpu_dstate = *cpu->trace_dstate;
+    tb->libafl_hook_gen = qatomic_read(&libafl_hook_generation);
     tcg_ctx->tb_cflags = cflags;
 
 #ifdef CONFIG_PROFILER
@@ -2081,19 +2971,26 @@ TranslationBlock *libafl_gen_edge(CPUState *cpu, target_ulong src_block,
 
     tcg_ctx->cpu = env_cpu(env);
 
-    hook = libafl_edge_hooks;
     size_t hcount = 0;
-    while (hook) {
-        if (hook->cur_id != (uint64_t)-1 && hook->exec) {
+    i = 0;
+    for (hook = hooks; hook; hook = qatomic_rcu_read(&hook->next)) {
+        uint64_t cur_id = libafl_edge_ids[i++];
+        if (cur_id != (uint64_t)-1 && hook->exec) {
             hcount++;
-            TCGv_i64 tmp0 = tcg_const_i64(hook->cur_id);
+            TCGv_i64 tmp0 = tcg_const_i64(cur_id);
             TCGv_i64 tmp1 = tcg_const_i64(hook->data);
             TCGTemp *tmp2[2] = { tcgv_i64_temp(tmp0), tcgv_i64_temp(tmp1) };
             tcg_gen_callN(hook->exec, NULL, 2, tmp2);
             tcg_temp_free_i64(tmp0);
             tcg_temp_free_i64(tmp1);
         }
-        hook = hook->next;
+    }
+    for (map_hook = map_hooks; map_hook; map_hook = qatomic_rcu_read(&map_hook->next)) {
+        uint64_t cur_id = libafl_edge_ids[i++];
+        if (cur_id != (uint64_t)-1) {
+            hcount++;
+            libafl_gen_edge_map_inc(map_hook, cur_id);
+        }
     }
     tcg_gen_goto_tb(0);
     tcg_gen_exit_tb(tb, 0);
@@ -2222,6 +3119,9 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->trace_vcpu_dstate = *cpu->trace_dstate;
     tb->page_addr[0] = phys_pc;
     tb->page_addr[1] = -1;
+    //// --- Begin LibAFL code ---
+    tb->libafl_hook_gen = qatomic_read(&libafl_hook_generation);
+    //// --- End LibAFL code ---
     tcg_ctx->tb_cflags = cflags;
  tb_overflow:
 
@@ -2242,7 +3142,9 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
 
     //// --- Begin LibAFL code ---
 
-    struct libafl_block_hook* hook = libafl_block_hooks;
+    libafl_reset_inline_labels();
+
+    struct libafl_block_hook* hook = qatomic_rcu_read(&libafl_block_hooks);
     while (hook) {
         uint64_t cur_id = 0;
         if (hook->gen)
@@ -2255,7 +3157,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
             tcg_temp_free_i64(tmp0);
             tcg_temp_free_i64(tmp1);
         }
-        hook = hook->next;
+        hook = qatomic_rcu_read(&hook->next);
     }
     
     //// --- End LibAFL code ---
@@ -2286,6 +3188,10 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     ti = profile_getclock();
 #endif
 
+    //// --- Begin LibAFL code ---
+    libafl_scope_inline_branches(tcg_ctx);
+    //// --- End LibAFL code ---
+
     gen_code_size = tcg_gen_code(tcg_ctx, tb, pc);
     if (unlikely(gen_code_size < 0)) {
  error_return:
@@ -3249,6 +4155,16 @@ void page_protect(tb_page_addr_t page_addr)
  * immediately exited. (We can only return 2 if the 'pc' argument is
  * non-zero.)
  */
+//// --- Begin LibAFL code ---
+
+/*
+ * Told about every host page that page_unprotect() makes writable again,
+ * while it is still write protected
+ */
+void (*libafl_page_unprotect_hook)(target_ulong host_start);
+
+//// --- End LibAFL code ---
+
 int page_unprotect(target_ulong address, uintptr_t pc)
 {
     unsigned int prot;
@@ -3301,6 +4217,13 @@ int page_unprotect(target_ulong address, uintptr_t pc)
                 }
 #endif
             }
+            //// --- Begin LibAFL code ---
+            /* Before any other thread can write to the page */
+            if (libafl_page_unprotect_hook) {
+                libafl_page_unprotect_hook(host_start);
+            }
+            //// --- End LibAFL code ---
+
             mprotect((void *)g2h_untagged(host_start), qemu_host_page_size,
                      prot & PAGE_BITS);
         }
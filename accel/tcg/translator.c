@@ -21,27 +21,28 @@
 //// --- Begin LibAFL code ---
 
 #include "tcg/tcg-internal.h"
+#include "qemu/rcu.h"
 
-extern target_ulong libafl_gen_cur_pc;
-
-struct libafl_breakpoint {
-    target_ulong addr;
-    struct libafl_breakpoint* next;
-};
-
-extern struct libafl_breakpoint* libafl_qemu_breakpoints;
+extern __thread target_ulong libafl_gen_cur_pc;
 
 struct libafl_hook {
     target_ulong addr;
-    void (*callback)(uint64_t);
+    void (*callback)(target_ulong, uint64_t);
     uint64_t data;
     TCGHelperInfo helper_info;
+    size_t num;
     struct libafl_hook* next;
+    struct rcu_head rcu;
 };
 
-extern struct libafl_hook* libafl_qemu_hooks;
+struct libafl_pc_entry {
+    target_ulong addr;
+    struct libafl_hook* hooks;
+    size_t breakpoints;
+    int state;
+};
 
-struct libafl_hook* libafl_search_hook(target_ulong addr);
+struct libafl_pc_entry* libafl_qemu_lookup_pc(target_ulong addr);
 
 struct libafl_backdoor_hook {
     void (*exec)(target_ulong pc, uint64_t data);
@@ -124,8 +125,10 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int max_insns,
 
         //// --- Begin LibAFL code ---
 
-        struct libafl_hook* hk = libafl_search_hook(db->pc_next);
-        if (hk) {
+        /* Hooks may change concurrently on other threads, see cpu.c */
+        struct libafl_pc_entry* pc_entry = libafl_qemu_lookup_pc(db->pc_next);
+        struct libafl_hook* hk = pc_entry ? qatomic_rcu_read(&pc_entry->hooks) : NULL;
+        while (hk) {
             TCGv tmp0 = tcg_const_tl(db->pc_next);
             TCGv_i64 tmp1 = tcg_const_i64(hk->data);
 #if TARGET_LONG_BITS == 32
@@ -140,14 +143,11 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int max_insns,
             tcg_temp_free_i64(tmp0);
 #endif
             tcg_temp_free_i64(tmp1);
+            hk = qatomic_rcu_read(&hk->next);
         }
 
-        struct libafl_breakpoint* bp = libafl_qemu_breakpoints;
-        while (bp) {
-            if (bp->addr == db->pc_next) {
-                gen_helper_libafl_qemu_handle_breakpoint(cpu_env);
-            }
-            bp = bp->next;
+        if (pc_entry && qatomic_read(&pc_entry->breakpoints)) {
+            gen_helper_libafl_qemu_handle_breakpoint(cpu_env);
         }
 
         libafl_gen_cur_pc = db->pc_next;
@@ -161,7 +161,7 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int max_insns,
                 if (backdoor == 0xf2) {
                     backdoor = translator_ldub(cpu->env_ptr, db, db->pc_next +3);
                     if (backdoor == 0x44) {
-                        struct libafl_backdoor_hook* hk = libafl_backdoor_hooks;
+                        struct libafl_backdoor_hook* hk = qatomic_rcu_read(&libafl_backdoor_hooks);
                         while (hk) {
                             TCGv tmp0 = tcg_const_tl(db->pc_next);
                             TCGv_i64 tmp1 = tcg_const_i64(hk->data);
@@ -177,7 +177,7 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int max_insns,
                             tcg_temp_free_i64(tmp0);
 #endif
                             tcg_temp_free_i64(tmp1);
-                            hk = hk->next;
+                            hk = qatomic_rcu_read(&hk->next);
                         }
 
                         db->pc_next += 4;
@@ -47,16 +47,8 @@
 #include "tcg/tcg-op.h"
 #include "tcg/tcg-internal.h"
 #include "exec/helper-head.h"
-
-#define LIBAFL_TABLES_SIZE 16384
-#define LIBAFL_TABLES_HASH(p) (((13*((size_t)(p))) ^ (((size_t)(p)) >> 15)) % LIBAFL_TABLES_SIZE)
-
-struct libafl_breakpoint {
-    target_ulong addr;
-    struct libafl_breakpoint* next;
-};
-
-struct libafl_breakpoint* libafl_qemu_breakpoints = NULL;
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
 
 struct libafl_hook {
     target_ulong addr;
@@ -65,9 +57,68 @@ struct libafl_hook {
     TCGHelperInfo helper_info;
     size_t num;
     struct libafl_hook* next;
+    struct rcu_head rcu;
 };
 
-struct libafl_hook* libafl_qemu_hooks[LIBAFL_TABLES_SIZE];
+/*
+ * Everything registered at a guest pc: the hooks (in reverse registration
+ * order) and whether a breakpoint is set there.
+ */
+struct libafl_pc_entry {
+    target_ulong addr;
+    struct libafl_hook* hooks;
+    size_t breakpoints;
+    int state;
+};
+
+#define LIBAFL_PC_ENTRY_EMPTY 0
+#define LIBAFL_PC_ENTRY_USED 1
+#define LIBAFL_PC_ENTRY_DELETED 2
+
+/*
+ * Translation looks up every guest instruction, and almost all of them have
+ * nothing registered. A counting filter over 4K guest pages answers that
+ * case with a single load; only pages that have something go on to probe
+ * the open-addressing pc map.
+ */
+#define LIBAFL_PAGE_FILTER_BITS 16
+#define LIBAFL_PAGE_FILTER_IDX(a) \
+    ((size_t)((((uint64_t)(a) >> 12) * 0x9e3779b97f4a7c15ULL) >> (64 - LIBAFL_PAGE_FILTER_BITS)))
+
+static uint32_t libafl_page_filter[1 << LIBAFL_PAGE_FILTER_BITS];
+
+#define LIBAFL_PC_MAP_MIN_BITS 10
+#define LIBAFL_PC_MAP_HASH(a, bits) \
+    ((size_t)(((uint64_t)(a) * 0x9e3779b97f4a7c15ULL) >> (64 - (bits))))
+
+struct libafl_pc_map {
+    struct rcu_head rcu;
+    size_t bits;
+    struct libafl_pc_entry entries[];
+};
+
+/*
+ * With MTTCG every vCPU thread translates, and looks up the map, while
+ * hooks may be added or removed from any other thread. Lookups take no
+ * lock: they run under RCU (cpu_exec() holds the read lock), entries are
+ * filled in before their state publishes them, deleted entries are only
+ * reclaimed by rehashing into a new map, and replaced maps and removed
+ * hooks are freed after a grace period. Changes are serialized by
+ * libafl_hooks_lock.
+ */
+static struct libafl_pc_map* libafl_pc_map = NULL;
+static size_t libafl_pc_map_used = 0;
+static size_t libafl_pc_map_deleted = 0;
+static QemuMutex libafl_hooks_lock;
+
+static void __attribute__((__constructor__)) libafl_hooks_init(void)
+{
+    qemu_mutex_init(&libafl_hooks_lock);
+}
+
+/* Hooks indexed by their id, so removing one by id does not search */
+static struct libafl_hook** libafl_qemu_hooks_by_num = NULL;
+static size_t libafl_qemu_hooks_by_num_size = 0;
 size_t libafl_qemu_hooks_num = 0;
 
 __thread int libafl_valid_current_cpu = 0;
@@ -84,6 +135,9 @@ int libafl_qemu_cpu_index(CPUState*);
 int libafl_qemu_write_reg(CPUState* cpu, int reg, uint8_t* val);
 int libafl_qemu_read_reg(CPUState* cpu, int reg, uint8_t* val);
 int libafl_qemu_num_regs(CPUState* cpu);
+size_t libafl_qemu_cpu_state_size(CPUState* cpu);
+size_t libafl_qemu_save_cpu_state(CPUState* cpu, void* buf);
+int libafl_qemu_restore_cpu_state(CPUState* cpu, const void* buf);
 
 int libafl_qemu_set_breakpoint(target_ulong addr);
 int libafl_qemu_remove_breakpoint(target_ulong addr);
@@ -92,6 +146,7 @@ size_t libafl_qemu_set_hook(target_ulong pc, void (*callback)(target_ulong, uint
 size_t libafl_qemu_remove_hooks_at(target_ulong addr, int invalidate);
 int libafl_qemu_remove_hook(size_t num, int invalidate);
 struct libafl_hook* libafl_search_hook(target_ulong addr);
+struct libafl_pc_entry* libafl_qemu_lookup_pc(target_ulong addr);
 void libafl_flush_jit(void);
 
 /*
@@ -173,58 +228,282 @@ int libafl_qemu_num_regs(CPUState* cpu)
     return cc->gdb_num_core_regs;
 }
 
+/*
+ * Bulk register state. The part of CPUArchState in front of the
+ * end_reset_fields marker is plain data (registers, system registers and
+ * cached flags), so it can be copied in one go together with the pending
+ * exception and interrupt state kept in CPUState. Targets without the
+ * marker only have the per-register interface above.
+ */
+#if defined(TARGET_ALPHA) || defined(TARGET_AVR) || defined(TARGET_HEXAGON) || \
+    defined(TARGET_HPPA) || defined(TARGET_LOONGARCH) || defined(TARGET_NIOS2) || \
+    defined(TARGET_PPC) || defined(TARGET_RISCV) || defined(TARGET_TRICORE) || \
+    defined(TARGET_XTENSA)
+#define LIBAFL_CPU_STATE_ENV_SIZE 0
+#else
+#define LIBAFL_CPU_STATE_ENV_SIZE offsetof(CPUArchState, end_reset_fields)
+#endif
+
+struct libafl_cpu_state_header {
+    uint32_t env_size;
+    int32_t exception_index;
+    uint32_t interrupt_request;
+    uint32_t halted;
+};
+
+size_t libafl_qemu_cpu_state_size(CPUState* cpu)
+{
+    if (LIBAFL_CPU_STATE_ENV_SIZE == 0) {
+        return 0;
+    }
+    return sizeof(struct libafl_cpu_state_header) + LIBAFL_CPU_STATE_ENV_SIZE;
+}
+
+size_t libafl_qemu_save_cpu_state(CPUState* cpu, void* buf)
+{
+    struct libafl_cpu_state_header* hdr = buf;
+
+    if (LIBAFL_CPU_STATE_ENV_SIZE == 0) {
+        return 0;
+    }
+
+    hdr->env_size = LIBAFL_CPU_STATE_ENV_SIZE;
+    hdr->exception_index = cpu->exception_index;
+    hdr->interrupt_request = cpu->interrupt_request;
+    hdr->halted = cpu->halted;
+    memcpy(hdr + 1, cpu->env_ptr, LIBAFL_CPU_STATE_ENV_SIZE);
+
+    return libafl_qemu_cpu_state_size(cpu);
+}
+
+int libafl_qemu_restore_cpu_state(CPUState* cpu, const void* buf)
+{
+    const struct libafl_cpu_state_header* hdr = buf;
+
+    if (LIBAFL_CPU_STATE_ENV_SIZE == 0 ||
+        hdr->env_size != LIBAFL_CPU_STATE_ENV_SIZE) {
+        return 0;
+    }
+
+#if defined(TARGET_ARM) || defined(TARGET_I386)
+    /* Architectural breakpoints/watchpoints live inside the copied region,
+     * but they point to objects owned by the CPU right now: keep them. */
+    CPUArchState *env = cpu->env_ptr;
+    struct CPUBreakpoint *bps[ARRAY_SIZE(env->cpu_breakpoint)];
+    struct CPUWatchpoint *wps[ARRAY_SIZE(env->cpu_watchpoint)];
+    memcpy(bps, env->cpu_breakpoint, sizeof(bps));
+    memcpy(wps, env->cpu_watchpoint, sizeof(wps));
+    memcpy(env, hdr + 1, LIBAFL_CPU_STATE_ENV_SIZE);
+    memcpy(env->cpu_breakpoint, bps, sizeof(bps));
+    memcpy(env->cpu_watchpoint, wps, sizeof(wps));
+#else
+    memcpy(cpu->env_ptr, hdr + 1, LIBAFL_CPU_STATE_ENV_SIZE);
+#endif
+    cpu->exception_index = hdr->exception_index;
+    qatomic_set(&cpu->interrupt_request, hdr->interrupt_request);
+    cpu->halted = hdr->halted;
+
+    /* Translation regime and cached TB flags may have changed under us */
+    tlb_flush(cpu);
+#if defined(TARGET_ARM)
+    arm_rebuild_hflags(cpu->env_ptr);
+#endif
+
+    return 1;
+}
+
 void libafl_breakpoint_invalidate(CPUState *cpu, target_ulong pc);
 
+static struct libafl_pc_entry* libafl_pc_map_find(target_ulong addr)
+{
+    struct libafl_pc_map* map = qatomic_rcu_read(&libafl_pc_map);
+    struct libafl_pc_entry* e;
+    size_t mask, idx;
+    int state;
+
+    if (map == NULL) {
+        return NULL;
+    }
+
+    mask = ((size_t)1 << map->bits) - 1;
+    idx = LIBAFL_PC_MAP_HASH(addr, map->bits);
+    while (1) {
+        e = &map->entries[idx];
+        state = qatomic_load_acquire(&e->state);
+        if (state == LIBAFL_PC_ENTRY_EMPTY) {
+            return NULL;
+        }
+        if (state == LIBAFL_PC_ENTRY_USED && e->addr == addr) {
+            return e;
+        }
+        idx = (idx + 1) & mask;
+    }
+}
+
+static void libafl_pc_map_free(struct libafl_pc_map* map)
+{
+    free(map);
+}
+
+/* Called with libafl_hooks_lock held */
+static void libafl_pc_map_resize(size_t bits)
+{
+    struct libafl_pc_map* old_map = libafl_pc_map;
+    struct libafl_pc_map* map;
+    size_t old_size = old_map ? ((size_t)1 << old_map->bits) : 0;
+    size_t mask = ((size_t)1 << bits) - 1;
+    size_t i, idx;
+
+    map = calloc(1, sizeof(struct libafl_pc_map) +
+                    ((size_t)1 << bits) * sizeof(struct libafl_pc_entry));
+    map->bits = bits;
+
+    for (i = 0; i < old_size; ++i) {
+        if (old_map->entries[i].state != LIBAFL_PC_ENTRY_USED) {
+            continue;
+        }
+        idx = LIBAFL_PC_MAP_HASH(old_map->entries[i].addr, bits);
+        while (map->entries[idx].state != LIBAFL_PC_ENTRY_EMPTY) {
+            idx = (idx + 1) & mask;
+        }
+        map->entries[idx] = old_map->entries[i];
+    }
+
+    libafl_pc_map_deleted = 0;
+    qatomic_rcu_set(&libafl_pc_map, map);
+    if (old_map) {
+        call_rcu(old_map, libafl_pc_map_free, rcu);
+    }
+}
+
+/* Called with libafl_hooks_lock held */
+static struct libafl_pc_entry* libafl_pc_map_insert(target_ulong addr)
+{
+    struct libafl_pc_entry* e = libafl_pc_map_find(addr);
+    size_t mask, idx, filter;
+
+    if (e) {
+        return e;
+    }
+
+    /* Keep the load factor (tombstones included) below 1/2 */
+    if (libafl_pc_map == NULL) {
+        libafl_pc_map_resize(LIBAFL_PC_MAP_MIN_BITS);
+    } else if ((libafl_pc_map_used + libafl_pc_map_deleted + 1) * 2 >
+               ((size_t)1 << libafl_pc_map->bits)) {
+        size_t bits = libafl_pc_map->bits;
+        if ((libafl_pc_map_used + 1) * 4 > ((size_t)1 << bits)) {
+            bits++;
+        }
+        libafl_pc_map_resize(bits);
+    }
+
+    /* Tombstones are not reused, a lookup might still be looking at them */
+    mask = ((size_t)1 << libafl_pc_map->bits) - 1;
+    idx = LIBAFL_PC_MAP_HASH(addr, libafl_pc_map->bits);
+    while (libafl_pc_map->entries[idx].state != LIBAFL_PC_ENTRY_EMPTY) {
+        idx = (idx + 1) & mask;
+    }
+
+    e = &libafl_pc_map->entries[idx];
+    e->addr = addr;
+    e->hooks = NULL;
+    e->breakpoints = 0;
+    qatomic_store_release(&e->state, LIBAFL_PC_ENTRY_USED);
+    libafl_pc_map_used++;
+
+    filter = LIBAFL_PAGE_FILTER_IDX(addr);
+    qatomic_set(&libafl_page_filter[filter], libafl_page_filter[filter] + 1);
+
+    return e;
+}
+
+/*
+ * Drop the entry once nothing is registered at its pc anymore. Called with
+ * libafl_hooks_lock held.
+ */
+static void libafl_pc_map_release(struct libafl_pc_entry* e)
+{
+    size_t filter;
+
+    if (e->hooks || e->breakpoints) {
+        return;
+    }
+
+    filter = LIBAFL_PAGE_FILTER_IDX(e->addr);
+    qatomic_set(&libafl_page_filter[filter], libafl_page_filter[filter] - 1);
+    qatomic_store_release(&e->state, LIBAFL_PC_ENTRY_DELETED);
+    libafl_pc_map_used--;
+    libafl_pc_map_deleted++;
+}
+
+static void libafl_hook_free(struct rcu_head* rcu)
+{
+    free(container_of(rcu, struct libafl_hook, rcu));
+}
+
+/* Must be called under RCU, the entry and its hooks are freed afterwards */
+struct libafl_pc_entry* libafl_qemu_lookup_pc(target_ulong addr)
+{
+    if (likely(qatomic_read(&libafl_page_filter[LIBAFL_PAGE_FILTER_IDX(addr)]) == 0)) {
+        return NULL;
+    }
+
+    return libafl_pc_map_find(addr);
+}
+
+/*
+ * The functions below publish their change before invalidating the code
+ * at pc, so a vCPU that retranslates it in between already sees it.
+ */
+
 int libafl_qemu_set_breakpoint(target_ulong pc)
 {
+    struct libafl_pc_entry* e;
     CPUState *cpu;
 
+    qemu_mutex_lock(&libafl_hooks_lock);
+    e = libafl_pc_map_insert(pc);
+    qatomic_set(&e->breakpoints, e->breakpoints + 1);
+    qemu_mutex_unlock(&libafl_hooks_lock);
+
     CPU_FOREACH(cpu) {
         libafl_breakpoint_invalidate(cpu, pc);
     }
-
-    struct libafl_breakpoint* bp = malloc(sizeof(struct libafl_breakpoint));
-    bp->addr = pc;
-    bp->next = libafl_qemu_breakpoints;
-    libafl_qemu_breakpoints = bp;
     return 1;
 }
 
 int libafl_qemu_remove_breakpoint(target_ulong pc)
 {
+    struct libafl_pc_entry* e;
     CPUState *cpu;
-    int r = 0;
 
-    struct libafl_breakpoint** bp = &libafl_qemu_breakpoints;
-    while (*bp) {
-        if ((*bp)->addr == pc) {
-            CPU_FOREACH(cpu) {
-                libafl_breakpoint_invalidate(cpu, pc);
-            }
+    qemu_mutex_lock(&libafl_hooks_lock);
+    e = libafl_pc_map_find(pc);
+    if (e == NULL || e->breakpoints == 0) {
+        qemu_mutex_unlock(&libafl_hooks_lock);
+        return 0;
+    }
 
-            *bp = (*bp)->next;
-            r = 1;
-        } else {
-            bp = &(*bp)->next;
-        }
+    qatomic_set(&e->breakpoints, 0);
+    libafl_pc_map_release(e);
+    qemu_mutex_unlock(&libafl_hooks_lock);
+
+    CPU_FOREACH(cpu) {
+        libafl_breakpoint_invalidate(cpu, pc);
     }
-    return r;
+    return 1;
 }
 
 size_t libafl_qemu_set_hook(target_ulong pc, void (*callback)(target_ulong, uint64_t),
                             uint64_t data, int invalidate)
 {
+    struct libafl_pc_entry* e;
+    struct libafl_hook* hk;
     CPUState *cpu;
+    size_t num;
 
-    if (invalidate) {
-        CPU_FOREACH(cpu) {
-            libafl_breakpoint_invalidate(cpu, pc);
-        }
-    }
-
-    size_t idx = LIBAFL_TABLES_HASH(pc);
-
-    struct libafl_hook* hk = malloc(sizeof(struct libafl_hook));
+    hk = malloc(sizeof(struct libafl_hook));
     hk->addr = pc;
     hk->callback = callback;
     hk->data = data;
@@ -232,34 +511,64 @@ size_t libafl_qemu_set_hook(target_ulong pc, void (*callback)(target_ulong, uint
     hk->helper_info.name = "libafl_hook";
     hk->helper_info.flags = dh_callflag(void);
     hk->helper_info.typemask = dh_typemask(void, 0) | dh_typemask(tl, 1) | dh_typemask(i64, 2);
-    hk->num = libafl_qemu_hooks_num++;
-    hk->next = libafl_qemu_hooks[idx];
-    libafl_qemu_hooks[idx] = hk;
+    /* Translation must find the helper as soon as it can see the hook */
     libafl_helper_table_add(&hk->helper_info);
-    return hk->num;
+
+    qemu_mutex_lock(&libafl_hooks_lock);
+
+    if (libafl_qemu_hooks_num == libafl_qemu_hooks_by_num_size) {
+        libafl_qemu_hooks_by_num_size = libafl_qemu_hooks_by_num_size ?
+            libafl_qemu_hooks_by_num_size * 2 : 64;
+        libafl_qemu_hooks_by_num = realloc(libafl_qemu_hooks_by_num,
+            libafl_qemu_hooks_by_num_size * sizeof(struct libafl_hook*));
+    }
+
+    e = libafl_pc_map_insert(pc);
+    num = libafl_qemu_hooks_num++;
+    hk->num = num;
+    hk->next = e->hooks;
+    libafl_qemu_hooks_by_num[num] = hk;
+    qatomic_rcu_set(&e->hooks, hk);
+
+    qemu_mutex_unlock(&libafl_hooks_lock);
+
+    if (invalidate) {
+        CPU_FOREACH(cpu) {
+            libafl_breakpoint_invalidate(cpu, pc);
+        }
+    }
+    return num;
 }
 
 size_t libafl_qemu_remove_hooks_at(target_ulong addr, int invalidate)
 {
+    struct libafl_pc_entry* e;
+    struct libafl_hook* hk;
     CPUState *cpu;
     size_t r = 0;
-    
-    size_t idx = LIBAFL_TABLES_HASH(addr);
-    struct libafl_hook** hk = &libafl_qemu_hooks[idx];
-    while (*hk) {
-        if ((*hk)->addr == addr) {
-            if (invalidate) {
-                CPU_FOREACH(cpu) {
-                    libafl_breakpoint_invalidate(cpu, addr);
-                }
-            }
-
-            void *tmp = *hk;
-            *hk = (*hk)->next;
-            free(tmp);
-            r++;
-        } else {
-            hk = &(*hk)->next;
+
+    qemu_mutex_lock(&libafl_hooks_lock);
+    e = libafl_pc_map_find(addr);
+    if (e == NULL || e->hooks == NULL) {
+        qemu_mutex_unlock(&libafl_hooks_lock);
+        return 0;
+    }
+
+    hk = e->hooks;
+    qatomic_rcu_set(&e->hooks, NULL);
+    while (hk) {
+        struct libafl_hook* tmp = hk;
+        hk = hk->next;
+        libafl_qemu_hooks_by_num[tmp->num] = NULL;
+        call_rcu1(&tmp->rcu, libafl_hook_free);
+        r++;
+    }
+    libafl_pc_map_release(e);
+    qemu_mutex_unlock(&libafl_hooks_lock);
+
+    if (invalidate) {
+        CPU_FOREACH(cpu) {
+            libafl_breakpoint_invalidate(cpu, addr);
         }
     }
     return r;
@@ -267,44 +576,45 @@ size_t libafl_qemu_remove_hooks_at(target_ulong addr, int invalidate)
 
 int libafl_qemu_remove_hook(size_t num, int invalidate)
 {
+    struct libafl_pc_entry* e;
+    struct libafl_hook* target;
+    struct libafl_hook** hk;
+    target_ulong addr;
     CPUState *cpu;
-    size_t idx;
-    
-    for (idx = 0; idx < LIBAFL_TABLES_SIZE; ++idx) {
-        struct libafl_hook** hk = &libafl_qemu_hooks[idx];
-        while (*hk) {
-            if ((*hk)->num == num) {
-                if (invalidate) {
-                    CPU_FOREACH(cpu) {
-                        libafl_breakpoint_invalidate(cpu, (*hk)->addr);
-                    }
-                }
-
-                void *tmp = *hk;
-                *hk = (*hk)->next;
-                free(tmp);
-                return 1;
-            } else {
-                hk = &(*hk)->next;
-            }
+
+    qemu_mutex_lock(&libafl_hooks_lock);
+    if (num >= libafl_qemu_hooks_num || libafl_qemu_hooks_by_num[num] == NULL) {
+        qemu_mutex_unlock(&libafl_hooks_lock);
+        return 0;
+    }
+
+    target = libafl_qemu_hooks_by_num[num];
+    addr = target->addr;
+    e = libafl_pc_map_find(addr);
+    hk = &e->hooks;
+    while (*hk != target) {
+        hk = &(*hk)->next;
+    }
+
+    qatomic_rcu_set(hk, target->next);
+    libafl_qemu_hooks_by_num[num] = NULL;
+    call_rcu1(&target->rcu, libafl_hook_free);
+    libafl_pc_map_release(e);
+    qemu_mutex_unlock(&libafl_hooks_lock);
+
+    if (invalidate) {
+        CPU_FOREACH(cpu) {
+            libafl_breakpoint_invalidate(cpu, addr);
         }
     }
-    return 0;
+    return 1;
 }
 
+/* Must be called under RCU */
 struct libafl_hook* libafl_search_hook(target_ulong addr)
 {
-    size_t idx = LIBAFL_TABLES_HASH(addr);
-
-    struct libafl_hook* hk = libafl_qemu_hooks[idx];
-    while (hk) {
-        if (hk->addr == addr) {
-            return hk;
-        }
-        hk = hk->next;
-    }
-    
-    return NULL;
+    struct libafl_pc_entry* e = libafl_qemu_lookup_pc(addr);
+    return e ? qatomic_rcu_read(&e->hooks) : NULL;
 }
 
 void libafl_flush_jit(void)
@@ -26,18 +26,42 @@
 #include "qemu/osdep.h"
 #include "qemu/units.h"
 #include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "hw/qdev-properties.h"
 #include "hw/boards.h"
 #include "hw/loader.h"
 #include "hw/arm/psp.h"
+#include "qemu/cutils.h"
+#include "sysemu/reset.h"
+#include "qemu/main-loop.h"
+#include "exec/exec-all.h"
 
 /* Setup inspired from raspi.c */
 
+/* Server parts have one PSP per die, selected with "-smp <dies>" */
 typedef struct AmdPspMachineState {
     /*< private >*/
     MachineState parent_obj;
     /*< public >*/
     AmdPspState soc;
+
+    /* The PSPs of the other dies, each in its own address space */
+    AmdPspState slaves[AMD_PSP_MAX_DIES - 1];
+    MemoryRegion slave_mem[AMD_PSP_MAX_DIES - 1];
+
+    //// +++ Begin ASPFuzz code +++
+    /* Checkpoint file and the PC at which it is taken */
+    char *checkpoint;
+    uint32_t checkpoint_pc;
+    bool checkpoint_pc_set;
+    bool checkpoint_taken;
+    /* Hook at checkpoint_pc, removed once the checkpoint is written */
+    size_t checkpoint_hook;
+
+    /* Mapping of an existing checkpoint, applied on every reset */
+    uint8_t *checkpoint_map;
+    size_t checkpoint_map_size;
+    //// +++ End ASPFuzz code +++
 } AmdPspMachineState;
 
 typedef struct AmdPspMachineClass {
@@ -59,10 +83,312 @@ static const char * soc_versions[] = {
 DECLARE_OBJ_CHECKERS(AmdPspMachineState, AmdPspMachineClass,
                      AMD_PSP_MACHINE, TYPE_AMD_PSP_MACHINE)
 
+//// +++ Begin ASPFuzz code +++
+/*
+ * Post-bootloader checkpoint. With "-machine checkpoint=<file>" the first
+ * run saves the machine state to <file> when the CPU reaches
+ * "checkpoint-pc", and keeps running. Later runs map <file> and reset
+ * straight into that state instead of running the on-chip bootloader again.
+ *
+ * The file holds a header, SRAM, ROM, the CPU and PSP device state and the
+ * flash pages that differ from the flash image.
+ */
+#define ASPFUZZ_CHECKPOINT_MAGIC   0x43505341 /* "ASPC" */
+#define ASPFUZZ_CHECKPOINT_VERSION 1
+#define ASPFUZZ_CHECKPOINT_PAGE    4096
+
+typedef struct AspfuzzCheckpointHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t gen;
+    uint32_t pc;
+    uint64_t sram_size;
+    uint64_t rom_size;
+    uint64_t cpu_size;
+    uint64_t dev_size;
+    /* Number of flash pages, each stored as a uint64_t offset + data */
+    uint64_t flash_pages;
+} AspfuzzCheckpointHeader;
+
+size_t libafl_qemu_cpu_state_size(CPUState* cpu);
+size_t libafl_qemu_save_cpu_state(CPUState* cpu, void* buf);
+int libafl_qemu_restore_cpu_state(CPUState* cpu, const void* buf);
+size_t libafl_qemu_set_hook(target_ulong pc, void (*callback)(target_ulong, uint64_t),
+                            uint64_t data, int invalidate);
+int libafl_qemu_remove_hook(size_t num, int invalidate);
+
+size_t aspfuzz_psp_state_size(void);
+void aspfuzz_psp_save_state(void *buf);
+void aspfuzz_psp_restore_state(const void *buf);
+
+static bool aspfuzz_checkpoint_write(int fd, const void *buf, size_t len) {
+    return qemu_write_full(fd, buf, len) == len;
+}
+
+static void aspfuzz_checkpoint_save(AmdPspMachineState *ms, Error **errp) {
+    AmdPspMachineClass *mc = AMD_PSP_MACHINE_GET_CLASS(ms);
+    PSPSmnFlashState *flash = &ms->soc.smn.psp_smn_flash;
+    CPUState *cpu = CPU(&ms->soc.cpu);
+    AspfuzzCheckpointHeader hdr = { 0 };
+    g_autofree char *tmp = NULL;
+    g_autofree uint8_t *cpu_buf = NULL;
+    g_autofree uint8_t *dev_buf = NULL;
+    uint8_t *flash_ptr;
+    uint64_t off;
+    bool ok;
+    int fd;
+
+    hdr.magic = ASPFUZZ_CHECKPOINT_MAGIC;
+    hdr.version = ASPFUZZ_CHECKPOINT_VERSION;
+    hdr.gen = mc->gen;
+    hdr.pc = ms->checkpoint_pc;
+    hdr.sram_size = memory_region_size(&ms->soc.sram);
+    hdr.rom_size = memory_region_size(&ms->soc.rom);
+    hdr.cpu_size = libafl_qemu_cpu_state_size(cpu);
+    hdr.dev_size = aspfuzz_psp_state_size();
+
+    cpu_buf = g_malloc(hdr.cpu_size);
+    libafl_qemu_save_cpu_state(cpu, cpu_buf);
+    dev_buf = g_malloc(hdr.dev_size);
+    aspfuzz_psp_save_state(dev_buf);
+
+    flash_ptr = qemu_map_ram_ptr(flash->psp_smn_flash.ram_block, 0);
+    for (off = 0; off < PSP_SMN_FLASH_SIZE_16; off += ASPFUZZ_CHECKPOINT_PAGE) {
+        if (memcmp(flash_ptr + off, flash->pristine + off,
+                   ASPFUZZ_CHECKPOINT_PAGE)) {
+            hdr.flash_pages++;
+        }
+    }
+
+    /* Write to a private file first, concurrent first runs race on "rename" */
+    tmp = g_strdup_printf("%s.%d", ms->checkpoint, (int)getpid());
+    fd = qemu_create(tmp, O_WRONLY | O_TRUNC, 0644, errp);
+    if (fd < 0) {
+        return;
+    }
+
+    ok = aspfuzz_checkpoint_write(fd, &hdr, sizeof(hdr)) &&
+         aspfuzz_checkpoint_write(fd, memory_region_get_ram_ptr(&ms->soc.sram),
+                                  hdr.sram_size) &&
+         aspfuzz_checkpoint_write(fd, memory_region_get_ram_ptr(&ms->soc.rom),
+                                  hdr.rom_size) &&
+         aspfuzz_checkpoint_write(fd, cpu_buf, hdr.cpu_size) &&
+         aspfuzz_checkpoint_write(fd, dev_buf, hdr.dev_size);
+
+    for (off = 0; ok && off < PSP_SMN_FLASH_SIZE_16;
+         off += ASPFUZZ_CHECKPOINT_PAGE) {
+        if (memcmp(flash_ptr + off, flash->pristine + off,
+                   ASPFUZZ_CHECKPOINT_PAGE)) {
+            ok = aspfuzz_checkpoint_write(fd, &off, sizeof(off)) &&
+                 aspfuzz_checkpoint_write(fd, flash_ptr + off,
+                                          ASPFUZZ_CHECKPOINT_PAGE);
+        }
+    }
+
+    close(fd);
+    if (!ok || rename(tmp, ms->checkpoint) < 0) {
+        error_setg_errno(errp, errno, "Couldn't write checkpoint %s",
+                         ms->checkpoint);
+        unlink(tmp);
+        return;
+    }
+    info_report("Checkpoint written to %s at pc 0x%x", ms->checkpoint,
+                ms->checkpoint_pc);
+}
+
+static void aspfuzz_checkpoint_hook(target_ulong pc, uint64_t data) {
+    AmdPspMachineState *ms = (AmdPspMachineState *)(uintptr_t)data;
+    Error *err = NULL;
+
+    if (ms->checkpoint_taken) {
+        return;
+    }
+    ms->checkpoint_taken = true;
+
+    /* Bring the CPU state up to date with the start of this instruction */
+    cpu_restore_state(current_cpu, GETPC(), false);
+
+    qemu_mutex_lock_iothread();
+    aspfuzz_checkpoint_save(ms, &err);
+    /* Freed after this callback returns, the hook is RCU protected */
+    libafl_qemu_remove_hook(ms->checkpoint_hook, 1);
+    qemu_mutex_unlock_iothread();
+    if (err) {
+        warn_report_err(err);
+    }
+}
+
+/* Map an existing checkpoint and check that it fits this machine */
+static bool aspfuzz_checkpoint_map(AmdPspMachineState *ms, Error **errp) {
+    AmdPspMachineClass *mc = AMD_PSP_MACHINE_GET_CLASS(ms);
+    const AspfuzzCheckpointHeader *hdr;
+    struct stat st;
+    uint64_t need;
+    void *map;
+    int fd;
+
+    fd = qemu_open(ms->checkpoint, O_RDONLY, errp);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr)) {
+        error_setg(errp, "Checkpoint %s is truncated", ms->checkpoint);
+        close(fd);
+        return false;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Couldn't map checkpoint %s",
+                         ms->checkpoint);
+        return false;
+    }
+
+    hdr = map;
+    need = sizeof(*hdr) + hdr->sram_size + hdr->rom_size + hdr->cpu_size +
+           hdr->dev_size + hdr->flash_pages *
+           (sizeof(uint64_t) + ASPFUZZ_CHECKPOINT_PAGE);
+    if (hdr->magic != ASPFUZZ_CHECKPOINT_MAGIC ||
+        hdr->version != ASPFUZZ_CHECKPOINT_VERSION ||
+        hdr->gen != mc->gen ||
+        hdr->sram_size != memory_region_size(&ms->soc.sram) ||
+        hdr->rom_size != memory_region_size(&ms->soc.rom) ||
+        hdr->cpu_size != libafl_qemu_cpu_state_size(CPU(&ms->soc.cpu)) ||
+        hdr->dev_size != aspfuzz_psp_state_size() ||
+        hdr->flash_pages > PSP_SMN_FLASH_SIZE_16 / ASPFUZZ_CHECKPOINT_PAGE ||
+        need != st.st_size) {
+        error_setg(errp, "Checkpoint %s doesn't match this machine",
+                   ms->checkpoint);
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    ms->checkpoint_map = map;
+    ms->checkpoint_map_size = st.st_size;
+    return true;
+}
+
+static void aspfuzz_checkpoint_apply(AmdPspMachineState *ms) {
+    const AspfuzzCheckpointHeader *hdr = (void *)ms->checkpoint_map;
+    PSPSmnFlashState *flash = &ms->soc.smn.psp_smn_flash;
+    CPUState *cpu = CPU(&ms->soc.cpu);
+    const uint8_t *p = (const uint8_t *)(hdr + 1);
+    uint8_t *flash_ptr;
+    uint64_t i, off;
+
+    memcpy(memory_region_get_ram_ptr(&ms->soc.sram), p, hdr->sram_size);
+    p += hdr->sram_size;
+    memcpy(memory_region_get_ram_ptr(&ms->soc.rom), p, hdr->rom_size);
+    p += hdr->rom_size;
+    libafl_qemu_restore_cpu_state(cpu, p);
+    p += hdr->cpu_size;
+    aspfuzz_psp_restore_state(p);
+    p += hdr->dev_size;
+
+    /* The checkpointed flash becomes the image that inputs are undone to */
+    flash_ptr = qemu_map_ram_ptr(flash->psp_smn_flash.ram_block, 0);
+    for (i = 0; i < hdr->flash_pages; i++) {
+        memcpy(&off, p, sizeof(off));
+        p += sizeof(off);
+        if (off <= PSP_SMN_FLASH_SIZE_16 - ASPFUZZ_CHECKPOINT_PAGE) {
+            memcpy(flash_ptr + off, p, ASPFUZZ_CHECKPOINT_PAGE);
+            memcpy(flash->pristine + off, p, ASPFUZZ_CHECKPOINT_PAGE);
+        }
+        p += ASPFUZZ_CHECKPOINT_PAGE;
+    }
+
+    /* Code was replaced behind the TCG's back */
+    tb_flush(cpu);
+}
+
+static void aspfuzz_machine_reset(MachineState *machine) {
+    AmdPspMachineState *ms = AMD_PSP_MACHINE(machine);
+
+    qemu_devices_reset();
+
+    /* After the device reset, which reloads the ROM blobs */
+    if (ms->checkpoint_map) {
+        aspfuzz_checkpoint_apply(ms);
+    }
+}
+
+static void aspfuzz_checkpoint_init(AmdPspMachineState *ms) {
+    Error *err = NULL;
+
+    if (ms->checkpoint == NULL) {
+        return;
+    }
+
+    if (!ms->checkpoint_pc_set) {
+        error_report("checkpoint requires checkpoint-pc");
+        exit(1);
+    }
+
+    if (MACHINE(ms)->smp.cpus > 1) {
+        error_report("Checkpoints are only supported with a single PSP");
+        exit(1);
+    }
+
+    if (libafl_qemu_cpu_state_size(CPU(&ms->soc.cpu)) == 0) {
+        error_report("Checkpoints are not supported for this CPU");
+        exit(1);
+    }
+
+    if (access(ms->checkpoint, F_OK) == 0) {
+        if (!aspfuzz_checkpoint_map(ms, &err)) {
+            error_report_err(err);
+            exit(1);
+        }
+        return;
+    }
+
+    /* First run: take the checkpoint when the CPU gets there */
+    ms->checkpoint_hook = libafl_qemu_set_hook(ms->checkpoint_pc,
+                                               aspfuzz_checkpoint_hook,
+                                               (uint64_t)(uintptr_t)ms, 0);
+}
+//// +++ End ASPFuzz code +++
+
+/*
+ * The PSPs of the other dies. They have their own CPU, SRAM and devices, run
+ * the master's on-chip ROM and share the master's SMN address space.
+ */
+static void zen_init_slaves(AmdPspMachineState *ms, unsigned int dies) {
+    AmdPspMachineClass *mc = AMD_PSP_MACHINE_GET_CLASS(ms);
+    unsigned int i;
+
+    for (i = 1; i < dies; i++) {
+        AmdPspState *psp = &ms->slaves[i - 1];
+        MemoryRegion *mem = &ms->slave_mem[i - 1];
+        g_autofree char *name = g_strdup_printf("soc-die%u", i);
+        g_autofree char *mem_name = g_strdup_printf("psp-die%u", i);
+
+        memory_region_init(mem, OBJECT(ms), mem_name, 4 * GiB);
+
+        object_initialize_child(OBJECT(ms), name, psp, soc_versions[mc->gen]);
+        qdev_prop_set_uint32(DEVICE(psp), "die-id", i);
+        object_property_set_link(OBJECT(psp), "memory", OBJECT(mem),
+                                 &error_abort);
+        object_property_set_link(OBJECT(psp), "smn-fabric",
+                                 OBJECT(&ms->soc.smn), &error_abort);
+        object_property_set_link(OBJECT(psp), "rom-source",
+                                 OBJECT(&ms->soc.rom), &error_abort);
+        qdev_realize(DEVICE(psp), NULL, &error_fatal);
+
+        psp->cpu.env.regs[15] = 0xffff0000;
+    }
+}
+
 static void zen_init_common(MachineState *machine) {
     AmdPspMachineState *ms = AMD_PSP_MACHINE(machine);
     AmdPspMachineClass *mc = AMD_PSP_MACHINE_GET_CLASS(machine);
 
+    if (machine->smp.max_cpus != machine->smp.cpus) {
+        error_report("One PSP per CPU, maxcpus has to match the number of "
+                     "CPUs (%u)", machine->smp.cpus);
+        exit(1);
+    }
+
     /* Initialize Soc */
     object_initialize_child(OBJECT(machine), "soc", &ms->soc, soc_versions[mc->gen]);
     qdev_realize(DEVICE(&ms->soc), NULL, &error_fatal);
@@ -72,6 +398,13 @@ static void zen_init_common(MachineState *machine) {
      */
     ms->soc.cpu.env.regs[15] = 0xffff0000;
 
+    /* The master's CPU comes first and runs the harness */
+    zen_init_slaves(ms, machine->smp.cpus);
+
+    //// +++ Begin ASPFuzz code +++
+    aspfuzz_checkpoint_init(ms);
+    //// +++ End ASPFuzz code +++
+
     /* TODO trigger on -kernel flag if it is provided */
     /* TODO can we maybe use -pflash flag for off chip bl? */
     /* TODO consider emulating/skipping on-chip-bl if not set */
@@ -81,7 +414,8 @@ static void psp_zen_machine_common_init(MachineClass *mc) {
     mc->desc = "AMD PSP";
     mc->init = zen_init_common;
     mc->block_default_type = IF_NONE;
-    mc->min_cpus = mc->max_cpus = mc->default_cpus = 1;
+    mc->min_cpus = mc->default_cpus = 1;
+    mc->max_cpus = AMD_PSP_MAX_DIES;
     mc->default_cpu_type = ARM_CPU_TYPE_NAME("cortex-a9");
     /* 
      * hw/core/generic_loader.c     line 157
@@ -91,6 +425,9 @@ static void psp_zen_machine_common_init(MachineClass *mc) {
      */
     mc->default_ram_size = 1 * GiB;
     mc->default_ram_id = "psp-ram";
+    //// +++ Begin ASPFuzz code +++
+    mc->reset = aspfuzz_machine_reset;
+    //// +++ End ASPFuzz code +++
 }
 
 static void psp_zen_machine_init(ObjectClass *oc, void *data) {
@@ -128,6 +465,51 @@ static void psp_zen_tesla_machine_init(ObjectClass *oc, void *data) {
     psp_zen_machine_common_init(mc);
 }
 
+//// +++ Begin ASPFuzz code +++
+static char *amd_psp_machine_get_checkpoint(Object *obj, Error **errp) {
+    AmdPspMachineState *ms = AMD_PSP_MACHINE(obj);
+
+    return g_strdup(ms->checkpoint);
+}
+
+static void amd_psp_machine_set_checkpoint(Object *obj, const char *value,
+                                           Error **errp) {
+    AmdPspMachineState *ms = AMD_PSP_MACHINE(obj);
+
+    g_free(ms->checkpoint);
+    ms->checkpoint = g_strdup(value);
+}
+
+static void amd_psp_machine_get_checkpoint_pc(Object *obj, Visitor *v,
+                                              const char *name, void *opaque,
+                                              Error **errp) {
+    AmdPspMachineState *ms = AMD_PSP_MACHINE(obj);
+
+    visit_type_uint32(v, name, &ms->checkpoint_pc, errp);
+}
+
+static void amd_psp_machine_set_checkpoint_pc(Object *obj, Visitor *v,
+                                              const char *name, void *opaque,
+                                              Error **errp) {
+    AmdPspMachineState *ms = AMD_PSP_MACHINE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    ms->checkpoint_pc = value;
+    ms->checkpoint_pc_set = true;
+}
+
+static void amd_psp_machine_instance_init(Object *obj) {
+    object_property_add_str(obj, "checkpoint", amd_psp_machine_get_checkpoint,
+                            amd_psp_machine_set_checkpoint);
+    object_property_add(obj, "checkpoint-pc", "uint32",
+                        amd_psp_machine_get_checkpoint_pc,
+                        amd_psp_machine_set_checkpoint_pc, NULL, NULL);
+}
+//// +++ End ASPFuzz code +++
+
 static const TypeInfo amd_psp_machine_types[] = {
     {
         .name           = MACHINE_TYPE_NAME("amd-psp-zen"),
@@ -153,6 +535,7 @@ static const TypeInfo amd_psp_machine_types[] = {
         .name           = TYPE_AMD_PSP_MACHINE,
         .parent         = TYPE_MACHINE,
         .instance_size  = sizeof(AmdPspMachineState),
+        .instance_init  = amd_psp_machine_instance_init,
         .class_size     = sizeof(AmdPspMachineClass),
         .abstract       = true,
     }
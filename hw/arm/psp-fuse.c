@@ -12,6 +12,7 @@
 #include "hw/sysbus.h"
 #include "hw/qdev-properties.h"
 #include "hw/arm/psp-fuse.h"
+#include "migration/vmstate.h"
 #include "trace.h"
 
 static uint64_t psp_fuse_read(void *opaque, hwaddr offset, unsigned int size) {
@@ -51,10 +52,21 @@ static Property psp_fuse_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
+/* The fuses are read-only, "dbg_mode" is a machine property */
+static const VMStateDescription vmstate_psp_fuse = {
+    .name = TYPE_PSP_FUSE,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void psp_fuse_class_init(ObjectClass *klass, void * data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = psp_fuse_realize;
+    dc->vmsd = &vmstate_psp_fuse;
     device_class_set_props(dc, psp_fuse_properties);
 }
 
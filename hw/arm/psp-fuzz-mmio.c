@@ -0,0 +1,154 @@
+/*
+ * AMD PSP emulation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "hw/arm/psp-fuzz-mmio.h"
+#include "trace.h"
+
+/* Consumed pieces beyond this are not logged, but still counted */
+#define ASPFUZZ_MMIO_INPUT_LOG_SIZE 65536
+
+#define ASPFUZZ_MMIO_MAX_DEVICES 32
+
+/*
+ * The current input. Only accessed from MMIO handlers, i.e. with the iothread
+ * lock held, and from the harness while the vCPU is stopped.
+ */
+static const uint8_t *aspfuzz_mmio_input;
+static size_t aspfuzz_mmio_input_len;
+static size_t aspfuzz_mmio_input_pos;
+
+static AspfuzzMmioInputRecord aspfuzz_mmio_input_records[ASPFUZZ_MMIO_INPUT_LOG_SIZE];
+static size_t aspfuzz_mmio_input_nrecords;
+
+static const char *aspfuzz_mmio_devices[ASPFUZZ_MMIO_MAX_DEVICES];
+static uint16_t aspfuzz_mmio_ndevices;
+
+/*
+ * Install the input for the next run and rewind it. The buffer is not copied
+ * and has to stay valid until it is replaced; NULL disables fuzzed reads.
+ */
+void aspfuzz_set_mmio_input(const uint8_t *buf, size_t len);
+void aspfuzz_set_mmio_input(const uint8_t *buf, size_t len) {
+    aspfuzz_mmio_input = buf;
+    aspfuzz_mmio_input_len = buf ? len : 0;
+    aspfuzz_mmio_input_pos = 0;
+    aspfuzz_mmio_input_nrecords = 0;
+}
+
+/* Number of input bytes consumed since the input was installed */
+size_t aspfuzz_mmio_input_consumed(void);
+size_t aspfuzz_mmio_input_consumed(void) {
+    return aspfuzz_mmio_input_pos;
+}
+
+/*
+ * The consumed pieces in input order. "total" counts all of them, the first
+ * "n" are logged.
+ */
+const AspfuzzMmioInputRecord *aspfuzz_mmio_input_log(size_t *n, size_t *total);
+const AspfuzzMmioInputRecord *aspfuzz_mmio_input_log(size_t *n, size_t *total) {
+    *total = aspfuzz_mmio_input_nrecords;
+    *n = MIN(aspfuzz_mmio_input_nrecords, ASPFUZZ_MMIO_INPUT_LOG_SIZE);
+    return aspfuzz_mmio_input_records;
+}
+
+/* Name of the device a record's "device" refers to */
+const char *aspfuzz_mmio_input_device(uint16_t id);
+const char *aspfuzz_mmio_input_device(uint16_t id) {
+    return id < aspfuzz_mmio_ndevices ? aspfuzz_mmio_devices[id] : NULL;
+}
+
+static bool psp_fuzz_mmio_parse_ranges(PSPFuzzMmio *f, const char *name,
+                                       Error **errp) {
+    const char *p = f->ranges_str;
+    uint64_t start, end;
+
+    f->nranges = 0;
+    while (p && *p) {
+        if (f->nranges == PSP_FUZZ_MMIO_MAX_RANGES) {
+            error_setg(errp, "%s: More than %d fuzz-ranges", name,
+                       PSP_FUZZ_MMIO_MAX_RANGES);
+            return false;
+        }
+        if (qemu_strtou64(p, &p, 0, &start) < 0 || *p != '-' ||
+            qemu_strtou64(p + 1, &p, 0, &end) < 0 ||
+            (*p != ',' && *p != '\0') || end < start) {
+            error_setg(errp, "%s: Invalid fuzz-ranges \"%s\", expected "
+                       "start-end[,start-end...]", name, f->ranges_str);
+            return false;
+        }
+        f->ranges[f->nranges].start = start;
+        f->ranges[f->nranges].end = end;
+        f->nranges++;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return true;
+}
+
+bool psp_fuzz_mmio_realize(PSPFuzzMmio *f, const char *name, Error **errp) {
+    if (!psp_fuzz_mmio_parse_ranges(f, name, errp)) {
+        return false;
+    }
+
+    f->active = f->unimp || f->nranges;
+    if (!f->active) {
+        return true;
+    }
+
+    if (aspfuzz_mmio_ndevices == ASPFUZZ_MMIO_MAX_DEVICES) {
+        error_setg(errp, "%s: Too many devices with fuzzed MMIO", name);
+        return false;
+    }
+    f->id = aspfuzz_mmio_ndevices++;
+    aspfuzz_mmio_devices[f->id] = name;
+    return true;
+}
+
+bool psp_fuzz_mmio_consume(PSPFuzzMmio *f, hwaddr addr, unsigned int size,
+                           bool implemented, uint64_t *val) {
+    AspfuzzMmioInputRecord *r;
+    size_t pos = aspfuzz_mmio_input_pos;
+    bool selected = f->unimp && !implemented;
+    uint32_t i;
+
+    for (i = 0; !selected && i < f->nranges; i++) {
+        selected = addr >= f->ranges[i].start && addr <= f->ranges[i].end;
+    }
+    if (!selected || size > aspfuzz_mmio_input_len - pos) {
+        return false;
+    }
+
+    *val = ldn_le_p(aspfuzz_mmio_input + pos, size);
+    aspfuzz_mmio_input_pos = pos + size;
+
+    if (aspfuzz_mmio_input_nrecords < ASPFUZZ_MMIO_INPUT_LOG_SIZE) {
+        r = &aspfuzz_mmio_input_records[aspfuzz_mmio_input_nrecords];
+        r->input_off = pos;
+        r->device = f->id;
+        r->size = size;
+        r->addr = addr;
+    }
+    aspfuzz_mmio_input_nrecords++;
+
+    trace_psp_fuzz_mmio_read(f->id, addr, *val, size, pos);
+    return true;
+}
@@ -32,159 +32,258 @@
 #include "hw/arm/psp.h"
 #include "qemu/log.h"
 #include "hw/arm/psp-misc.h"
+#include "migration/vmstate.h"
 #include "trace-hw_arm.h"
+#include "qemu/cutils.h"
 
 /* TODO make values offset based only starting from mmio base */
 /* TODO needs desperate rework. Rework to different classes or move into
  * its according file
  */
 
-/* Look up misc values from the smn memory space
- * @addr The phys address in the smn memory
- * @val The loaded value
- * @return If a value was found
- * TODO pass PSPMisc ref for ZEN version dependent values
+/* Built-in registers, used by every generation. All of them are read-only.
+ * The values below were found on Zen/Zen+ and Zen 2 but are served on all
+ * generations; a register file can override them per generation.
  */
-static int psp_misc_load_value(hwaddr addr, uint64_t * val)
-{
-    switch (addr){
-
-    case 0x5b304:
-        /* Read by the on chip bootloader and acted upon. */
-        *val = 0xffffffff; break;
-
-    case 0x5bb04:
-        /* Read by the on chip bootloader and acted upon. TODO verify */
-        *val = 0xffffffff; break;
-
-    case 0x5e000:
-        /* The on chip bootloader waits for bit 0 to go 1 */
-        *val = 0x1; break;
-
-    case 0x5d0cc:
-        /* The off chip bootloader wants bit 5 to be one, otherwise it returns an error
-         * dubbed PSPSTATUS_CCX_SEC_BISI_EN_NOT_SET_IN_FUSE_RAM. */
-        *val = BIT(5); break;
-
-    case 0x01025034:
-        /* Read by the on chip bootloader and acted upon. */
-        *val = 0x1e113; break;
-
-    case 0x01003034:
-        /* Read by the on chip bootloader and acted upon. */
-        *val = 0x1e112; break;
-
-    case 0x01004034:
-        /* Read by the on chip bootloader and acted upon. */
-        *val = 0x1e112; break;
-        /* Read by the on chip bootloader and acted upon. */
-    case 0x0102e034:
-        *val = 0x1e312; break;
-
-    case 0x01046034:
-        /* Read by the on chip bootloader and acted upon. */
-        *val = 0x1e103; break;
-
-    case 0x01047034:
-        /* Read by the on chip bootloader and acted upon. */
-        *val = 0x1e103; break;
-
-    case 0x01030034:
-        /* Read by the on chip bootloader and acted upon. */
-        *val = 0x1e312; break;
-
-    case 0x01018034:
-        /* Read by the on chip bootloader and acted upon. */
-        *val = 0x1e113; break;
-
-    case 0x0106c034:
-        /* Read by the on chip bootloader and acted upon. */
-        *val = 0x1e113; break;
-
-    case 0x0106d034:
-        /* Read by the on chip bootloader and acted upon. */
-        *val = 0x1e113; break;
-
-    case 0x0106e034:
-        /* Read by the on chip bootloader and acted upon. */
-        *val = 0x1e312; break;
-
-    case 0x01080034:
-        /* Read by the on chip bootloader and acted upon. */
-        *val = 0x1e113; break;
-
-    case 0x01081034:
-        /* Read by the on chip bootloader and acted upon. */
-        *val = 0x1e113; break;
-
-    case 0x01096034:
-        /* Read by the on chip bootloader and acted upon. */
-        *val = 0x1e313; break;
-
-    case 0x01097034:
-        /* Read by the on chip bootloader and acted upon. */
-        *val = 0x1e313; break;
-
-    case 0x010a8034:
-        /* Read by the on chip bootloader and acted upon. */
-        *val = 0x1e313; break;
+static const PSPMiscReg psp_misc_default_regs[] = {
+    /* Read by the on chip bootloader and acted upon. */
+    { 0x5b304, 0xffffffff, PSP_MISC_REG_RO },
+    /* Read by the on chip bootloader and acted upon. TODO verify */
+    { 0x5bb04, 0xffffffff, PSP_MISC_REG_RO },
+    /* The on chip bootloader waits for bit 0 to go 1 */
+    { 0x5e000, 0x1, PSP_MISC_REG_RO },
+    /* The off chip bootloader wants bit 5 to be one, otherwise it returns an error
+     * dubbed PSPSTATUS_CCX_SEC_BISI_EN_NOT_SET_IN_FUSE_RAM. */
+    { 0x5d0cc, BIT(5), PSP_MISC_REG_RO },
+    /* Read by the on chip bootloader and acted upon. */
+    { 0x01025034, 0x1e113, PSP_MISC_REG_RO },
+    { 0x01003034, 0x1e112, PSP_MISC_REG_RO },
+    { 0x01004034, 0x1e112, PSP_MISC_REG_RO },
+    { 0x0102e034, 0x1e312, PSP_MISC_REG_RO },
+    { 0x01046034, 0x1e103, PSP_MISC_REG_RO },
+    { 0x01047034, 0x1e103, PSP_MISC_REG_RO },
+    { 0x01030034, 0x1e312, PSP_MISC_REG_RO },
+    { 0x01018034, 0x1e113, PSP_MISC_REG_RO },
+    { 0x0106c034, 0x1e113, PSP_MISC_REG_RO },
+    { 0x0106d034, 0x1e113, PSP_MISC_REG_RO },
+    { 0x0106e034, 0x1e312, PSP_MISC_REG_RO },
+    { 0x01080034, 0x1e113, PSP_MISC_REG_RO },
+    { 0x01081034, 0x1e113, PSP_MISC_REG_RO },
+    { 0x01096034, 0x1e313, PSP_MISC_REG_RO },
+    { 0x01097034, 0x1e313, PSP_MISC_REG_RO },
+    { 0x010a8034, 0x1e313, PSP_MISC_REG_RO },
+    { 0x010d8034, 0x1e313, PSP_MISC_REG_RO },
+    /* The on chip bootloader waits for bit 0 to go 1. */
+    { 0x5a088, 0x1, PSP_MISC_REG_RO },
+    /* Some SMU ready/online bit the off chip bootloader waits for after the firmware was loaded. */
+    /* TODO: Move SMU related stuff into separate device */
+    { 0x3b10034, 0x1, PSP_MISC_REG_RO },
+    { 0x3b10704, 0x1, PSP_MISC_REG_RO },
+    /* The on chip bootloader waits for bit 9 and 10 to become set. */
+    { 0x18080064, BIT(10) | BIT(9), PSP_MISC_REG_RO },
+    { 0x18480064, BIT(10) | BIT(9), PSP_MISC_REG_RO },
+    { 0x5a078, 0x10, PSP_MISC_REG_RO },
+    { 0x5a870, 0x1, PSP_MISC_REG_RO },
+    // Zen and Zen+
+    { 0x0320004c, 0xbc090071, PSP_MISC_REG_RO },
+    // Zen2
+    { 0x03200048, 0xbc0b0552, PSP_MISC_REG_RO },
+    // Zen2
+    { 0x03200050, 0x300, PSP_MISC_REG_RO },
+    // TODO this should depend on dbg flag: 
+    // https://github.com/PSPReverse/PSPEmu/blob/78e4be24e882ae67867063c894fbfb2ecbe50f3f/psp-dev-mmio-unknown.c#L67
+    { 0x030101c0, 0x80102, PSP_MISC_REG_RO },
+};
 
-    case 0x010d8034:
-        /* Read by the on chip bootloader and acted upon. */
-        *val = 0x1e313; break;
+/* Section names of the register file, same as the machine names */
+static const char *psp_misc_gen_names[] = {
+    [ZEN]      = "zen",
+    [ZEN_PLUS] = "zen+",
+    [ZEN2]     = "zen2",
+    [ZEN3]     = "zen3",
+    [ZENTESLA] = "zentesla",
+};
 
-    case 0x5a088:
-        /* The on chip bootloader waits for bit 0 to go 1. */
-        *val = 0x1; break;
+static const char *psp_misc_mode_names[] = {
+    [PSP_MISC_REG_RO]     = "ro",
+    [PSP_MISC_REG_RW]     = "rw",
+    [PSP_MISC_REG_W1C]    = "w1c",
+    [PSP_MISC_REG_STICKY] = "sticky",
+};
 
-    case 0x3b10034:
-        /* Some SMU ready/online bit the off chip bootloader waits for after the firmware was loaded. */
-        /* TODO: Move SMU related stuff into separate device */
-        *val = 0x1; break;
+static inline uint32_t psp_misc_hash(hwaddr addr)
+{
+    return (addr * 0x9e3779b97f4a7c15ULL) >> (64 - PSP_MISC_HASH_BITS);
+}
 
-    case 0x3b10704:
-        /* Some SMU ready/online bit the off chip bootloader waits for after the firmware was loaded. */
-        /* TODO: Move SMU related stuff into separate device */
-        *val = 0x1; break;
+/* Look up a register by its phys address, returns its index or -1 */
+static int psp_misc_find(PSPMiscState *s, hwaddr addr)
+{
+    uint32_t h = psp_misc_hash(addr);
+    int idx;
+
+    while ((idx = s->hash[h]) >= 0) {
+        if (s->regs[idx].addr == addr) {
+            return idx;
+        }
+        h = (h + 1) & (PSP_MISC_HASH_SIZE - 1);
+    }
+    return -1;
+}
 
-    case 0x18080064:
-        /* The on chip bootloader waits for bit 9 and 10 to become set. */
-        *val = BIT(10) | BIT(9); break;
+/* Add a register or replace the one at the same address */
+static bool psp_misc_set_reg(PSPMiscState *s, const PSPMiscReg *reg,
+                             Error **errp)
+{
+    uint32_t i;
 
-    case 0x18480064:
-        /* The on chip bootloader waits for bit 9 and 10 to become set. */
-        *val = BIT(10) | BIT(9); break;
+    for (i = 0; i < s->nregs; i++) {
+        if (s->regs[i].addr == reg->addr) {
+            s->regs[i] = *reg;
+            return true;
+        }
+    }
 
-    case 0x5A078:
-        *val = 0x10; break;
-
-    case 0x5A870:
-        *val = 0x1; break;
+    if (s->nregs == PSP_MISC_MAX_REGS) {
+        error_setg(errp, "%s: More than %d registers", s->ident,
+                   PSP_MISC_MAX_REGS);
+        return false;
+    }
+    s->regs[s->nregs++] = *reg;
+    return true;
+}
 
-    // Zen and Zen+
-    case 0x0320004c:
-        *val = 0xbc090071; break;
+/*
+ * Register file format, one register per line:
+ *
+ *   # comment
+ *   <addr> <value> [ro|rw|w1c|sticky]
+ *   [zen2]
+ *   <addr> <value> [mode]
+ *
+ * Lines before the first section apply to all generations, lines in a
+ * section ("zen", "zen+", "zen2", "zen3" or "zentesla") only to that one.
+ * Numbers take the usual C prefixes, the mode defaults to "ro".
+ */
+static bool psp_misc_load_file(PSPMiscState *s, Error **errp)
+{
+    g_autofree char *contents = NULL;
+    g_auto(GStrv) lines = NULL;
+    g_autoptr(GError) gerr = NULL;
+    bool active = true;
+    int i, j;
+
+    if (!g_file_get_contents(s->regs_file, &contents, NULL, &gerr)) {
+        error_setg(errp, "%s: Couldn't read register file %s: %s", s->ident,
+                   s->regs_file, gerr->message);
+        return false;
+    }
 
-    // Zen2
-    case 0x03200048:
-        *val = 0xbc0b0552; break;
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; lines[i] != NULL; i++) {
+        g_auto(GStrv) tok = NULL;
+        char *line = lines[i];
+        char *comment = strchr(line, '#');
+        PSPMiscReg reg = { 0 };
+        uint64_t addr, val;
+        int ntok = 0;
+
+        if (comment) {
+            *comment = '\0';
+        }
+        line = g_strstrip(line);
+        if (*line == '\0') {
+            continue;
+        }
+
+        if (*line == '[') {
+            char *end = strchr(line, ']');
+
+            if (end == NULL || end[1] != '\0') {
+                goto malformed;
+            }
+            *end = '\0';
+            for (j = 0; j < ARRAY_SIZE(psp_misc_gen_names); j++) {
+                if (!strcmp(line + 1, psp_misc_gen_names[j])) {
+                    break;
+                }
+            }
+            if (j == ARRAY_SIZE(psp_misc_gen_names)) {
+                error_setg(errp, "%s:%d: Unknown generation '%s'",
+                           s->regs_file, i + 1, line + 1);
+                return false;
+            }
+            active = j == s->gen;
+            continue;
+        }
+
+        tok = g_strsplit_set(line, " \t", -1);
+        /* Drop the empty tokens between repeated separators */
+        for (j = 0; tok[j] != NULL; j++) {
+            if (*tok[j] != '\0') {
+                tok[ntok++] = tok[j];
+            } else {
+                g_free(tok[j]);
+            }
+        }
+        tok[ntok] = NULL;
+
+        if (ntok < 2 || ntok > 3 ||
+            qemu_strtou64(tok[0], NULL, 0, &addr) ||
+            qemu_strtou64(tok[1], NULL, 0, &val) || val > UINT32_MAX) {
+            goto malformed;
+        }
+        reg.addr = addr;
+        reg.val = val;
+        reg.mode = PSP_MISC_REG_RO;
+        if (ntok == 3) {
+            for (j = 0; j < ARRAY_SIZE(psp_misc_mode_names); j++) {
+                if (!strcmp(tok[2], psp_misc_mode_names[j])) {
+                    break;
+                }
+            }
+            if (j == ARRAY_SIZE(psp_misc_mode_names)) {
+                goto malformed;
+            }
+            reg.mode = j;
+        }
+
+        if (active && !psp_misc_set_reg(s, &reg, errp)) {
+            return false;
+        }
+    }
+    return true;
 
-    // Zen2
-    case 0x03200050:
-        *val = 0x300; break;
+malformed:
+    error_setg(errp, "%s:%d: Malformed line", s->regs_file, i + 1);
+    return false;
+}
 
-    // TODO this should depend on dbg flag: 
-    // https://github.com/PSPReverse/PSPEmu/blob/78e4be24e882ae67867063c894fbfb2ecbe50f3f/psp-dev-mmio-unknown.c#L67
-    case 0x030101c0:
-        *val = 0x80102; break;
+/* Build the register table of this instance's generation */
+static bool psp_misc_build_table(PSPMiscState *s, Error **errp)
+{
+    uint32_t i, h;
 
+    s->nregs = 0;
+    for (i = 0; i < ARRAY_SIZE(psp_misc_default_regs); i++) {
+        if (!psp_misc_set_reg(s, &psp_misc_default_regs[i], errp)) {
+            return false;
+        }
+    }
 
-    default:
-        /* No value found */
-        return -1;
+    if (s->regs_file && !psp_misc_load_file(s, errp)) {
+        return false;
     }
 
-    return 0;
+    memset(s->hash, -1, sizeof(s->hash));
+    for (i = 0; i < s->nregs; i++) {
+        h = psp_misc_hash(s->regs[i].addr);
+        while (s->hash[h] >= 0) {
+            h = (h + 1) & (PSP_MISC_HASH_SIZE - 1);
+        }
+        s->hash[h] = i;
+    }
+    return true;
 }
 
 static void psp_misc_set_identifier(Object *obj, const char *str, Error **errp)
@@ -204,32 +303,49 @@ static char *psp_misc_get_identifier(Object *obj, Error **errp)
 static void psp_misc_write(void *opaque, hwaddr offset, uint64_t value,
                            unsigned int size)
 {
-    //PSPMiscState *misc = PSP_MISC(opaque);
-    //hwaddr phys_base = misc->iomem.addr;
-    //hwaddr phys_abs;
-    //phys_abs = phys_base + offset;
-
-    /* TODO: Allow write to specific registers */
+    PSPMiscState *misc = PSP_MISC(opaque);
+    int idx;
 
+    idx = psp_misc_find(misc, misc->iomem.addr + offset);
+    if (idx < 0) {
+        trace_psp_misc_write_unimplemented(offset, value, size);
+        return;
+    }
 
-    trace_psp_misc_write_unimplemented(offset, value, size);
+    switch (misc->regs[idx].mode) {
+    case PSP_MISC_REG_RW:
+        misc->values[idx] = value;
+        break;
+    case PSP_MISC_REG_W1C:
+        misc->values[idx] &= ~value;
+        break;
+    case PSP_MISC_REG_STICKY:
+        misc->values[idx] |= value;
+        break;
+    default:
+        break;
+    }
+    trace_psp_misc_write(offset, value, size);
 }
 
 static uint64_t psp_misc_read(void *opaque, hwaddr offset, unsigned int size)
 {
     PSPMiscState *misc = PSP_MISC(opaque);
-    hwaddr phys_abs;
-    //int i;
-    hwaddr phys_base;
     uint64_t value;
+    int idx;
 
-    phys_base = misc->iomem.addr;
-    phys_abs = phys_base + offset;
-    value = 0;
-
-    if(psp_misc_load_value(phys_abs, &value)) {
+    idx = psp_misc_find(misc, misc->iomem.addr + offset);
+    //// +++ Begin ASPFuzz code +++
+    if (psp_fuzz_mmio_read(&misc->fuzz, misc->iomem.addr + offset, size,
+                           idx >= 0, &value)) {
+        return value;
+    }
+    //// +++ End ASPFuzz code +++
+    if (idx < 0) {
+        value = 0;
         trace_psp_misc_read_unimplemented(offset, size);
     } else {
+        value = misc->values[idx];
         trace_psp_misc_read(offset, value, size);
     }
 
@@ -250,6 +366,8 @@ static void psp_misc_init(Object *obj)
 
     s->mmio_size = 0;
     s->ident = NULL;
+    s->nregs = 0;
+    memset(s->hash, -1, sizeof(s->hash));
 
     /* TODO: What is the difference to e.g. DEFINE_PROP_UINT32 ? */
     object_property_add_uint64_ptr(obj,"psp_misc_msize", &s->mmio_size,
@@ -260,6 +378,16 @@ static void psp_misc_init(Object *obj)
 
 }
 
+static void psp_misc_reset(DeviceState *dev)
+{
+    PSPMiscState *s = PSP_MISC(dev);
+    uint32_t i;
+
+    for (i = 0; i < s->nregs; i++) {
+        s->values[i] = s->regs[i].val;
+    }
+}
+
 static void psp_misc_realize(DeviceState *dev, Error **errp)
 {
     PSPMiscState *s = PSP_MISC(dev);
@@ -274,6 +402,22 @@ static void psp_misc_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (s->gen != PSP_MISC_GEN_NONE &&
+        (s->gen < 0 || s->gen >= ARRAY_SIZE(psp_misc_gen_names))) {
+        error_setg(errp, "property 'psp_misc_gen' out of range");
+        return;
+    }
+
+    if (!psp_misc_build_table(s, errp)) {
+        return;
+    }
+    //// +++ Begin ASPFuzz code +++
+    if (!psp_fuzz_mmio_realize(&s->fuzz, s->ident, errp)) {
+        return;
+    }
+    //// +++ End ASPFuzz code +++
+    psp_misc_reset(dev);
+
     memory_region_init_io(&s->iomem, OBJECT(dev), &misc_mem_ops, s,
                           s->ident, 0x44000000);
 
@@ -281,10 +425,33 @@ static void psp_misc_realize(DeviceState *dev, Error **errp)
 
 }
 
+static Property psp_misc_properties[] = {
+    DEFINE_PROP_INT32("psp_misc_gen", PSPMiscState, gen, PSP_MISC_GEN_NONE),
+    DEFINE_PROP_STRING("regs_file", PSPMiscState, regs_file),
+    //// +++ Begin ASPFuzz code +++
+    DEFINE_PSP_FUZZ_MMIO_PROPERTIES(PSPMiscState, fuzz),
+    //// +++ End ASPFuzz code +++
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+/* The table itself is rebuilt from the configuration, only values change */
+static const VMStateDescription vmstate_psp_misc = {
+    .name = TYPE_PSP_MISC,
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(values, PSPMiscState, PSP_MISC_MAX_REGS),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void psp_misc_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(oc);
     dc->realize = psp_misc_realize;
+    dc->reset = psp_misc_reset;
+    dc->vmsd = &vmstate_psp_misc;
+    device_class_set_props(dc, psp_misc_properties);
 }
 
 static const TypeInfo psp_misc_info = {
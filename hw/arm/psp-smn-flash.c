@@ -31,6 +31,9 @@
 #include "hw/arm/psp.h"
 #include "qemu/log.h"
 #include "hw/arm/psp-smn-flash.h"
+#include "qemu/memfd.h"
+#include "exec/ram_addr.h"
+#include "migration/vmstate.h"
 
 /* static const MemoryRegionOps smn_flash_ops = { */
 /*     .read = psp_smn_flash_read, */
@@ -41,22 +44,153 @@
 /* }; */
 
 //// +++ Begin ASPFuzz code +++
+/*
+ * Fuzz input injection into the SMN flash. Every byte that differs from the
+ * flash image is covered by an extent in "dirty": writes through the API
+ * below are recorded exactly, guest writes are picked up page-wise from the
+ * dirty log at restore time. A restore only copies these extents back from
+ * the pristine image, and only TBs translated from the modified bytes are
+ * invalidated.
+ */
+typedef struct AspfuzzFlashRange {
+    hwaddr addr;
+    hwaddr len;
+} AspfuzzFlashRange;
+
 MemoryRegion *asp_smn_mr = NULL;
+static PSPSmnFlashState *aspfuzz_flash = NULL;
+
+/* Invalidate the TBs of [addr, addr + len) and mark it as modified for all
+ * dirty log clients but the one used to track guest writes.
+ */
+static void aspfuzz_smn_flash_invalidate(PSPSmnFlashState *s, hwaddr addr,
+                                         hwaddr len) {
+    ram_addr_t ram_addr = memory_region_get_ram_addr(&s->psp_smn_flash) + addr;
+    uint8_t mask;
+
+    mask = memory_region_get_dirty_log_mask(&s->psp_smn_flash);
+    mask &= ~(1 << DIRTY_MEMORY_VGA);
+    mask = cpu_physical_memory_range_includes_clean(ram_addr, len, mask);
+    if (mask & (1 << DIRTY_MEMORY_CODE)) {
+        tb_invalidate_phys_range(ram_addr, ram_addr + len);
+        mask &= ~(1 << DIRTY_MEMORY_CODE);
+    }
+    cpu_physical_memory_set_dirty_range(ram_addr, len, mask);
+}
+
+static bool aspfuzz_smn_flash_check(hwaddr addr, hwaddr len) {
+    if (aspfuzz_flash == NULL) {
+        return false;
+    }
+    if (addr > PSP_SMN_FLASH_SIZE_16 || len > PSP_SMN_FLASH_SIZE_16 - addr) {
+        qemu_log_mask(LOG_GUEST_ERROR, "ASPFuzz: flash access 0x%" HWADDR_PRIx
+                      "+0x%" HWADDR_PRIx " out of bounds\n", addr, len);
+        return false;
+    }
+    return true;
+}
+
+/* The fuzzer wrote [addr, addr + len) through the memfd mapping */
+void aspfuzz_smn_flash_written(hwaddr addr, hwaddr len);
+void aspfuzz_smn_flash_written(hwaddr addr, hwaddr len) {
+    AspfuzzFlashRange r = { addr, len };
+
+    if (!aspfuzz_smn_flash_check(addr, len) || len == 0) {
+        return;
+    }
+    g_array_append_val(aspfuzz_flash->dirty, r);
+    aspfuzz_smn_flash_invalidate(aspfuzz_flash, addr, len);
+}
+
 void aspfuzz_write_smn_flash(hwaddr addr, hwaddr len, const void* ptr);
 void aspfuzz_write_smn_flash(hwaddr addr, hwaddr len, const void* ptr){
     const uint8_t *buf = ptr;
-    uint8_t *ram_ptr = qemu_map_ram_ptr(asp_smn_mr->ram_block, addr);
+    uint8_t *ram_ptr;
+
+    if (!aspfuzz_smn_flash_check(addr, len)) {
+        return;
+    }
+    ram_ptr = qemu_map_ram_ptr(asp_smn_mr->ram_block, addr);
     memcpy(ram_ptr, buf, len);
+    aspfuzz_smn_flash_written(addr, len);
+}
+
+/* Undo all modifications since the last restore */
+void aspfuzz_restore_smn_flash(void);
+void aspfuzz_restore_smn_flash(void) {
+    PSPSmnFlashState *s = aspfuzz_flash;
+    DirtyBitmapSnapshot *snap;
+    AspfuzzFlashRange *r;
+    uint8_t *ram_ptr;
+    hwaddr addr;
+    guint i;
+
+    if (s == NULL) {
+        return;
+    }
+
+    snap = memory_region_snapshot_and_clear_dirty(&s->psp_smn_flash, 0,
+                                                  PSP_SMN_FLASH_SIZE_16,
+                                                  DIRTY_MEMORY_VGA);
+    for (addr = 0; addr < PSP_SMN_FLASH_SIZE_16; addr += TARGET_PAGE_SIZE) {
+        if (memory_region_snapshot_get_dirty(&s->psp_smn_flash, snap, addr,
+                                             TARGET_PAGE_SIZE)) {
+            AspfuzzFlashRange page = { addr, TARGET_PAGE_SIZE };
+            g_array_append_val(s->dirty, page);
+        }
+    }
+    g_free(snap);
+
+    ram_ptr = qemu_map_ram_ptr(s->psp_smn_flash.ram_block, 0);
+    for (i = 0; i < s->dirty->len; i++) {
+        r = &g_array_index(s->dirty, AspfuzzFlashRange, i);
+        memcpy(ram_ptr + r->addr, s->pristine + r->addr, r->len);
+        aspfuzz_smn_flash_invalidate(s, r->addr, r->len);
+    }
+    g_array_set_size(s->dirty, 0);
+}
+
+/* The memfd backing the flash, -1 if it is plain anonymous RAM */
+int aspfuzz_smn_flash_fd(void);
+int aspfuzz_smn_flash_fd(void) {
+    return aspfuzz_flash ? aspfuzz_flash->flash_fd : -1;
+}
+
+void *aspfuzz_smn_flash_ptr(void);
+void *aspfuzz_smn_flash_ptr(void) {
+    if (aspfuzz_flash == NULL) {
+        return NULL;
+    }
+    return qemu_map_ram_ptr(aspfuzz_flash->psp_smn_flash.ram_block, 0);
 }
 //// +++ End ASPFuzz code +++
 
 static void psp_smn_flash_realize(DeviceState *dev, Error **errp)
 {
+    ERRP_GUARD();
     PSPSmnFlashState *s = PSP_SMN_FLASH(dev);
     Object *obj = OBJECT(dev);
 
-    memory_region_init_ram(&s->psp_smn_flash, obj, "flash",
-                           PSP_SMN_FLASH_SIZE_16, errp);
+    //// +++ Begin ASPFuzz code +++
+    s->flash_fd = -1;
+    if (s->flash_memfd) {
+        s->flash_fd = qemu_memfd_create("aspfuzz-flash", PSP_SMN_FLASH_SIZE_16,
+                                        false, 0, 0, errp);
+        if (s->flash_fd < 0) {
+            return;
+        }
+        memory_region_init_ram_from_fd(&s->psp_smn_flash, obj, "flash",
+                                       PSP_SMN_FLASH_SIZE_16, RAM_SHARED,
+                                       s->flash_fd, 0, errp);
+        if (*errp) {
+            return;
+        }
+        vmstate_register_ram(&s->psp_smn_flash, DEVICE(obj));
+    } else {
+        memory_region_init_ram(&s->psp_smn_flash, obj, "flash",
+                               PSP_SMN_FLASH_SIZE_16, errp);
+    }
+    //// +++ End ASPFuzz code +++
 
     if(!s->flash_img) {
         qemu_log_mask(LOG_GUEST_ERROR, "No flash image provided for smn\n");
@@ -69,13 +203,27 @@ static void psp_smn_flash_realize(DeviceState *dev, Error **errp)
     }
 
     //// +++ Begin ASPFuzz code +++
+    s->pristine = g_malloc(PSP_SMN_FLASH_SIZE_16);
+    memcpy(s->pristine, qemu_map_ram_ptr(s->psp_smn_flash.ram_block, 0),
+           PSP_SMN_FLASH_SIZE_16);
+    s->dirty = g_array_new(false, false, sizeof(AspfuzzFlashRange));
+
+    /* Track guest writes to the flash */
+    memory_region_set_log(&s->psp_smn_flash, true, DIRTY_MEMORY_VGA);
+    memory_region_reset_dirty(&s->psp_smn_flash, 0, PSP_SMN_FLASH_SIZE_16,
+                              DIRTY_MEMORY_VGA);
+
     asp_smn_mr = &s->psp_smn_flash;
+    aspfuzz_flash = s;
     //// +++ End ASPFuzz code +++
 
 }
 
 static Property psp_smn_flash_properties[] = {
     DEFINE_PROP_STRING("flash_img", PSPSmnFlashState, flash_img),
+    //// +++ Begin ASPFuzz code +++
+    DEFINE_PROP_BOOL("flash_memfd", PSPSmnFlashState, flash_memfd, false),
+    //// +++ End ASPFuzz code +++
     DEFINE_PROP_END_OF_LIST(),
 };
 
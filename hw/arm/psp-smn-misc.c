@@ -5,6 +5,7 @@
 #include "trace.h"
 
 #include "hw/arm/psp-smn-misc.h"
+#include "migration/vmstate.h"
 #include <stdint.h>
 
 #define PSP_SMN_MISC_LOG "[PSP SMN MISC]"
@@ -12,6 +13,7 @@
 static uint64_t psp_smn_misc_read(void *opaque, hwaddr offset,
                            unsigned int size)
 {
+    PSPSmnMiscState *s = PSP_SMN_MISC(opaque);
     uint64_t val;
     switch(offset) {
 
@@ -179,10 +181,19 @@ static uint64_t psp_smn_misc_read(void *opaque, hwaddr offset,
             break;
 
         default:
+            //// +++ Begin ASPFuzz code +++
+            if (psp_fuzz_mmio_read(&s->fuzz, offset, size, false, &val)) {
+                return val;
+            }
+            //// +++ End ASPFuzz code +++
             trace_psp_smn_misc_read_unimplemented(offset);
             return 0;
     }
 
+    //// +++ Begin ASPFuzz code +++
+    psp_fuzz_mmio_read(&s->fuzz, offset, size, true, &val);
+    //// +++ End ASPFuzz code +++
+
     trace_psp_smn_misc_read(offset, val);
     return val;
 }
@@ -204,6 +215,12 @@ static const MemoryRegionOps misc_mem_ops = {
 static void psp_misc_realize(DeviceState *dev, Error **errp) {
     PSPSmnMiscState * s = PSP_SMN_MISC(dev);
 
+    //// +++ Begin ASPFuzz code +++
+    if (!psp_fuzz_mmio_realize(&s->fuzz, "psp-smn-misc", errp)) {
+        return;
+    }
+    //// +++ End ASPFuzz code +++
+
     /* Init mmio */
     memory_region_init_io(&s->iomem, OBJECT(dev), &misc_mem_ops, s,
                           "psp-smn-misc", UINT32_MAX);
@@ -213,10 +230,31 @@ static void psp_misc_realize(DeviceState *dev, Error **errp) {
 static void psp_smn_misc_init(Object *o) {
 }
 
+/* All registers are constants, there is no runtime state to migrate */
+static const VMStateDescription vmstate_psp_smn_misc = {
+    .name = TYPE_PSP_SMN_MISC,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+//// +++ Begin ASPFuzz code +++
+static Property psp_smn_misc_properties[] = {
+    DEFINE_PSP_FUZZ_MMIO_PROPERTIES(PSPSmnMiscState, fuzz),
+    DEFINE_PROP_END_OF_LIST(),
+};
+//// +++ End ASPFuzz code +++
+
 static void psp_smn_misc_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(oc);
     dc->realize = psp_misc_realize;
+    dc->vmsd = &vmstate_psp_smn_misc;
+    //// +++ Begin ASPFuzz code +++
+    device_class_set_props(dc, psp_smn_misc_properties);
+    //// +++ End ASPFuzz code +++
 }
 
 static const TypeInfo psp_smn_misc_info = {
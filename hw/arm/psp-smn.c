@@ -34,23 +34,13 @@
 #include "trace.h"
 #include "hw/arm/psp-smn.h"
 #include "hw/arm/psp.h"
+#include "migration/vmstate.h"
+#include "qemu/bitops.h"
 
 /* DEFINE_PROP_STRING("rom_path", AmdPspState,flash_rom_path), */
 
 /* PSPSmnCTRL: Controller, attaches SMN devices on demand? */
 
-//// +++ Begin ASPFuzz code +++
-uint32_t aspfuzz_smn_slots[32] = { 0 };
-PSPSmnState *aspfuzz_smn_state = 0;
-
-void aspfuzz_smn_update_slot(uint32_t idx);
-void aspfuzz_smn_update_slot(uint32_t idx) {
-    PSPSmnAddr addr = aspfuzz_smn_slots[idx];
-    memory_region_set_alias_offset(&aspfuzz_smn_state->psp_smn_containers[idx], addr);
-    trace_psp_smn_update_slot(idx, addr);
-}
-//// +++ End ASPFuzz code +++
-
 typedef struct PspSmnClass {
     /*< private >*/
     SysBusDeviceClass parent_class;
@@ -93,16 +83,55 @@ static PspSmnConfiguration psp_smn_configuration[] = {
 
 const char* ident = "SMN Control";
 
+/* The SMN whose address space this one accesses */
+static inline PSPSmnState *psp_smn_fabric(PSPSmnState *smn) {
+    return smn->fabric ? smn->fabric : smn;
+}
+
+/* SMN address a slot currently points to. Unprogrammed slots are identity
+ * mapped.
+ */
+static inline PSPSmnAddr psp_smn_slot_addr(PSPSmnState *smn, uint32_t idx) {
+    if (smn->psp_smn_slots_mapped & BIT(idx)) {
+        return smn->psp_smn_slots[idx];
+    }
+    return idx * PSP_SMN_SLOT_SIZE;
+}
+
+static bool psp_smn_addr_is_ram(PSPSmnState *smn, PSPSmnAddr addr) {
+    MemoryRegionSection section;
+    bool ram;
+
+    section = memory_region_find(&psp_smn_fabric(smn)->psp_smn_space, addr, 1);
+    ram = section.mr && memory_region_is_ram(section.mr);
+    if (section.mr) {
+        memory_region_unref(section.mr);
+    }
+    return ram;
+}
+
+/* Accesses through the SMN window are dispatched using the slot table, so
+ * retargeting a slot at MMIO is a plain store and does not change the memory
+ * topology. Only slots that point to RAM get a direct alias on top of the
+ * window, so that the CPU and the CCP access the flash without going through
+ * the dispatcher. Those are rarely reprogrammed.
+ */
+static void psp_smn_apply_slot(PSPSmnState *smn, uint32_t idx) {
+    PSPSmnAddr addr = psp_smn_slot_addr(smn, idx);
+    MemoryRegion *alias = &smn->psp_smn_containers[idx];
+
+    if (psp_smn_addr_is_ram(smn, addr)) {
+        memory_region_set_alias_offset(alias, addr);
+        memory_region_set_enabled(alias, true);
+    } else {
+        memory_region_set_enabled(alias, false);
+    }
+}
+
 static void psp_smn_update_slot(PSPSmnState *smn, uint32_t idx) {
-    PSPSmnAddr addr = smn->psp_smn_slots[idx];
-    /* TODO documentation */
-    memory_region_set_alias_offset(&smn->psp_smn_containers[idx], addr);
-    trace_psp_smn_update_slot(idx, addr);
-
-    //// +++ Begin ASPFuzz code +++
-    aspfuzz_smn_state = (void *)smn;
-    aspfuzz_smn_slots[idx] = addr;
-    //// +++ End ASPFuzz code +++
+    smn->psp_smn_slots_mapped |= BIT(idx);
+    psp_smn_apply_slot(smn, idx);
+    trace_psp_smn_update_slot(idx, smn->psp_smn_slots[idx]);
 }
 
 static void psp_smn_write(void *opaque, hwaddr offset, uint64_t value,
@@ -118,8 +147,10 @@ static void psp_smn_write(void *opaque, hwaddr offset, uint64_t value,
             idx = (offset / 4) * 2;
             smn->psp_smn_slots[idx] = ((uint32_t) value & 0xffff) << 20;
             smn->psp_smn_slots[idx + 1] = ((uint32_t) value >> 16) << 20;
+            memory_region_transaction_begin();
             psp_smn_update_slot(smn, idx);
             psp_smn_update_slot(smn, idx + 1);
+            memory_region_transaction_commit();
             break;
         case 2:
             idx = offset / 2;
@@ -169,6 +200,38 @@ static const MemoryRegionOps smn_ctlr_ops = {
     .impl.max_access_size = 4,
 };
 
+static uint64_t psp_smn_window_read(void *opaque, hwaddr offset,
+                                    unsigned int size) {
+    PSPSmnState *smn = PSP_SMN(opaque);
+    uint32_t idx = offset / PSP_SMN_SLOT_SIZE;
+    hwaddr addr = psp_smn_slot_addr(smn, idx) + offset % PSP_SMN_SLOT_SIZE;
+    uint8_t buf[8] = { 0 };
+
+    address_space_read(&psp_smn_fabric(smn)->psp_smn_as, addr,
+                       MEMTXATTRS_UNSPECIFIED, buf, size);
+    return ldn_le_p(buf, size);
+}
+
+static void psp_smn_window_write(void *opaque, hwaddr offset, uint64_t value,
+                                 unsigned int size) {
+    PSPSmnState *smn = PSP_SMN(opaque);
+    uint32_t idx = offset / PSP_SMN_SLOT_SIZE;
+    hwaddr addr = psp_smn_slot_addr(smn, idx) + offset % PSP_SMN_SLOT_SIZE;
+    uint8_t buf[8];
+
+    stn_le_p(buf, size, value);
+    address_space_write(&psp_smn_fabric(smn)->psp_smn_as, addr,
+                        MEMTXATTRS_UNSPECIFIED, buf, size);
+}
+
+static const MemoryRegionOps smn_window_ops = {
+    .read = psp_smn_window_read,
+    .write = psp_smn_window_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .impl.min_access_size = 1,
+    .impl.max_access_size = 8,
+};
+
 static void psp_smn_init(Object *obj)
 {
     PSPSmnState *s = PSP_SMN(obj);
@@ -188,10 +251,18 @@ static void psp_smn_init(Object *obj)
 
 static void psp_smn_init_slots(DeviceState *dev) {
     PSPSmnState *s = PSP_SMN(dev);
+    MemoryRegion *psp_mem = s->psp_mem ? s->psp_mem : get_system_memory();
     int i;
     char name[PSP_SMN_SLOT_NAME_LEN] = { 0 };
     hwaddr slot_offset;
 
+    /* The window dispatching all slots to the SMN address space */
+    memory_region_init_io(&s->psp_smn_window, OBJECT(dev), &smn_window_ops, s,
+                          "smn-window", PSP_SMN_SLOT_COUNT * PSP_SMN_SLOT_SIZE);
+    memory_region_add_subregion_overlap(psp_mem, s->psp_smn_base,
+                                        &s->psp_smn_window, 0);
+
+    memory_region_transaction_begin();
     for(i = 0; i < PSP_SMN_SLOT_COUNT; i++) {
         /* The SMN MMIO region of the PSP */
         snprintf(name, PSP_SMN_SLOT_NAME_LEN, "%s%d", PSP_SMN_SLOT_NAME, i);
@@ -199,19 +270,21 @@ static void psp_smn_init_slots(DeviceState *dev) {
         /* TODO: How to check for errors? */
         /* Each container is an alias to the SMN addres space. Here we
          * initialize each container beginning with the address 0 in the SMN
-         * address space.
+         * address space. It only stays enabled while the slot targets RAM.
          */
         memory_region_init_alias(&s->psp_smn_containers[i], OBJECT(dev), name,
-                                 &s->psp_smn_space, i * PSP_SMN_SLOT_SIZE,
-                                 PSP_SMN_SLOT_SIZE);
+                                 &psp_smn_fabric(s)->psp_smn_space,
+                                 i * PSP_SMN_SLOT_SIZE, PSP_SMN_SLOT_SIZE);
 
         /* Map the containers to the PSP address space */
         slot_offset = s->psp_smn_base + i * PSP_SMN_SLOT_SIZE;
 
-        memory_region_add_subregion_overlap(get_system_memory(), slot_offset,
-                                            &s->psp_smn_containers[i], 0);
+        memory_region_add_subregion_overlap(psp_mem, slot_offset,
+                                            &s->psp_smn_containers[i], 1);
 
+        psp_smn_apply_slot(s, i);
     }
+    memory_region_transaction_commit();
 
 }
 
@@ -223,6 +296,18 @@ static void psp_smn_realize(DeviceState *dev, Error **errp) {
     PSPSmnFlashState* flash;
     Error *err = NULL;
 
+    /* The SMN control registers of this PSP */
+    memory_region_init_io(&s->psp_smn_control, OBJECT(dev), &smn_ctlr_ops, s,
+                          TYPE_PSP_SMN, PSP_SMN_CTRL_SIZE);
+
+    sysbus_init_mmio(sbd, &s->psp_smn_control);
+
+    /* The devices on a shared fabric belong to the PSP that owns it */
+    if (s->fabric) {
+        psp_smn_init_slots(dev);
+        return;
+    }
+
     sysbus_realize(SYS_BUS_DEVICE(&s->psp_smn_misc), &err);
     sysbus_realize(SYS_BUS_DEVICE(&s->psp_smn_flash), &err);
     if (err != NULL) {
@@ -234,12 +319,6 @@ static void psp_smn_realize(DeviceState *dev, Error **errp) {
     memory_region_init(&s->psp_smn_space, OBJECT(dev), "smn-address-space",
                        0xFFFFFFFF);
 
-    /* The SMN MMIO regions containing the control regs */
-    memory_region_init_io(&s->psp_smn_control, OBJECT(dev), &smn_ctlr_ops, s,
-                          TYPE_PSP_SMN, PSP_SMN_CTRL_SIZE);
-
-    sysbus_init_mmio(sbd, &s->psp_smn_control);
-
     mr_smn_misc = sysbus_mmio_get_region(SYS_BUS_DEVICE(&s->psp_smn_misc), 0);
     memory_region_add_subregion_overlap(&s->psp_smn_space, 0x0, mr_smn_misc,
                                         -1000);
@@ -249,13 +328,55 @@ static void psp_smn_realize(DeviceState *dev, Error **errp) {
     memory_region_add_subregion_overlap(&s->psp_smn_space, c->flash,
                                         &flash->psp_smn_flash, 0);
 
+    address_space_init(&s->psp_smn_as, &s->psp_smn_space, "smn");
+
     /* Setup the initial SMN to PSP MemoryRegion alias. */
     psp_smn_init_slots(dev);
 }
 
+static int psp_smn_post_load(void *opaque, int version_id) {
+    PSPSmnState *s = PSP_SMN(opaque);
+    uint32_t i;
+
+    /*
+     * The slot registers are restored, re-apply the direct aliases of slots
+     * that target RAM. Slots the firmware never programmed go back to their
+     * identity mapping.
+     */
+    memory_region_transaction_begin();
+    for (i = 0; i < PSP_SMN_SLOT_COUNT; i++) {
+        psp_smn_apply_slot(s, i);
+    }
+    memory_region_transaction_commit();
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_psp_smn = {
+    .name = TYPE_PSP_SMN,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = psp_smn_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(psp_smn_slots, PSPSmnState, PSP_SMN_SLOT_COUNT),
+        VMSTATE_UINT32(psp_smn_slots_mapped, PSPSmnState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property psp_smn_properties[] = {
+    DEFINE_PROP_LINK("memory", PSPSmnState, psp_mem, TYPE_MEMORY_REGION,
+                     MemoryRegion *),
+    DEFINE_PROP_LINK("fabric", PSPSmnState, fabric, TYPE_PSP_SMN,
+                     PSPSmnState *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void psp_smn_class_init(ObjectClass *oc, void *data) {
     DeviceClass *dc = DEVICE_CLASS(oc);
+    device_class_set_props(dc, psp_smn_properties);
     dc->realize = psp_smn_realize;
+    dc->vmsd = &vmstate_psp_smn;
 }
 
 static void psp_smn_common_class_init(ObjectClass *oc, enum PspGeneration gen) {
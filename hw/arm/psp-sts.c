@@ -32,6 +32,7 @@
 #include "trace-hw_arm.h"
 #include "trace.h"
 #include "hw/arm/psp-sts.h"
+#include "migration/vmstate.h"
 
 static uint64_t psp_sts_read(void *opaque, hwaddr offset, unsigned int size) {
     PSPStsState *s = PSP_STS(opaque);
@@ -67,12 +68,28 @@ static void psp_sts_init(Object *obj) {
 
 }
 
+static const VMStateDescription vmstate_psp_sts = {
+    .name = TYPE_PSP_STS,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(psp_sts_val, PSPStsState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void psp_sts_class_init(ObjectClass *oc, void *data) {
+    DeviceClass *dc = DEVICE_CLASS(oc);
+
+    dc->vmsd = &vmstate_psp_sts;
+}
+
 static const TypeInfo psp_sts_info = {
     .name = TYPE_PSP_STS,
     .parent = TYPE_SYS_BUS_DEVICE,
     .instance_init = psp_sts_init,
     .instance_size = sizeof(PSPStsState),
-
+    .class_init = psp_sts_class_init,
 };
 
 static void psp_sts_register_types(void) {
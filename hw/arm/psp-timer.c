@@ -32,38 +32,73 @@
 #include "trace-hw_arm.h"
 #include "trace.h"
 #include "hw/arm/psp-timer.h"
+#include "migration/vmstate.h"
+#include "qemu/timer.h"
 
 static char ident[] = "PSP Timer";
 
-//// +++ Begin ASPFuzz code +++
-uint64_t aspfuzz_timer_count_0 = 0;
-uint64_t aspfuzz_timer_control_0 = 0;
-uint64_t aspfuzz_timer_count_1 = 0;
-uint64_t aspfuzz_timer_control_1 = 0;
-//// +++ End ASPFuzz code +++
+static uint32_t psp_timer_get_count(PSPTimerState *s, int64_t now) {
+    if (!s->virtual_clock || !(s->psp_timer_control & PSP_TIMER_CTRL_EN)) {
+        return s->psp_timer_count;
+    }
+    return s->psp_timer_count + (now - s->base_ns) / s->ns_per_tick;
+}
 
-static uint64_t psp_timer_read(void *opaque, hwaddr offset, unsigned int size) {
-    PSPTimerState *s = PSP_TIMER(opaque);
-    uint64_t val;
-    hwaddr phys_base = s->psp_timer_iomem.addr;
+/* Fold the elapsed ticks into "psp_timer_count" */
+static void psp_timer_sync(PSPTimerState *s, int64_t now) {
+    int64_t rem;
 
-    //// +++ Begin ASPFuzz code +++
-    if (phys_base == 0x3010400) {
-        if (aspfuzz_timer_count_0 != s->psp_timer_count) {
-            s->psp_timer_count = aspfuzz_timer_count_0;
-        }
-        if (aspfuzz_timer_control_0 != s->psp_timer_control) {
-            s->psp_timer_control = aspfuzz_timer_control_0;
-        }
+    if (!s->virtual_clock || !(s->psp_timer_control & PSP_TIMER_CTRL_EN)) {
+        s->base_ns = now;
+        return;
+    }
+    rem = (now - s->base_ns) % s->ns_per_tick;
+    s->psp_timer_count = psp_timer_get_count(s, now);
+    s->base_ns = now - rem;
+}
+
+static void psp_timer_ff_reset(PSPTimerState *s) {
+    s->ff_streak = 0;
+    s->ff_step = 1;
+    s->ff_last_read_ns = INT64_MIN;
+}
+
+/*
+ * A delay loop does nothing but re-read the count until it passed some
+ * threshold, so its reads follow each other closely. Once such a streak is
+ * detected, warp the count instead of letting the guest spin. The step
+ * doubles on every read: the loop exits after a logarithmic number of
+ * iterations and waits at most twice as long as it asked for. Any other
+ * access to the timer, or a gap between two reads, ends the streak.
+ */
+static void psp_timer_fast_forward(PSPTimerState *s, int64_t now) {
+    if (!s->fast_forward || !(s->psp_timer_control & PSP_TIMER_CTRL_EN)) {
+        return;
+    }
+
+    if (s->ff_last_read_ns != INT64_MIN &&
+        (uint64_t)(now - s->ff_last_read_ns) <= s->ff_window_ns) {
+        s->ff_streak++;
     } else {
-        if (aspfuzz_timer_count_1 != s->psp_timer_count) {
-            s->psp_timer_count = aspfuzz_timer_count_1;
-        }
-        if (aspfuzz_timer_control_1 != s->psp_timer_control) {
-            s->psp_timer_control = aspfuzz_timer_control_1;
+        s->ff_streak = 0;
+        s->ff_step = 1;
+    }
+    s->ff_last_read_ns = now;
+
+    if (s->ff_streak >= s->ff_threshold) {
+        s->psp_timer_count += s->ff_step;
+        trace_psp_timer_fast_forward(s->ff_step, s->psp_timer_count);
+        if (s->ff_step < PSP_TIMER_FF_MAX_STEP) {
+            s->ff_step <<= 1;
         }
     }
-    //// +++ End ASPFuzz code +++
+}
+
+static uint64_t psp_timer_read(void *opaque, hwaddr offset, unsigned int size) {
+    PSPTimerState *s = PSP_TIMER(opaque);
+    uint64_t val;
+    hwaddr phys_base = s->psp_timer_iomem.addr;
+    int64_t now;
 
     if (size != sizeof(uint32_t)) {
         qemu_log_mask(LOG_UNIMP,
@@ -72,16 +107,18 @@ static uint64_t psp_timer_read(void *opaque, hwaddr offset, unsigned int size) {
         return 0;
     }
 
-    // TODO do this properly instead of counting up
     switch (offset) {
         case 0:
             val = s->psp_timer_control;
             trace_psp_timer_control_read(offset, val);
             break;
         case 0x20:
-            val = s->psp_timer_count;
+            now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+            psp_timer_fast_forward(s, now);
+            val = psp_timer_get_count(s, now);
             trace_psp_timer_counter_read(val);
-            if (s->psp_timer_control & 0x1)
+            /* Without a clock every read is one tick */
+            if (!s->virtual_clock && (s->psp_timer_control & PSP_TIMER_CTRL_EN))
                 s->psp_timer_count++;
             break;
         default:
@@ -89,16 +126,6 @@ static uint64_t psp_timer_read(void *opaque, hwaddr offset, unsigned int size) {
             break;
     }
 
-    //// +++ Begin ASPFuzz code +++
-    if (phys_base == 0x3010400) {
-        aspfuzz_timer_count_0 = s->psp_timer_count;
-        aspfuzz_timer_control_0 = s->psp_timer_control;
-    } else {
-        aspfuzz_timer_count_1 = s->psp_timer_count;
-        aspfuzz_timer_control_1 = s->psp_timer_control;
-    }
-    //// +++ End ASPFuzz code +++
-
     return val;
 }
 
@@ -108,30 +135,16 @@ static void psp_timer_write(void *opaque, hwaddr offset, uint64_t val,
     hwaddr phys = s->psp_timer_iomem.addr;
     phys += offset;
 
-    //// +++ Begin ASPFuzz code +++
-    if (phys == 0x3010400) {
-        if (aspfuzz_timer_count_0 != s->psp_timer_count) {
-            s->psp_timer_count = aspfuzz_timer_count_0;
-        }
-        if (aspfuzz_timer_control_0 != s->psp_timer_control) {
-            s->psp_timer_control = aspfuzz_timer_control_0;
-        }
-    } else {
-        if (aspfuzz_timer_count_1 != s->psp_timer_count) {
-            s->psp_timer_count = aspfuzz_timer_count_1;
-        }
-        if (aspfuzz_timer_control_1 != s->psp_timer_control) {
-            s->psp_timer_control = aspfuzz_timer_control_1;
-        }
-    }
-    //// +++ End ASPFuzz code +++
-
     if (size != sizeof(uint32_t) && size != sizeof(uint8_t)) {
         qemu_log_mask(LOG_UNIMP,
                       "PSP Timer: Error. Unsupported write size (%d) at offset 0x%" \
                       HWADDR_PRIx " with val 0x%lx\n", size, phys, val);
         return;
     }
+
+    psp_timer_sync(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    psp_timer_ff_reset(s);
+
     switch (offset) {
         case 0x0:
             s->psp_timer_control = val;
@@ -153,16 +166,6 @@ static void psp_timer_write(void *opaque, hwaddr offset, uint64_t val,
             break;
     }
 
-    //// +++ Begin ASPFuzz code +++
-    if (phys == 0x3010400) {
-        aspfuzz_timer_count_0 = s->psp_timer_count;
-        aspfuzz_timer_control_0 = s->psp_timer_control;
-    } else {
-        aspfuzz_timer_count_1 = s->psp_timer_count;
-        aspfuzz_timer_control_1 = s->psp_timer_control;
-    }
-    //// +++ End ASPFuzz code +++
-
 }
 
 
@@ -179,18 +182,75 @@ static void psp_timer_init(Object *obj) {
     SysBusDevice *sbd = SYS_BUS_DEVICE(obj);
     s->psp_timer_control = 0;
     s->psp_timer_count = 0;
+    s->base_ns = 0;
+    psp_timer_ff_reset(s);
 
     memory_region_init_io(&s->psp_timer_iomem, obj, &timer_mem_ops, s,
                           TYPE_PSP_TIMER, PSP_TIMER_SIZE);
     sysbus_init_mmio(sbd, &s->psp_timer_iomem);
 }
 
+/* Only the folded count is migrated, it resumes counting from the load */
+static int psp_timer_pre_save(void *opaque) {
+    PSPTimerState *s = PSP_TIMER(opaque);
+
+    psp_timer_sync(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    return 0;
+}
+
+static int psp_timer_post_load(void *opaque, int version_id) {
+    PSPTimerState *s = PSP_TIMER(opaque);
+
+    s->base_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    psp_timer_ff_reset(s);
+    return 0;
+}
+
+static Property psp_timer_properties[] = {
+    DEFINE_PROP_BOOL("virtual_clock", PSPTimerState, virtual_clock, false),
+    DEFINE_PROP_UINT32("ns_per_tick", PSPTimerState, ns_per_tick, 10),
+    DEFINE_PROP_BOOL("fast_forward", PSPTimerState, fast_forward, false),
+    DEFINE_PROP_UINT32("ff_threshold", PSPTimerState, ff_threshold, 8),
+    DEFINE_PROP_UINT64("ff_window_ns", PSPTimerState, ff_window_ns, 1000),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void psp_timer_realize(DeviceState *dev, Error **errp) {
+    PSPTimerState *s = PSP_TIMER(dev);
+
+    if (s->ns_per_tick == 0) {
+        error_setg(errp, "%s: ns_per_tick must not be 0", ident);
+        return;
+    }
+}
+
+static const VMStateDescription vmstate_psp_timer = {
+    .name = TYPE_PSP_TIMER,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = psp_timer_pre_save,
+    .post_load = psp_timer_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(psp_timer_control, PSPTimerState),
+        VMSTATE_UINT32(psp_timer_count, PSPTimerState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void psp_timer_class_init(ObjectClass *oc, void *data) {
+    DeviceClass *dc = DEVICE_CLASS(oc);
+
+    dc->realize = psp_timer_realize;
+    dc->vmsd = &vmstate_psp_timer;
+    device_class_set_props(dc, psp_timer_properties);
+}
+
 static const TypeInfo psp_timer_info = {
     .name = TYPE_PSP_TIMER,
     .parent = TYPE_SYS_BUS_DEVICE,
     .instance_init = psp_timer_init,
     .instance_size = sizeof(PSPTimerState),
-
+    .class_init = psp_timer_class_init,
 };
 
 static void psp_timer_register_types(void) {
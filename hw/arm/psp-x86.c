@@ -32,6 +32,8 @@
 #include "hw/arm/psp.h"
 #include "qemu/log.h"
 #include "hw/arm/psp-x86.h"
+#include "migration/vmstate.h"
+#include "trace.h"
 
 /* TODO: Refactor */
 //static PSPMiscReg psp_regs[] = {
@@ -44,7 +46,6 @@
 //};
 //
 /* TODO: Refactor read/write methods */
-/* TODO: fix log -> use log trace for non errors */
 
 static uint32_t psp_x86_ctrl_read(PSPX86State *s, uint32_t slot_id,
                                   PSPX86RegId reg_id) {
@@ -59,25 +60,45 @@ static uint32_t psp_x86_ctrl_read(PSPX86State *s, uint32_t slot_id,
   } else {
         slot = &s->psp_x86_slots[slot_id];
         ret = slot->ctrl_regs[reg_id];
-        qemu_log_mask(LOG_UNIMP, "PSP X86: Read slot %d reg %d val 0x%x\n",
-                      slot_id, reg_id, ret);
+        trace_psp_x86_ctrl_read(slot_id, reg_id, ret);
   }
 
   return ret;
 }
 
+/* Accesses through the x86 window look up the slot table, so remapping a
+ * slot does not touch the memory topology.
+ */
 static void psp_x86_map_slot(PSPX86State *s, uint32_t slot_id) {
     PSPX86Slot *slot;
 
     slot = &s->psp_x86_slots[slot_id];
 
     slot->x86_addr = (slot->ctrl_regs[X86BASE] & 0x3f) << 26 | ((uint64_t)(slot->ctrl_regs[X86BASE] >> 6)) << 32;
+}
 
-    memory_region_set_alias_offset(&s->psp_x86_containers[slot_id], slot->x86_addr);
-
+static uint64_t psp_x86_window_read(void *opaque, hwaddr offset,
+                                    unsigned int size) {
+    PSPX86State *s = PSP_X86(opaque);
+    PSPX86Slot *slot = &s->psp_x86_slots[offset / PSP_X86_SLOT_SIZE];
+    uint8_t buf[8] = { 0 };
 
+    address_space_read(&s->psp_x86_as,
+                       slot->x86_addr + offset % PSP_X86_SLOT_SIZE,
+                       MEMTXATTRS_UNSPECIFIED, buf, size);
+    return ldn_le_p(buf, size);
+}
 
+static void psp_x86_window_write(void *opaque, hwaddr offset, uint64_t value,
+                                 unsigned int size) {
+    PSPX86State *s = PSP_X86(opaque);
+    PSPX86Slot *slot = &s->psp_x86_slots[offset / PSP_X86_SLOT_SIZE];
+    uint8_t buf[8];
 
+    stn_le_p(buf, size, value);
+    address_space_write(&s->psp_x86_as,
+                        slot->x86_addr + offset % PSP_X86_SLOT_SIZE,
+                        MEMTXATTRS_UNSPECIFIED, buf, size);
 }
 
 static void psp_x86_ctrl_write(PSPX86State *s, uint32_t slot_id, PSPX86RegId reg_id,
@@ -95,8 +116,7 @@ static void psp_x86_ctrl_write(PSPX86State *s, uint32_t slot_id, PSPX86RegId reg
             psp_x86_map_slot(s, slot_id);
 
         }
-        qemu_log_mask(LOG_UNIMP, "PSP X86: Write slot %d reg %d val 0x%x\n",
-                      slot_id, reg_id, val);
+        trace_psp_x86_ctrl_write(slot_id, reg_id, val);
 
     }
 }
@@ -253,6 +273,14 @@ static const MemoryRegionOps x86_ctlr3_ops = {
     .impl.max_access_size = 4,
 };
 
+static const MemoryRegionOps x86_window_ops = {
+    .read = psp_x86_window_read,
+    .write = psp_x86_window_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .impl.min_access_size = 1,
+    .impl.max_access_size = 8,
+};
+
 static void psp_x86_init(Object *obj) {
 
     PSPX86State *s = PSP_X86(obj);
@@ -278,29 +306,19 @@ static void psp_x86_init_slots(DeviceState *dev) {
     PSPX86State *s = PSP_X86(dev);
 
     int i;
-    char name[PSP_X86_SLOT_NAME_LEN] = { 0 };
-    hwaddr slot_offset;
 
+    /* Each slot starts out mapping the x86 address space beginning with
+     * address 0.
+     */
     for(i = 0; i < PSP_X86_SLOT_COUNT; i++) {
-        /* The X86 MMIO region of the PSP */
-        snprintf(name, PSP_X86_SLOT_NAME_LEN, "%s%d", PSP_X86_SLOT_NAME, i);
-
-        /* TODO: How to check for errors? */
-        /* Each container is an alias to the X86 addres space. Here we
-         * initialize each container beginning with the address 0 in the x86
-         * address space.
-         */
-        memory_region_init_alias(&s->psp_x86_containers[i], OBJECT(dev), name,
-                                 &s->psp_x86_space, i * PSP_X86_SLOT_SIZE,
-                                 PSP_X86_SLOT_SIZE);
-
-        /* Map the containers to the PSP address space */
-        slot_offset = s->psp_x86_base + i * PSP_X86_SLOT_SIZE;
-
-        memory_region_add_subregion_overlap(get_system_memory(), slot_offset,
-                                            &s->psp_x86_containers[i], 0);
-
+        s->psp_x86_slots[i].x86_addr = (hwaddr)i * PSP_X86_SLOT_SIZE;
     }
+
+    /* The X86 window of the PSP */
+    memory_region_init_io(&s->psp_x86_window, OBJECT(dev), &x86_window_ops, s,
+                          "x86-window", PSP_X86_CONTAINER_SIZE);
+    memory_region_add_subregion_overlap(get_system_memory(), s->psp_x86_base,
+                                        &s->psp_x86_window, 0);
 }
 
 static void psp_x86_realize(DeviceState *dev, Error **errp) {
@@ -341,13 +359,39 @@ static void psp_x86_realize(DeviceState *dev, Error **errp) {
     memory_region_add_subregion_overlap(&s->psp_x86_space, 0x0, mr_x86_misc,
                                         -1000);
 
+    address_space_init(&s->psp_x86_as, &s->psp_x86_space, "x86");
+
     psp_x86_init_slots(dev);
 
 }
 
+static const VMStateDescription vmstate_psp_x86_slot = {
+    .name = "amd_psp.x86/slot",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(x86_addr, PSPX86Slot),
+        VMSTATE_UINT64(psp_addr, PSPX86Slot),
+        VMSTATE_UINT32_ARRAY(ctrl_regs, PSPX86Slot, PSP_X86_REG_COUNT),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_psp_x86 = {
+    .name = TYPE_PSP_X86,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_ARRAY(psp_x86_slots, PSPX86State, PSP_X86_SLOT_COUNT,
+                             1, vmstate_psp_x86_slot, PSPX86Slot),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void psp_x86_class_init(ObjectClass *oc, void *data) {
     DeviceClass *dc = DEVICE_CLASS(oc);
     dc->realize = psp_x86_realize;
+    dc->vmsd = &vmstate_psp_x86;
 }
 
 static const TypeInfo psp_x86_info = {
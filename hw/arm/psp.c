@@ -34,6 +34,8 @@
 #include "hw/arm/psp-timer.h"
 #include "hw/arm/psp-sts.h"
 #include "qemu/log.h"
+#include "qemu/cutils.h"
+#include "migration/vmstate.h"
 
 // TODO: use mmio_map_overlap with memory_regions_dispatch_rw to log access to SPI flash
 
@@ -50,6 +52,8 @@ typedef struct AmdPspClass {
     /*< private >*/
     DeviceClass parent_class;
     /*< public >*/
+    PspGeneration gen;
+
     uint64_t sram_size;
     hwaddr sram_base;
     uint64_t rom_size;
@@ -67,8 +71,184 @@ typedef struct AmdPspClass {
 #define AMD_PSP_GET_CLASS(obj) \
     OBJECT_GET_CLASS(AmdPspClass, (obj), TYPE_AMD_PSP)
 
+//// +++ Begin ASPFuzz code +++
+/*
+ * Fast device-state snapshot of the PSP devices of all dies. The plain fields
+ * described by each device's vmsd are copied to and from a flat
+ * caller-provided buffer, so a restore is a memcpy between the device's
+ * pre_load and post_load hooks.
+ */
+#define ASPFUZZ_PSP_DIE_DEVICES 7
+#define ASPFUZZ_PSP_MAX_DEVICES (ASPFUZZ_PSP_DIE_DEVICES * AMD_PSP_MAX_DIES)
+
+/* Indexed by die, the master comes first */
+static AmdPspState *aspfuzz_psps[AMD_PSP_MAX_DIES];
+
+static int aspfuzz_psp_devices(DeviceState **devs) {
+    AmdPspState *s;
+    int i, n = 0;
+
+    for (i = 0; i < AMD_PSP_MAX_DIES; i++) {
+        s = aspfuzz_psps[i];
+        if (s == NULL) {
+            continue;
+        }
+        devs[n++] = DEVICE(&s->smn);
+        devs[n++] = DEVICE(&s->base_mem);
+        devs[n++] = DEVICE(&s->timer1);
+        devs[n++] = DEVICE(&s->timer2);
+        devs[n++] = DEVICE(&s->sts);
+        devs[n++] = DEVICE(&s->ccp);
+        devs[n++] = DEVICE(&s->fuse);
+    }
+
+    return n;
+}
+
+static size_t aspfuzz_psp_walk_vmsd(const VMStateDescription *vmsd,
+                                    void *opaque, uint8_t *buf, bool save) {
+    const VMStateField *field;
+    size_t off = 0;
+    int i, n;
+
+    assert(vmsd->subsections == NULL);
+
+    for (field = vmsd->fields; field->name != NULL; field++) {
+        uint8_t *base = (uint8_t *)opaque + field->offset;
+
+        /* Only fixed-size fields embedded in the device state are supported */
+        assert(!(field->flags & ~(VMS_SINGLE | VMS_ARRAY | VMS_STRUCT |
+                                  VMS_BUFFER)));
+        assert(field->field_exists == NULL);
+
+        n = (field->flags & VMS_ARRAY) ? field->num : 1;
+
+        if (field->flags & VMS_STRUCT) {
+            for (i = 0; i < n; i++) {
+                off += aspfuzz_psp_walk_vmsd(field->vmsd, base + i * field->size,
+                                             buf ? buf + off : NULL, save);
+            }
+            continue;
+        }
+
+        if (buf) {
+            if (save) {
+                memcpy(buf + off, base, field->size * n);
+            } else {
+                memcpy(base, buf + off, field->size * n);
+            }
+        }
+        off += field->size * n;
+    }
+
+    return off;
+}
+
+size_t aspfuzz_psp_state_size(void);
+size_t aspfuzz_psp_state_size(void) {
+    DeviceState *devs[ASPFUZZ_PSP_MAX_DEVICES];
+    size_t size = 0;
+    int i, n;
+
+    if (aspfuzz_psps[0] == NULL) {
+        return 0;
+    }
+
+    n = aspfuzz_psp_devices(devs);
+    for (i = 0; i < n; i++) {
+        DeviceClass *dc = DEVICE_GET_CLASS(devs[i]);
+        size += aspfuzz_psp_walk_vmsd(dc->vmsd, devs[i], NULL, true);
+    }
+
+    return size;
+}
+
+void aspfuzz_psp_save_state(void *buf);
+void aspfuzz_psp_save_state(void *buf) {
+    DeviceState *devs[ASPFUZZ_PSP_MAX_DEVICES];
+    uint8_t *p = buf;
+    int i, n;
+
+    if (aspfuzz_psps[0] == NULL) {
+        return;
+    }
+
+    n = aspfuzz_psp_devices(devs);
+    for (i = 0; i < n; i++) {
+        const VMStateDescription *vmsd = DEVICE_GET_CLASS(devs[i])->vmsd;
+
+        if (vmsd->pre_save) {
+            vmsd->pre_save(devs[i]);
+        }
+        p += aspfuzz_psp_walk_vmsd(vmsd, devs[i], p, true);
+    }
+}
+
+void aspfuzz_psp_restore_state(const void *buf);
+void aspfuzz_psp_restore_state(const void *buf) {
+    DeviceState *devs[ASPFUZZ_PSP_MAX_DEVICES];
+    uint8_t *p = (uint8_t *)buf;
+    int i, n;
+
+    if (aspfuzz_psps[0] == NULL) {
+        return;
+    }
+
+    n = aspfuzz_psp_devices(devs);
+    for (i = 0; i < n; i++) {
+        const VMStateDescription *vmsd = DEVICE_GET_CLASS(devs[i])->vmsd;
+
+        if (vmsd->pre_load) {
+            vmsd->pre_load(devs[i]);
+        }
+        p += aspfuzz_psp_walk_vmsd(vmsd, devs[i], p, false);
+        if (vmsd->post_load) {
+            vmsd->post_load(devs[i], vmsd->version_id);
+        }
+    }
+}
+
+void libafl_shadow_poison(target_ulong addr, size_t len);
+
+/*
+ * Poison the "sram-poison" ranges for the sanitizer. The shadow is indexed
+ * by virtual address and shared by all dies, so this assumes the firmware
+ * sees the SRAM identity mapped. The checks themselves are only generated
+ * once the harness enables them.
+ */
+static bool amd_psp_poison_sram(AmdPspState *s, AmdPspClass *c,
+                                Error **errp) {
+    const char *p = s->sram_poison;
+    uint64_t start, end;
+
+    while (p && *p) {
+        if (qemu_strtou64(p, &p, 0, &start) < 0 || *p != '-' ||
+            qemu_strtou64(p + 1, &p, 0, &end) < 0 ||
+            (*p != ',' && *p != '\0') || end < start || end >= c->sram_size) {
+            error_setg(errp, "Invalid sram-poison \"%s\", expected "
+                       "start-end[,start-end...] within the SRAM",
+                       s->sram_poison);
+            return false;
+        }
+        libafl_shadow_poison(c->sram_base + start, end - start + 1);
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return true;
+}
+//// +++ End ASPFuzz code +++
+
 // TODO: Check CPU Object properties
 
+/* Map a device into the address space of this PSP */
+static void amd_psp_mmio_map(MemoryRegion *mem, SysBusDevice *dev, hwaddr addr,
+                             int priority) {
+    memory_region_add_subregion_overlap(mem, addr,
+                                        sysbus_mmio_get_region(dev, 0),
+                                        priority);
+}
+
 /* Initialize psp and its device. This should never fail */
 static void amd_psp_init(Object *obj)
 {
@@ -109,15 +289,30 @@ static void amd_psp_realize(DeviceState *dev, Error **errp)
 {
     AmdPspState *s = AMD_PSP(dev);
     AmdPspClass *c = AMD_PSP_GET_CLASS(dev);
+    MemoryRegion *mem = s->memory ? s->memory : get_system_memory();
+    g_autofree char *sram_name = NULL;
+    g_autofree char *rom_name = NULL;
 
     qemu_log("Generation: %s\n", DEVICE_GET_CLASS(dev)->desc);
 
     /* TODO: Maybe use "&error_abort" instead? */
     Error *err = NULL;
 
+    if (s->die_id >= AMD_PSP_MAX_DIES) {
+        error_setg(errp, "die-id %u out of range, at most %d dies",
+                   s->die_id, AMD_PSP_MAX_DIES);
+        return;
+    }
+
     /* TODO: Enable the ARM TrustZone extensions. Needed? */
     //object_property_set_bool(OBJECT(&s->cpu), "has_el3", true,  &err);
 
+    /* Every PSP sees its own SRAM, ROM and devices */
+    if (s->memory) {
+        object_property_set_link(OBJECT(&s->cpu), "memory", OBJECT(mem),
+                                 &error_abort);
+    }
+
     /* Init CPU object. TODO convert to qdev_init_nofail */
     qdev_realize(DEVICE(&s->cpu), NULL, &err);
     if (err != NULL) {
@@ -127,6 +322,12 @@ static void amd_psp_realize(DeviceState *dev, Error **errp)
 
     //TODO: Do we really need to solve this with a prop?
     qdev_prop_set_int32(DEVICE(&s->smn), "smn-container-base", c->smn_container_base);
+    object_property_set_link(OBJECT(&s->smn), "memory", OBJECT(mem),
+                             &error_abort);
+    if (s->smn_fabric) {
+        object_property_set_link(OBJECT(&s->smn), "fabric",
+                                 OBJECT(s->smn_fabric), &error_abort);
+    }
     if(!sysbus_realize(SYS_BUS_DEVICE(&s->smn), errp)) {
         return;
     }
@@ -140,22 +341,45 @@ static void amd_psp_realize(DeviceState *dev, Error **errp)
 
     qdev_prop_set_string(DEVICE(&s->base_mem), "psp_misc_ident", "BASE MEM");
 
+    /* Selects the register values of this generation */
+    qdev_prop_set_int32(DEVICE(&s->base_mem), "psp_misc_gen", c->gen);
+
     if(!sysbus_realize(SYS_BUS_DEVICE(&s->base_mem), &err)) {
         return;
     }
 
+    /* RAM block names have to be unique, keep the old ones for the master */
+    if (s->die_id) {
+        sram_name = g_strdup_printf("sram-die%u", s->die_id);
+        rom_name = g_strdup_printf("rom-die%u", s->die_id);
+    } else {
+        sram_name = g_strdup("sram");
+        rom_name = g_strdup("rom");
+    }
+
     /* Init SRAM */
-    memory_region_init_ram(&s->sram, OBJECT(dev), "sram", c->sram_size,
+    memory_region_init_ram(&s->sram, OBJECT(dev), sram_name, c->sram_size,
                            &error_abort);
-    memory_region_add_subregion(get_system_memory(), c->sram_base, &s->sram);
+    memory_region_add_subregion(mem, c->sram_base, &s->sram);
 
-    /* Init ROM */
-    memory_region_init_rom(&s->rom, OBJECT(dev), "rom", c->rom_size,
-                           &error_abort);
-    memory_region_add_subregion(get_system_memory(), c->rom_base, &s->rom);
+    //// +++ Begin ASPFuzz code +++
+    if (!amd_psp_poison_sram(s, c, errp)) {
+        return;
+    }
+    //// +++ End ASPFuzz code +++
+
+    /* Init ROM. All dies run the same on-chip bootloader */
+    if (s->rom_source) {
+        memory_region_init_alias(&s->rom, OBJECT(dev), rom_name, s->rom_source,
+                                 0, c->rom_size);
+    } else {
+        memory_region_init_rom(&s->rom, OBJECT(dev), rom_name, c->rom_size,
+                               &error_abort);
+    }
+    memory_region_add_subregion(mem, c->rom_base, &s->rom);
 
     /* Map SMN control registers */
-    sysbus_mmio_map(SYS_BUS_DEVICE(&s->smn), 0, c->smn_ctrl_base);
+    amd_psp_mmio_map(mem, SYS_BUS_DEVICE(&s->smn), c->smn_ctrl_base, 0);
 
     /* Map X86 control registers */
     //sysbus_mmio_map(SYS_BUS_DEVICE(&s->x86), 0, PSP_X86_CTRL1_BASE);
@@ -170,25 +394,27 @@ static void amd_psp_realize(DeviceState *dev, Error **errp)
     if(!sysbus_realize(SYS_BUS_DEVICE(&s->timer1), errp)) {
         return;
     }
-    sysbus_mmio_map(SYS_BUS_DEVICE(&s->timer1), 0, PSP_TIMER1_BASE);
+    amd_psp_mmio_map(mem, SYS_BUS_DEVICE(&s->timer1), PSP_TIMER1_BASE, 0);
 
     /* Map timer 2 */
     if(!sysbus_realize(SYS_BUS_DEVICE(&s->timer2), errp)) {
         return;
     }
-    sysbus_mmio_map(SYS_BUS_DEVICE(&s->timer2), 0, PSP_TIMER2_BASE);
+    amd_psp_mmio_map(mem, SYS_BUS_DEVICE(&s->timer2), PSP_TIMER2_BASE, 0);
 
     /* Map PSP Status port */
     if(!sysbus_realize(SYS_BUS_DEVICE(&s->sts), errp)) {
         return;
     }
-    sysbus_mmio_map(SYS_BUS_DEVICE(&s->sts), 0, c->sts_base);
+    amd_psp_mmio_map(mem, SYS_BUS_DEVICE(&s->sts), c->sts_base, 0);
 
     /* Map CCP */
+    object_property_set_link(OBJECT(&s->ccp), "memory", OBJECT(mem),
+                             &error_abort);
     if(!sysbus_realize(SYS_BUS_DEVICE(&s->ccp), errp)) {
         return;
     }
-    sysbus_mmio_map(SYS_BUS_DEVICE(&s->ccp), 0, PSP_CCP_BASE);
+    amd_psp_mmio_map(mem, SYS_BUS_DEVICE(&s->ccp), PSP_CCP_BASE, 0);
 
     /* Map Fuse */
     if(s->dbg_mode) {
@@ -198,12 +424,12 @@ static void amd_psp_realize(DeviceState *dev, Error **errp)
     if(!sysbus_realize(SYS_BUS_DEVICE(&s->fuse), errp)) {
         return;
     }
-    sysbus_mmio_map(SYS_BUS_DEVICE(&s->fuse), 0, PSP_FUSE_BASE);
+    amd_psp_mmio_map(mem, SYS_BUS_DEVICE(&s->fuse), PSP_FUSE_BASE, 0);
 
     /* Map the misc device as an overlap with low priority */
     /* This device covers all "unknown" psp registers */
     /* TODO reduce this to only cover the known mmio region */
-    sysbus_mmio_map_overlap(SYS_BUS_DEVICE(&s->base_mem), 0, 0, -100);
+    amd_psp_mmio_map(mem, SYS_BUS_DEVICE(&s->base_mem), 0, -100);
 
     /* General unimplemented device that maps the whole memory with low priority */
     qdev_prop_set_string(DEVICE(&s->unimp), "name", "unimp");
@@ -211,13 +437,24 @@ static void amd_psp_realize(DeviceState *dev, Error **errp)
     if(!sysbus_realize(SYS_BUS_DEVICE(&s->unimp), &error_abort)) {
         return;
     }
-    sysbus_mmio_map_overlap(SYS_BUS_DEVICE(&s->unimp), 0, 0, -1000);
+    amd_psp_mmio_map(mem, SYS_BUS_DEVICE(&s->unimp), 0, -1000);
 
+    //// +++ Begin ASPFuzz code +++
+    aspfuzz_psps[s->die_id] = s;
+    //// +++ End ASPFuzz code +++
 }
 
 /* User-configurable options with "-global amd-psp.<property>=<value> */
 static Property amd_psp_properties[] = {
     DEFINE_PROP_BOOL("dbg_mode", AmdPspState, dbg_mode, false),
+    DEFINE_PROP_UINT32("die-id", AmdPspState, die_id, 0),
+    DEFINE_PROP_LINK("memory", AmdPspState, memory, TYPE_MEMORY_REGION,
+                     MemoryRegion *),
+    DEFINE_PROP_LINK("smn-fabric", AmdPspState, smn_fabric, TYPE_PSP_SMN,
+                     PSPSmnState *),
+    DEFINE_PROP_LINK("rom-source", AmdPspState, rom_source, TYPE_MEMORY_REGION,
+                     MemoryRegion *),
+    DEFINE_PROP_STRING("sram-poison", AmdPspState, sram_poison),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -235,6 +472,7 @@ static void amd_psp_zen_class_init(ObjectClass *oc, void *data) {
     AmdPspClass *pspc = AMD_PSP_CLASS(oc);
 
     dc->desc = amd_psp_gen_ident[ZEN];
+    pspc->gen = ZEN;
 
     pspc->sram_size = (256 * 1024);
     pspc->sram_base = 0x0;
@@ -252,9 +490,11 @@ static void amd_psp_zen_class_init(ObjectClass *oc, void *data) {
 
 static void amd_psp_zen_plus_class_init(ObjectClass *oc, void *data) {
     DeviceClass *dc = DEVICE_CLASS(oc);
+    AmdPspClass *pspc = AMD_PSP_CLASS(oc);
     /* Zen Plus barely differs from orig Zen. Overwrite differences afterwards */
     amd_psp_zen_class_init(oc, data);
     dc->desc = amd_psp_gen_ident[ZEN_PLUS];
+    pspc->gen = ZEN_PLUS;
 }
 
 static void amd_psp_zen_two_class_init(ObjectClass *oc, void *data) {
@@ -262,6 +502,7 @@ static void amd_psp_zen_two_class_init(ObjectClass *oc, void *data) {
     AmdPspClass *pspc = AMD_PSP_CLASS(oc);
 
     dc->desc = amd_psp_gen_ident[ZEN2];
+    pspc->gen = ZEN2;
 
     pspc->sram_size = (320 * 1024);
     pspc->sram_base = 0x0;
@@ -281,6 +522,7 @@ static void amd_psp_zen_three_class_init(ObjectClass *oc, void *data) {
     AmdPspClass *pspc = AMD_PSP_CLASS(oc);
 
     dc->desc = amd_psp_gen_ident[ZEN3];
+    pspc->gen = ZEN3;
 
     pspc->sram_size = (320 * 1024);
     pspc->sram_base = 0x0;
@@ -300,6 +542,7 @@ static void amd_psp_zen_tesla_class_init(ObjectClass *oc, void *data) {
     AmdPspClass *pspc = AMD_PSP_CLASS(oc);
 
     dc->desc = amd_psp_gen_ident[ZENTESLA];
+    pspc->gen = ZENTESLA;
 
     pspc->sram_size = (256 * 1024);
     pspc->sram_base = 0x0;
@@ -0,0 +1,255 @@
+/*
+ * AMD PSP emulation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "hw/misc/ccpv5-cache.h"
+
+/*
+ * The backing file is a sequence of records, each a CcpV5CacheRecord
+ * followed by "out_len" bytes of output. Records are only ever appended with
+ * a single write(), so several QEMU processes can share one file: each of
+ * them picks up the records of the others when it misses.
+ */
+#define CCP_CACHE_MAGIC 0x4d504343 /* "CCPM" */
+
+typedef struct CcpV5CacheRecord {
+    uint32_t magic;
+    uint32_t out_len;
+    CcpV5CacheKey key;
+} CcpV5CacheRecord;
+
+typedef struct CcpV5CacheEntry {
+    CcpV5CacheKey key;
+    uint32_t out_len;
+    uint8_t out[];
+} CcpV5CacheEntry;
+
+#define CCP_CACHE_SEED0 0x9e3779b97f4a7c15ULL
+#define CCP_CACHE_SEED1 0xc2b2ae3d27d4eb4fULL
+
+static inline uint64_t ccp_cache_mix(uint64_t h, uint64_t v) {
+    h ^= v * 0xff51afd7ed558ccdULL;
+    h = (h << 31) | (h >> 33);
+    return h * 0xc4ceb9fe1a85ec53ULL;
+}
+
+static uint64_t ccp_cache_hash(uint64_t h, const uint8_t *buf, size_t len) {
+    uint64_t v;
+
+    while (len >= 8) {
+        v = ldq_le_p(buf);
+        h = ccp_cache_mix(h, v);
+        buf += 8;
+        len -= 8;
+    }
+    v = 0;
+    memcpy(&v, buf, len);
+    h = ccp_cache_mix(h, v ^ len);
+
+    h ^= h >> 29;
+    return h;
+}
+
+void ccp_cache_key_init(CcpV5CacheKey *key, uint32_t engine, uint32_t function) {
+    memset(key, 0, sizeof(*key));
+    key->engine = engine;
+    key->function = function;
+    key->hash[0] = CCP_CACHE_SEED0;
+    key->hash[1] = CCP_CACHE_SEED1;
+}
+
+void ccp_cache_key_add(CcpV5CacheKey *key, const void *buf, size_t len) {
+    key->in_len += len;
+    key->hash[0] = ccp_cache_hash(key->hash[0], buf, len);
+    key->hash[1] = ccp_cache_hash(key->hash[1] ^ len, buf, len);
+}
+
+static guint ccp_cache_key_hash(gconstpointer p) {
+    const CcpV5CacheKey *key = p;
+    return (guint)key->hash[0];
+}
+
+static gboolean ccp_cache_key_equal(gconstpointer a, gconstpointer b) {
+    return memcmp(a, b, sizeof(CcpV5CacheKey)) == 0;
+}
+
+static void ccp_cache_evict(CcpV5Cache *c, uint64_t needed) {
+    CcpV5CacheEntry *e;
+
+    while (c->size + needed > c->max_size &&
+           (e = g_queue_pop_head(c->order)) != NULL) {
+        c->size -= e->out_len;
+        /* Frees "e" */
+        g_hash_table_remove(c->entries, &e->key);
+    }
+}
+
+/* Add an entry to the in-memory table. Returns false if it is not cached */
+static bool ccp_cache_add(CcpV5Cache *c, const CcpV5CacheKey *key,
+                          const void *out, uint32_t out_len) {
+    CcpV5CacheEntry *e;
+
+    if (out_len > c->max_size) {
+        return false;
+    }
+    if (g_hash_table_contains(c->entries, key)) {
+        return false;
+    }
+
+    ccp_cache_evict(c, out_len);
+
+    e = g_malloc(sizeof(*e) + out_len);
+    e->key = *key;
+    e->out_len = out_len;
+    memcpy(e->out, out, out_len);
+
+    g_hash_table_insert(c->entries, &e->key, e);
+    g_queue_push_tail(c->order, e);
+    c->size += out_len;
+    return true;
+}
+
+/* Read the records appended to the backing file since the last sync */
+static void ccp_cache_sync(CcpV5Cache *c) {
+    CcpV5CacheRecord rec;
+    struct stat st;
+    uint8_t *out;
+
+    if (c->fd < 0 || fstat(c->fd, &st) < 0) {
+        return;
+    }
+
+    while (c->file_off + (off_t)sizeof(rec) <= st.st_size) {
+        if (pread(c->fd, &rec, sizeof(rec), c->file_off) != sizeof(rec)) {
+            break;
+        }
+        if (rec.magic != CCP_CACHE_MAGIC) {
+            warn_report("CCP: Corrupt cache file %s at offset 0x%" PRIx64,
+                        c->path, (uint64_t)c->file_off);
+            /* Don't look at this file again */
+            close(c->fd);
+            c->fd = -1;
+            return;
+        }
+        /* Another process might still be writing this record */
+        if (c->file_off + (off_t)(sizeof(rec) + rec.out_len) > st.st_size) {
+            break;
+        }
+
+        out = g_malloc(rec.out_len);
+        if (pread(c->fd, out, rec.out_len, c->file_off + sizeof(rec)) !=
+            rec.out_len) {
+            g_free(out);
+            break;
+        }
+        ccp_cache_add(c, &rec.key, out, rec.out_len);
+        g_free(out);
+
+        c->file_off += sizeof(rec) + rec.out_len;
+    }
+}
+
+void ccp_cache_init(CcpV5Cache *c, Error **errp) {
+    c->entries = g_hash_table_new_full(ccp_cache_key_hash, ccp_cache_key_equal,
+                                       NULL, g_free);
+    c->order = g_queue_new();
+    qemu_mutex_init(&c->lock);
+    c->size = 0;
+    c->hits = 0;
+    c->misses = 0;
+    c->fd = -1;
+    c->file_off = 0;
+
+    if (c->path) {
+        c->fd = qemu_create(c->path, O_RDWR | O_APPEND, 0644, errp);
+        if (c->fd < 0) {
+            return;
+        }
+        ccp_cache_sync(c);
+    }
+}
+
+bool ccp_cache_lookup(CcpV5Cache *c, const CcpV5CacheKey *key, void *out,
+                      uint32_t max_len, uint32_t *out_len) {
+    CcpV5CacheEntry *e;
+
+    if (!c->enabled) {
+        return false;
+    }
+
+    qemu_mutex_lock(&c->lock);
+    e = g_hash_table_lookup(c->entries, key);
+    if (e == NULL) {
+        /* Maybe another instance computed it in the meantime */
+        ccp_cache_sync(c);
+        e = g_hash_table_lookup(c->entries, key);
+    }
+
+    if (e == NULL || e->out_len > max_len) {
+        c->misses++;
+        qemu_mutex_unlock(&c->lock);
+        return false;
+    }
+
+    c->hits++;
+    *out_len = e->out_len;
+    /* The entry may be evicted as soon as the lock is dropped */
+    memcpy(out, e->out, e->out_len);
+    qemu_mutex_unlock(&c->lock);
+    return true;
+}
+
+void ccp_cache_insert(CcpV5Cache *c, const CcpV5CacheKey *key,
+                      const void *out, uint32_t out_len) {
+    CcpV5CacheRecord rec;
+    uint8_t *buf;
+    struct stat st;
+
+    if (!c->enabled) {
+        return;
+    }
+
+    qemu_mutex_lock(&c->lock);
+    if (!ccp_cache_add(c, key, out, out_len)) {
+        qemu_mutex_unlock(&c->lock);
+        return;
+    }
+
+    /* The file is bounded by the same size as the in-memory table */
+    if (c->fd < 0 || fstat(c->fd, &st) < 0 ||
+        (uint64_t)st.st_size + sizeof(rec) + out_len > c->max_size) {
+        qemu_mutex_unlock(&c->lock);
+        return;
+    }
+
+    rec.magic = CCP_CACHE_MAGIC;
+    rec.out_len = out_len;
+    rec.key = *key;
+
+    /* One write per record keeps concurrent appends from interleaving */
+    buf = g_malloc(sizeof(rec) + out_len);
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), out, out_len);
+    if (qemu_write_full(c->fd, buf, sizeof(rec) + out_len) !=
+        sizeof(rec) + out_len) {
+        warn_report("CCP: Couldn't append to cache file %s", c->path);
+    }
+    qemu_mutex_unlock(&c->lock);
+    g_free(buf);
+}
@@ -21,6 +21,7 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "qemu/module.h"
+#include "qemu/units.h"
 #include "sysemu/sysemu.h"
 #include "exec/address-spaces.h"
 #include "hw/sysbus.h"
@@ -38,6 +39,13 @@
 #include "trace.h"
 #include "hw/arm/psp.h"
 #include "crypto/hash.h"
+#include "migration/vmstate.h"
+#include "block/aio.h"
+#include "block/thread-pool.h"
+#include "block/aio-wait.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "hw/irq.h"
 /* TODO: Restrict access to specific MemoryRegions only.
  *       Verify correct use of cpu_physical_memory_map/unmap */
 
@@ -111,7 +119,7 @@ static uint32_t ccp_queue_read(CcpV5State *s, hwaddr offset, uint32_t id) {
     qs = &s->q_states[id];
     switch(offset) {
         case CCP_Q_CTRL_OFFSET:
-            if(qs->ccp_q_control & CCP_Q_RUN) {
+            if((qs->ccp_q_control & CCP_Q_RUN) && !qs->busy) {
                 ccp_process_q(s,id);
             }
             ret = qs->ccp_q_control;
@@ -129,6 +137,12 @@ static uint32_t ccp_queue_read(CcpV5State *s, hwaddr offset, uint32_t id) {
             ret = qs->ccp_q_status;
             trace_ccp_queue_status_read(id, ret);
             break;
+        case CCP_Q_INT_ENABLE_OFFSET:
+            ret = qs->ccp_q_int_enable;
+            break;
+        case CCP_Q_INT_STATUS_OFFSET:
+            ret = qs->ccp_q_int_status;
+            break;
         default:
             qemu_log_mask(LOG_UNIMP, "CCP: CCP queue read at unknown " \
                           "offset: 0x%" HWADDR_PRIx "\n", offset);
@@ -179,7 +193,8 @@ static void ccp_in_guest_pt(CcpV5State *s, uint32_t id, hwaddr dst, hwaddr src,
     } else if (dst_type == CCP_MEMTYPE_LOCAL) {
         /* TODO: Check whether "dst" is accessible for the CCP */
         /* sets "plen" to the length of memory that was acutally mapped */
-        hdst = cpu_physical_memory_map(dst, &plen, true);
+        hdst = address_space_map(&s->dma_as, dst, &plen, true,
+                                 MEMTXATTRS_UNSPECIFIED);
         if (hdst == NULL) {
             qemu_log_mask(LOG_GUEST_ERROR, "CCP: Couldn't map guest memory during" \
                                            " passthrough operation\n");
@@ -200,7 +215,8 @@ static void ccp_in_guest_pt(CcpV5State *s, uint32_t id, hwaddr dst, hwaddr src,
     else if (src_type == CCP_MEMTYPE_LOCAL) {
         /* TODO: Check whether "src" is accessible for the CCP */
         /* sets "plen" to the length of memory that was acutally mapped */
-        hsrc = cpu_physical_memory_map(src, &plen, false);
+        hsrc = address_space_map(&s->dma_as, src, &plen, false,
+                                 MEMTXATTRS_UNSPECIFIED);
         if (hsrc == NULL) {
             qemu_log_mask(LOG_GUEST_ERROR, "CCP: Couldn't map guest memory during" \
                                            " passthrough operation\n");
@@ -217,9 +233,9 @@ static void ccp_in_guest_pt(CcpV5State *s, uint32_t id, hwaddr dst, hwaddr src,
     ccp_memcpy(hdst, hsrc, plen, bwise, bswap);
 
     if (dclean)
-        cpu_physical_memory_unmap(hdst, len, true, 0);
+        address_space_unmap(&s->dma_as, hdst, len, true, 0);
     if (sclean)
-        cpu_physical_memory_unmap(hsrc, len, false, 0);
+        address_space_unmap(&s->dma_as, hsrc, len, false, 0);
 }
 
 
@@ -248,37 +264,83 @@ static void ccp_passthrough(CcpV5State *s, uint32_t id, ccp5_desc *desc) {
     ccp_in_guest_pt(s, id, dst, src, cbytes, dst_type, src_type, bwise, bswap);
 }
 
-static void ccp_perform_sha_256(CcpV5State *s, hwaddr src, uint32_t len, bool eom, bool init, uint8_t* lsb_ctx) {
+/* A hash that starts and ends within one descriptor only depends on its
+ * input. Look it up in the cache and, on a hit, store the digest to the LSB.
+ */
+static bool ccp_sha_cache_lookup(CcpV5State *s, uint32_t type, hwaddr src,
+                                 uint32_t len, uint8_t* lsb_ctx,
+                                 uint32_t digest_len, CcpV5CacheKey *key) {
+    uint8_t digest[48];
+    uint32_t cached_len;
+    void* hsrc;
+    hwaddr plen = len;
+
+    hsrc = address_space_map(&s->dma_as, src, &plen, false,
+                             MEMTXATTRS_UNSPECIFIED);
+    if (hsrc == NULL) {
+        return false;
+    }
+    if (plen != len) {
+        address_space_unmap(&s->dma_as, hsrc, plen, false, 0);
+        return false;
+    }
+    ccp_cache_key_init(key, CCP_ENGINE_SHA, type);
+    ccp_cache_key_add(key, hsrc, plen);
+    address_space_unmap(&s->dma_as, hsrc, plen, false, 0);
+
+    if (!ccp_cache_lookup(&s->cache, key, digest, sizeof(digest),
+                          &cached_len) || cached_len != digest_len) {
+        return false;
+    }
+    memcpy(lsb_ctx, digest, digest_len);
+    return true;
+}
+
+static void ccp_perform_sha_256(CcpV5State *s, CcpV5QState *qs, hwaddr src, uint32_t len, bool eom, bool init, uint8_t* lsb_ctx) {
     /* TODO: use nettle. See: https://www.gnutls.org/manual/html_node/Using-GnuTLS-as-a-cryptographic-library.html#Using-GnuTLS-as-a-cryptographic-library */
     /* Use "init" to determine whether we need to initialize a new sha context */
     void* hsrc;
     hwaddr plen;
+    CcpV5CacheKey key = { 0 };
+    bool memo;
     plen = len;
 
-    if (s->sha_ctx.raw == NULL) {
+    memo = s->cache.enabled && qs->sha_ctx.raw == NULL && eom;
+    if (memo && ccp_sha_cache_lookup(s, CCP_SHA_TYPE_256, src, len, lsb_ctx,
+                                     32, &key)) {
+        return;
+    }
+
+    if (qs->sha_ctx.raw == NULL) {
         /* Init new SHA256 context */
-        ccp_init_sha256_ctx(&s->sha_ctx);
+        ccp_init_sha256_ctx(&qs->sha_ctx);
+        qs->sha_ctx_len = sizeof(struct sha256_ctx);
     }
-    if(s->sha_ctx.raw != NULL) {
-        hsrc = cpu_physical_memory_map(src, &plen, false);
+    if(qs->sha_ctx.raw != NULL) {
+        hsrc = address_space_map(&s->dma_as, src, &plen, false,
+                                 MEMTXATTRS_UNSPECIFIED);
         if (plen != len) {
             qemu_log_mask(LOG_GUEST_ERROR, "CCP Error: Couldn't map guest memory\n");
             return;
         }
         if (hsrc != NULL) {
-            ccp_update_sha256(&s->sha_ctx, len, hsrc);
+            ccp_update_sha256(&qs->sha_ctx, len, hsrc);
         } else {
             qemu_log_mask(LOG_GUEST_ERROR, "CCP Error: Couldn't map guest memory\n");
             return;
         }
         if (eom) {
-            ccp_digest_sha256(&s->sha_ctx, lsb_ctx);
+            ccp_digest_sha256(&qs->sha_ctx, lsb_ctx);
+            qs->sha_ctx_len = 0;
             /* The CCP seems to store the digest in reversed order -> Do as the
              * CCP would do, even if it means we reverse it again when the 
              * digest is copied from the lsb to the PSP.
              */
             ccp_reverse_buf(lsb_ctx, 32); // 32 -> SHA256 digest size 
-            cpu_physical_memory_unmap(hsrc, plen, false, 0);
+            address_space_unmap(&s->dma_as, hsrc, plen, false, 0);
+            if (memo) {
+                ccp_cache_insert(&s->cache, &key, lsb_ctx, 32);
+            }
         }
 
     } else {
@@ -287,37 +349,51 @@ static void ccp_perform_sha_256(CcpV5State *s, hwaddr src, uint32_t len, bool eo
     }
 }
 
-static void ccp_perform_sha_384(CcpV5State *s, hwaddr src, uint32_t len, bool eom, bool init, uint8_t* lsb_ctx) {
+static void ccp_perform_sha_384(CcpV5State *s, CcpV5QState *qs, hwaddr src, uint32_t len, bool eom, bool init, uint8_t* lsb_ctx) {
     /* TODO: use nettle. See: https://www.gnutls.org/manual/html_node/Using-GnuTLS-as-a-cryptographic-library.html#Using-GnuTLS-as-a-cryptographic-library */
     /* Use "init" to determine whether we need to initialize a new sha context */
     void* hsrc;
     hwaddr plen;
+    CcpV5CacheKey key = { 0 };
+    bool memo;
     plen = len;
 
-    if (s->sha_ctx.raw == NULL) {
+    memo = s->cache.enabled && qs->sha_ctx.raw == NULL && eom;
+    if (memo && ccp_sha_cache_lookup(s, CCP_SHA_TYPE_384, src, len, lsb_ctx,
+                                     48, &key)) {
+        return;
+    }
+
+    if (qs->sha_ctx.raw == NULL) {
         /* Init new SHA384 context */
-        ccp_init_sha384_ctx(&s->sha_ctx);
+        ccp_init_sha384_ctx(&qs->sha_ctx);
+        qs->sha_ctx_len = sizeof(struct sha384_ctx);
     }
-    if(s->sha_ctx.raw != NULL) {
-        hsrc = cpu_physical_memory_map(src, &plen, false);
+    if(qs->sha_ctx.raw != NULL) {
+        hsrc = address_space_map(&s->dma_as, src, &plen, false,
+                                 MEMTXATTRS_UNSPECIFIED);
         if (plen != len) {
             qemu_log_mask(LOG_GUEST_ERROR, "CCP Error: Couldn't map guest memory\n");
             return;
         }
         if (hsrc != NULL) {
-            ccp_update_sha384(&s->sha_ctx, len, hsrc);
+            ccp_update_sha384(&qs->sha_ctx, len, hsrc);
         } else {
             qemu_log_mask(LOG_GUEST_ERROR, "CCP Error: Couldn't map guest memory\n");
             return;
         }
         if (eom) {
-            ccp_digest_sha384(&s->sha_ctx, lsb_ctx);
+            ccp_digest_sha384(&qs->sha_ctx, lsb_ctx);
+            qs->sha_ctx_len = 0;
             /* The CCP seems to store the digest in reversed order -> Do as the
              * CCP would do, even if it means we reverse it again when the 
              * digest is copied from the lsb to the PSP.
              */
             ccp_reverse_buf(lsb_ctx, 48); // 48 -> SHA384 digest size 
-            cpu_physical_memory_unmap(hsrc, plen, false, 0);
+            address_space_unmap(&s->dma_as, hsrc, plen, false, 0);
+            if (memo) {
+                ccp_cache_insert(&s->cache, &key, lsb_ctx, 48);
+            }
         }
 
     } else {
@@ -338,7 +414,11 @@ static bool ccp_zlib(CcpV5State *s, uint32_t id, ccp5_desc *desc) {
     void* hdst;
     hwaddr plen_in;
     hwaddr plen_out;
-    bool err;
+    bool err = false;
+    CcpV5CacheKey key = { 0 };
+    uint8_t cached[CCP_ZLIB_CHUNK_SIZE];
+    uint32_t cached_len;
+    CcpV5QState *qs = &s->q_states[id];
 
     src_type = CCP5_CMD_SRC_MEM(desc);
     dst_type = CCP5_CMD_DST_MEM(desc);
@@ -360,33 +440,54 @@ static bool ccp_zlib(CcpV5State *s, uint32_t id, ccp5_desc *desc) {
     }
 
     if (init) {
-      if (ccp_zlib_init(&s->zlib_state)) {
+      if (ccp_zlib_init(&qs->zlib_state)) {
         qemu_log_mask(LOG_UNIMP, "CCP Error: Couldn't initialize zlib state\n");
         return true;
       }
     }
 
     /* Mapping input buffer */
-    hsrc = cpu_physical_memory_map(src, &plen_in, false);
+    hsrc = address_space_map(&s->dma_as, src, &plen_in, false,
+                             MEMTXATTRS_UNSPECIFIED);
     if (plen_in != len) {
         qemu_log_mask(LOG_GUEST_ERROR, "CCP Error: Zlib couldn't map guest input memory\n");
-        cpu_physical_memory_unmap(hsrc, plen_in, true, plen_in);
+        address_space_unmap(&s->dma_as, hsrc, plen_in, true, plen_in);
         return true;
     }
+
+    if (s->cache.enabled) {
+        ccp_cache_key_init(&key, CCP_ENGINE_ZLIB_DECOMPRESS,
+                           CCP5_CMD_FUNCTION(desc));
+        ccp_cache_key_add(&key, hsrc, len);
+        if (ccp_cache_lookup(&s->cache, &key, cached, sizeof(cached),
+                             &cached_len)) {
+            address_space_unmap(&s->dma_as, hsrc, plen_in, false, 0);
+            address_space_write(&s->dma_as, dst, MEMTXATTRS_UNSPECIFIED, cached,
+                                cached_len);
+            ccp_zlib_end(&qs->zlib_state);
+            return false;
+        }
+    }
     /* Mapping output buffer */
     /* TODO: Try to decompress page wise until we can't map the hosts memory anymore */
     plen_out = CCP_ZLIB_CHUNK_SIZE;
-    hdst = cpu_physical_memory_map(dst, &plen_out, false);
+    hdst = address_space_map(&s->dma_as, dst, &plen_out, false,
+                             MEMTXATTRS_UNSPECIFIED);
     if (plen_out != CCP_ZLIB_CHUNK_SIZE) {
       /* qemu_log_mask(LOG_GUEST_ERROR, "CCP Error: Zlib couldn't map guest output memory\n"); */
       err = true;
         /* return; */
     }
 
-    ccp_zlib_inflate(&s->zlib_state, plen_in, plen_out, hdst, hsrc);
+    ccp_zlib_inflate(&qs->zlib_state, plen_in, plen_out, hdst, hsrc);
+
+    if (s->cache.enabled && !err) {
+        ccp_cache_insert(&s->cache, &key, hdst,
+                         plen_out - qs->zlib_state.avail_out);
+    }
 
     if(eom) {
-      ccp_zlib_end(&s->zlib_state);
+      ccp_zlib_end(&qs->zlib_state);
     }
 
     return err;
@@ -402,6 +503,7 @@ static void ccp_sha(CcpV5State *s, uint32_t id, ccp5_desc *desc) {
     uint64_t sha_len;
     uint32_t ctx_id;
     uint8_t* ctx;
+    CcpV5QState *qs = &s->q_states[id];
 
     func.raw = CCP5_CMD_FUNCTION(desc);
     init = CCP5_CMD_INIT(desc);
@@ -416,12 +518,12 @@ static void ccp_sha(CcpV5State *s, uint32_t id, ccp5_desc *desc) {
     switch (func.sha.type) {
         case CCP_SHA_TYPE_256:
             trace_ccp_sha(src, len, sha_len, init, eom, ctx_id);
-            ccp_perform_sha_256(s, src, len, eom, init, ctx);
+            ccp_perform_sha_256(s, qs, src, len, eom, init, ctx);
 
             break;
         case CCP_SHA_TYPE_384:
             trace_ccp_sha(src, len, sha_len, init, eom, ctx_id);
-            ccp_perform_sha_384(s, src, len, eom, init, ctx);
+            ccp_perform_sha_384(s, qs, src, len, eom, init, ctx);
 
             break;
         default:
@@ -439,9 +541,10 @@ static void ccp_copy_to_host(CcpV5State *s, void* hdst, hwaddr src, ccp_memtype
     hwaddr plen = len;
 
     if (stype == CCP_MEMTYPE_LOCAL) {
-        hsrc = cpu_physical_memory_map(src, &plen, false);
+        hsrc = address_space_map(&s->dma_as, src, &plen, false,
+                                 MEMTXATTRS_UNSPECIFIED);
         memcpy(hdst, hsrc, len);
-        cpu_physical_memory_unmap(hsrc, len, false, plen);
+        address_space_unmap(&s->dma_as, hsrc, len, false, plen);
     } else if (stype == CCP_MEMTYPE_SB) {
         hsrc = s->lsb.u.lsb + src;
         memcpy(hdst, hsrc, len);
@@ -457,9 +560,10 @@ static void ccp_copy_to_guest(CcpV5State *s, hwaddr dst, void* hsrc, ccp_memtype
 
     if(dtype == CCP_MEMTYPE_LOCAL) {
         /* TODO: Check for error */
-        hdst = cpu_physical_memory_map(dst, &plen, true);
+        hdst = address_space_map(&s->dma_as, dst, &plen, true,
+                                 MEMTXATTRS_UNSPECIFIED);
         memcpy(hdst, hsrc, plen);
-        cpu_physical_memory_unmap(hdst, plen, true, plen);
+        address_space_unmap(&s->dma_as, hdst, plen, true, plen);
     } else if (dtype == CCP_MEMTYPE_SB) {
         hdst = s->lsb.u.lsb + dst;
         memcpy(hdst, hsrc, len);
@@ -504,6 +608,9 @@ static void ccp_rsa(CcpV5State *s, uint32_t id, ccp5_desc *desc) {
     hwaddr rsa_src;
     hwaddr rsa_dst;
     CcpV5RsaPubKey rsa_pubkey;
+    CcpV5CacheKey key = { 0 };
+    bool cached;
+    uint32_t cached_len;
 
     uint8_t rsa_exp[512]; /* Only 2048 & 4096 for now */
     uint8_t rsa_mod[512]; /* Only 2048 & 4096 for now */
@@ -547,12 +654,27 @@ static void ccp_rsa(CcpV5State *s, uint32_t id, ccp5_desc *desc) {
         /* Copy RSA message (signature) */
         ccp_copy_to_host(s, rsa_msg, rsa_src + rsa_size , rsa_src_mtype, rsa_size);
 
-        ccp_rsa_init_key(&rsa_pubkey, rsa_mod, rsa_exp);
+        cached = false;
+        if (s->cache.enabled) {
+            ccp_cache_key_init(&key, CCP_ENGINE_RSA, func.raw);
+            ccp_cache_key_add(&key, rsa_exp, rsa_size);
+            ccp_cache_key_add(&key, rsa_mod, rsa_size);
+            ccp_cache_key_add(&key, rsa_msg, rsa_size);
+            cached = ccp_cache_lookup(&s->cache, &key, rsa_result,
+                                      sizeof(rsa_result), &cached_len) &&
+                     cached_len == rsa_size;
+        }
+
+        if (!cached) {
+            ccp_rsa_init_key(&rsa_pubkey, rsa_mod, rsa_exp);
+
 
+            ccp_rsa_encrypt(&rsa_pubkey, rsa_msg, rsa_result);
 
-        ccp_rsa_encrypt(&rsa_pubkey, rsa_msg, rsa_result);
+            ccp_rsa_clear_key(&rsa_pubkey);
 
-        ccp_rsa_clear_key(&rsa_pubkey);
+            ccp_cache_insert(&s->cache, &key, rsa_result, rsa_size);
+        }
 
         ccp_copy_to_guest(s, rsa_dst, rsa_result, rsa_dst_mtype, rsa_size);
 
@@ -599,43 +721,213 @@ static void ccp_execute(CcpV5State *s, uint32_t id, ccp5_desc *desc) {
 
 }
 
-static void ccp_process_q(CcpV5State *s, uint32_t id) {
+/* The LSB is shared by all queues. SHA keeps its context there, any other
+ * engine only touches it through an operand of memory type SB.
+ */
+static bool ccp_desc_uses_lsb(ccp5_desc *desc) {
+    return CCP5_CMD_ENGINE(desc) == CCP_ENGINE_SHA ||
+           CCP5_CMD_SRC_MEM(desc) == CCP_MEMTYPE_SB ||
+           CCP5_CMD_DST_MEM(desc) == CCP_MEMTYPE_SB ||
+           CCP5_CMD_KEY_MEM(desc) == CCP_MEMTYPE_SB;
+}
 
-    CcpV5QState *qs;
+/* Execute the descriptors in [tail, head) */
+static void ccp_run_q(CcpV5State *s, uint32_t id, uint32_t tail,
+                      uint32_t head) {
     ccp5_desc *desc;
     hwaddr req_len;
-    uint32_t tail;
-    uint32_t head;
-    /* TODO: This operation needs to be delayed! */
-
-    qs = &s->q_states[id];
-    trace_ccp_process_queue(qs->ccp_q_id, qs->ccp_q_tail, qs->ccp_q_head);
-
-    /* Clear HALT bit */
-    /* Clear RUN bit. TODO: The secure OS never re-sets the RUN bit. We need
-     * to figure out how/when we really clear this bit */
-    qs->ccp_q_control &= ~((CCP_Q_CTRL_HALT | CCP_Q_RUN));
-
-    /* TODO fix tail/head data types? */
-    tail = qs->ccp_q_tail;
-    head = qs->ccp_q_head;
+    bool lsb;
 
     req_len = sizeof(ccp5_desc);
 
     while (tail < head) {
-        desc = cpu_physical_memory_map(tail, &req_len, false);
+        desc = address_space_map(&s->dma_as, tail, &req_len, false,
+                                 MEMTXATTRS_UNSPECIFIED);
+        /* Descriptors of other queues may run in parallel */
+        lsb = ccp_desc_uses_lsb(desc);
+        if (lsb) {
+            qemu_mutex_lock(&s->lsb_lock);
+        }
         ccp_execute(s, id, desc);
+        if (lsb) {
+            qemu_mutex_unlock(&s->lsb_lock);
+        }
         /* TODO: What is "access_len" ? */
-        cpu_physical_memory_unmap(desc, req_len, false, sizeof(ccp5_desc));
+        address_space_unmap(&s->dma_as, desc, req_len, false,
+                            sizeof(ccp5_desc));
         tail += sizeof(ccp5_desc);
 
     }
+}
+
+static void ccp_update_irq(CcpV5State *s) {
+    int i;
+    bool level = false;
+
+    for (i = 0; i < CCP_Q_COUNT; i++) {
+        level |= (s->q_states[i].ccp_q_int_status &
+                  s->q_states[i].ccp_q_int_enable) != 0;
+    }
+    qemu_set_irq(s->irq, level);
+}
+
+/* Make the end of a queue run visible to the guest */
+static void ccp_complete_q(CcpV5State *s, CcpV5QState *qs) {
+    qs->busy = false;
 
     /* TODO: Return proper CCP error codes */
-    qs->ccp_q_tail = qs->ccp_q_head;
+    qs->ccp_q_tail = qs->job_head;
     qs->ccp_q_status = CCP_Q_STATUS_SUCCESS;
     qs->ccp_q_control |= CCP_Q_CTRL_HALT;
+    qs->ccp_q_int_status |= CCP_Q_INT_COMPLETION;
+    ccp_update_irq(s);
+}
+
+/* Runs in a thread pool worker */
+static int ccp_q_worker(void *opaque) {
+    CcpV5QState *qs = opaque;
+
+    /* Guest memory mappings and logging take RCU read locks */
+    rcu_register_thread();
+    ccp_run_q(qs->ccp, qs->ccp_q_id, qs->job_tail, qs->job_head);
+    rcu_unregister_thread();
+
+    qatomic_store_release(&qs->job_finished, true);
+    qemu_event_set(&qs->job_done);
+    return 0;
+}
+
+/* Runs in the main loop once ccp_q_worker() returned */
+static void ccp_q_worker_done(void *opaque, int ret) {
+    CcpV5QState *qs = opaque;
+
+    qs->job_pending = false;
+
+    /* The run might already have been completed by ccp_drain_q() and a new
+     * one started since. Only complete a run that is actually finished.
+     */
+    if (qs->ccp->async_mode == CCP_ASYNC_THREAD && qs->busy &&
+        qatomic_load_acquire(&qs->job_finished)) {
+        ccp_complete_q(qs->ccp, qs);
+    }
+}
+
+static bool ccp_jobs_pending(CcpV5State *s) {
+    int i;
+
+    for (i = 0; i < CCP_Q_COUNT; i++) {
+        if (s->q_states[i].job_pending) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Wait for the worker of "qs" to finish. Its DMA may dispatch to MMIO
+ * regions that take the BQL, so the BQL must not be held while waiting.
+ * Callers have to recheck the queue state afterwards.
+ */
+static void ccp_wait_q(CcpV5QState *qs) {
+    if (qatomic_load_acquire(&qs->job_finished)) {
+        return;
+    }
+
+    if (qemu_mutex_iothread_locked()) {
+        qemu_mutex_unlock_iothread();
+        qemu_event_wait(&qs->job_done);
+        qemu_mutex_lock_iothread();
+    } else {
+        qemu_event_wait(&qs->job_done);
+    }
+}
+
+/* Completion timer of CCP_ASYNC_VIRTUAL. The guest always sees the queue
+ * finish "async_delay" ns after it started, however long the host took.
+ */
+static void ccp_q_timer_cb(void *opaque) {
+    CcpV5QState *qs = opaque;
+
+    if (!qs->busy) {
+        return;
+    }
+    ccp_wait_q(qs);
+    if (qs->busy && qatomic_load_acquire(&qs->job_finished)) {
+        ccp_complete_q(qs->ccp, qs);
+    }
+}
+
+/* Wait for an in-flight run of queue "qs". If "complete" is false the run
+ * is dropped without touching the guest-visible state.
+ */
+static void ccp_drain_q(CcpV5State *s, CcpV5QState *qs, bool complete) {
+    /* A run completed by the timer or the worker callback meanwhile may
+     * have been followed by a new one, wait for that as well.
+     */
+    while (qs->busy && !qatomic_load_acquire(&qs->job_finished)) {
+        ccp_wait_q(qs);
+    }
+    if (!qs->busy) {
+        return;
+    }
+    timer_del(&qs->job_timer);
+    if (complete) {
+        ccp_complete_q(s, qs);
+    } else {
+        qs->busy = false;
+    }
+}
+
+void libafl_qemu_add_fork_notifier(Notifier *n);
 
+/* The fork server tears down the thread pool before each fork(). Let the
+ * workers finish and their completions run; the guest-visible completion
+ * of CCP_ASYNC_VIRTUAL still waits for the timer.
+ */
+static void ccp_fork_notify(Notifier *n, void *data) {
+    CcpV5State *s = container_of(n, CcpV5State, fork_notifier);
+    int i;
+
+    for (i = 0; i < CCP_Q_COUNT; i++) {
+        if (s->q_states[i].job_pending) {
+            ccp_wait_q(&s->q_states[i]);
+        }
+    }
+    AIO_WAIT_WHILE(NULL, ccp_jobs_pending(s));
+}
+
+static void ccp_process_q(CcpV5State *s, uint32_t id) {
+
+    CcpV5QState *qs;
+
+    qs = &s->q_states[id];
+    trace_ccp_process_queue(qs->ccp_q_id, qs->ccp_q_tail, qs->ccp_q_head);
+
+    /* Clear HALT bit */
+    /* Clear RUN bit. TODO: The secure OS never re-sets the RUN bit. We need
+     * to figure out how/when we really clear this bit */
+    qs->ccp_q_control &= ~((CCP_Q_CTRL_HALT | CCP_Q_RUN));
+
+    /* TODO fix tail/head data types? */
+    qs->job_tail = qs->ccp_q_tail;
+    qs->job_head = qs->ccp_q_head;
+
+    if (s->async_mode == CCP_ASYNC_OFF) {
+        ccp_run_q(s, id, qs->job_tail, qs->job_head);
+        ccp_complete_q(s, qs);
+        return;
+    }
+
+    /* The queue stays "running" (HALT clear) until the run completes */
+    qs->busy = true;
+    qs->job_pending = true;
+    qs->job_finished = false;
+    qemu_event_reset(&qs->job_done);
+    thread_pool_submit_aio(aio_get_thread_pool(qemu_get_aio_context()),
+                           ccp_q_worker, qs, ccp_q_worker_done, qs);
+    if (s->async_mode == CCP_ASYNC_VIRTUAL) {
+        timer_mod(&qs->job_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + s->async_delay);
+    }
 }
 
 static void ccp_queue_write(CcpV5State *s, hwaddr offset, uint32_t val,
@@ -669,6 +961,15 @@ static void ccp_queue_write(CcpV5State *s, hwaddr offset, uint32_t val,
             qs->ccp_q_status = val;
             trace_ccp_queue_status_write(id, val);
             break;
+        case CCP_Q_INT_ENABLE_OFFSET:
+            qs->ccp_q_int_enable = val;
+            ccp_update_irq(s);
+            break;
+        case CCP_Q_INT_STATUS_OFFSET:
+            /* Write 1 to clear */
+            qs->ccp_q_int_status &= ~val;
+            ccp_update_irq(s);
+            break;
         default:
             qemu_log_mask(LOG_UNIMP, "CCP: CCP queue write at unknown " \
                           "offset: 0x%" HWADDR_PRIx " val 0x%x\n", offset, val);
@@ -806,7 +1107,12 @@ static void ccp_init_q(CcpV5State *s) {
         s->q_states[i].ccp_q_control = CCP_Q_CTRL_HALT;
         s->q_states[i].ccp_q_status = CCP_Q_STATUS_SUCCESS;
         s->q_states[i].ccp_q_id = i;
+        s->q_states[i].ccp = s;
+        qemu_event_init(&s->q_states[i].job_done, true);
+        timer_init_ns(&s->q_states[i].job_timer, QEMU_CLOCK_VIRTUAL,
+                      ccp_q_timer_cb, &s->q_states[i]);
     }
+    qemu_mutex_init(&s->lsb_lock);
 
 }
 
@@ -830,10 +1136,183 @@ static void ccp_init(Object *obj) {
             TYPE_CCP_V5, CCP_MMIO_SIZE);
 
     sysbus_init_mmio(sbd, &s->iomem);
+    sysbus_init_irq(sbd, &s->irq);
 
     ccp_init_q(s);
-    s->sha_ctx.raw = NULL;
 
+    object_property_add_uint64_ptr(obj, "memo-cache-hits", &s->cache.hits,
+                                   OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "memo-cache-misses",
+                                   &s->cache.misses, OBJ_PROP_FLAG_READ);
+}
+
+static void ccp_realize(DeviceState *dev, Error **errp) {
+    CcpV5State *s = CCP_V5(dev);
+
+    if (s->async == NULL || !strcmp(s->async, "off")) {
+        s->async_mode = CCP_ASYNC_OFF;
+    } else if (!strcmp(s->async, "thread")) {
+        s->async_mode = CCP_ASYNC_THREAD;
+    } else if (!strcmp(s->async, "virtual")) {
+        s->async_mode = CCP_ASYNC_VIRTUAL;
+    } else {
+        error_setg(errp, "CCP: Invalid async mode '%s', expected 'off', "
+                   "'thread' or 'virtual'", s->async);
+        return;
+    }
+
+    if (s->cache.enabled) {
+        ccp_cache_init(&s->cache, errp);
+    }
+
+    /* DMA goes to the address space of the PSP the CCP belongs to */
+    address_space_init(&s->dma_as, s->dma_mr ? s->dma_mr : get_system_memory(),
+                       "ccp-dma");
+
+    if (s->async_mode != CCP_ASYNC_OFF) {
+        s->fork_notifier.notify = ccp_fork_notify;
+        libafl_qemu_add_fork_notifier(&s->fork_notifier);
+    }
+}
+
+static Property ccp_properties[] = {
+    DEFINE_PROP_BOOL("memo-cache", CcpV5State, cache.enabled, false),
+    DEFINE_PROP_UINT64("memo-cache-size", CcpV5State, cache.max_size,
+                       64 * MiB),
+    DEFINE_PROP_STRING("memo-cache-file", CcpV5State, cache.path),
+    DEFINE_PROP_STRING("async", CcpV5State, async),
+    DEFINE_PROP_LINK("memory", CcpV5State, dma_mr, TYPE_MEMORY_REGION,
+                     MemoryRegion *),
+    DEFINE_PROP_UINT64("async-delay", CcpV5State, async_delay, 10000),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+/* The nettle SHA contexts are plain structs, migrate them as raw bytes.
+ * The worker owns the contexts, so in-flight runs are waited for first.
+ * Their guest-visible completion is not brought forward: "busy" and the
+ * time left until the completion timer fires are saved instead.
+ */
+static int ccp_pre_save(void *opaque) {
+    CcpV5State *s = CCP_V5(opaque);
+    CcpV5QState *qs;
+    int64_t expire;
+    int i;
+
+    for (i = 0; i < CCP_Q_COUNT; i++) {
+        qs = &s->q_states[i];
+        while (qs->busy && !qatomic_load_acquire(&qs->job_finished)) {
+            ccp_wait_q(qs);
+        }
+
+        qs->job_delay = 0;
+        expire = timer_expire_time_ns(&qs->job_timer);
+        if (qs->busy && expire != -1) {
+            qs->job_delay = MAX(expire - qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL),
+                                0);
+        }
+
+        if (qs->sha_ctx.raw == NULL) {
+            qs->sha_ctx_len = 0;
+        }
+        memset(qs->sha_ctx_data, 0, sizeof(qs->sha_ctx_data));
+        if (qs->sha_ctx_len) {
+            memcpy(qs->sha_ctx_data, qs->sha_ctx.raw, qs->sha_ctx_len);
+        }
+    }
+
+    return 0;
+}
+
+/* The loaded state replaces whatever an in-flight run would produce */
+static int ccp_pre_load(void *opaque) {
+    CcpV5State *s = CCP_V5(opaque);
+    int i;
+
+    for (i = 0; i < CCP_Q_COUNT; i++) {
+        ccp_drain_q(s, &s->q_states[i], false);
+    }
+
+    return 0;
+}
+
+static int ccp_post_load(void *opaque, int version_id) {
+    CcpV5State *s = CCP_V5(opaque);
+    CcpV5QState *qs;
+    int i;
+
+    for (i = 0; i < CCP_Q_COUNT; i++) {
+        qs = &s->q_states[i];
+        if (qs->sha_ctx_len > sizeof(qs->sha_ctx_data)) {
+            return -EINVAL;
+        }
+
+        ccp_clear_sha_ctx(&qs->sha_ctx);
+        if (qs->sha_ctx_len) {
+            qs->sha_ctx.raw = g_memdup2(qs->sha_ctx_data, qs->sha_ctx_len);
+        }
+
+        /* The run was finished by the worker before saving, only its
+         * completion is left.
+         */
+        if (qs->busy) {
+            qatomic_store_release(&qs->job_finished, true);
+            qemu_event_set(&qs->job_done);
+            if (s->async_mode == CCP_ASYNC_VIRTUAL) {
+                timer_mod(&qs->job_timer,
+                          qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + qs->job_delay);
+            } else {
+                ccp_complete_q(s, qs);
+            }
+        }
+    }
+    ccp_update_irq(s);
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_ccp_q = {
+    .name = TYPE_CCP_V5 "/queue",
+    .version_id = 3,
+    .minimum_version_id = 2,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(ccp_q_control, CcpV5QState),
+        VMSTATE_UINT32(ccp_q_tail, CcpV5QState),
+        VMSTATE_UINT32(ccp_q_head, CcpV5QState),
+        VMSTATE_UINT32(ccp_q_status, CcpV5QState),
+        VMSTATE_UINT32(ccp_q_id, CcpV5QState),
+        VMSTATE_UINT32(ccp_q_int_enable, CcpV5QState),
+        VMSTATE_UINT32(ccp_q_int_status, CcpV5QState),
+        VMSTATE_UINT32(sha_ctx_len, CcpV5QState),
+        VMSTATE_BUFFER(sha_ctx_data, CcpV5QState),
+        VMSTATE_BOOL_V(busy, CcpV5QState, 3),
+        VMSTATE_UINT32_V(job_tail, CcpV5QState, 3),
+        VMSTATE_UINT32_V(job_head, CcpV5QState, 3),
+        VMSTATE_INT64_V(job_delay, CcpV5QState, 3),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_ccp = {
+    .name = TYPE_CCP_V5,
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .pre_save = ccp_pre_save,
+    .pre_load = ccp_pre_load,
+    .post_load = ccp_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_ARRAY(q_states, CcpV5State, CCP_Q_COUNT, 2,
+                             vmstate_ccp_q, CcpV5QState),
+        VMSTATE_BUFFER(lsb.u.lsb, CcpV5State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void ccp_class_init(ObjectClass *oc, void *data) {
+    DeviceClass *dc = DEVICE_CLASS(oc);
+
+    dc->realize = ccp_realize;
+    dc->vmsd = &vmstate_ccp;
+    device_class_set_props(dc, ccp_properties);
 }
 
 static const TypeInfo ccp_info = {
@@ -841,7 +1320,7 @@ static const TypeInfo ccp_info = {
     .parent = TYPE_SYS_BUS_DEVICE,
     .instance_init = ccp_init,
     .instance_size = sizeof(CcpV5State),
-
+    .class_init = ccp_class_init,
 };
 
 static void ccp_register_types(void) {
@@ -550,6 +550,11 @@ struct TranslationBlock {
     uint16_t size;
     uint16_t icount;
 
+    //// --- Begin LibAFL code ---
+    /* Hook-set generation this TB was instrumented under */
+    uint32_t libafl_hook_gen;
+    //// --- End LibAFL code ---
+
     struct tb_tc tc;
 
     /* first and second physical page containing code. The lower bit
@@ -72,7 +72,14 @@ static inline void fuzz_dma_read_cb(size_t addr,
 /* Dirty tracking enabled because dirty limit */
 #define GLOBAL_DIRTY_LIMIT      (1U << 2)
 
-#define GLOBAL_DIRTY_MASK  (0x7)
+//// --- Begin LibAFL code ---
+
+/* Dirty tracking enabled because a LibAFL fast snapshot is active */
+#define GLOBAL_DIRTY_LIBAFL     (1U << 3)
+
+#define GLOBAL_DIRTY_MASK  (0xf)
+
+//// --- End LibAFL code ---
 
 extern unsigned int global_dirty_tracking;
 
@@ -761,6 +768,10 @@ struct MemoryRegion {
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
     RamDiscardManager *rdm; /* Only for RAM */
+    //// --- Begin LibAFL code ---
+    /* Device id in the binary MMIO trace plus one, 0 until first traced */
+    uint16_t libafl_trace_id;
+    //// --- End LibAFL code ---
 };
 
 struct IOMMUMemoryRegion {
@@ -0,0 +1,89 @@
+/*
+ * AMD PSP emulation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Fuzzed MMIO
+ *
+ * Register reads of a device can be answered from the fuzz input instead of
+ * the device model. The harness hands over an input buffer (usually the
+ * fuzzer's shared memory input map) with aspfuzz_set_mmio_input(); every
+ * selected read then consumes the next "size" bytes of it, little endian.
+ * Once the input is used up, reads fall back to the model again.
+ *
+ * Devices embed a PSPFuzzMmio and select the reads with two properties:
+ *   fuzz-unimp   reads of registers the model does not implement
+ *   fuzz-ranges  "start-end[,start-end...]" inclusive address ranges, in
+ *                the addresses the device matches registers against
+ *
+ * Each consumed chunk is logged (input offset, size, device, address) so
+ * inputs can be minimized to the bytes that were actually used.
+ */
+#ifndef AMD_PSP_FUZZ_MMIO_H
+#define AMD_PSP_FUZZ_MMIO_H
+
+#include "hw/qdev-properties.h"
+
+#define PSP_FUZZ_MMIO_MAX_RANGES 16
+
+typedef struct PSPFuzzMmioRange {
+    hwaddr start;
+    hwaddr end;     /* Inclusive */
+} PSPFuzzMmioRange;
+
+typedef struct PSPFuzzMmio {
+    /* Configuration */
+    bool unimp;
+    char *ranges_str;
+
+    /* Set at realize time */
+    bool active;
+    uint16_t id;
+    PSPFuzzMmioRange ranges[PSP_FUZZ_MMIO_MAX_RANGES];
+    uint32_t nranges;
+} PSPFuzzMmio;
+
+#define DEFINE_PSP_FUZZ_MMIO_PROPERTIES(_state, _field)                   \
+    DEFINE_PROP_BOOL("fuzz-unimp", _state, _field.unimp, false),          \
+    DEFINE_PROP_STRING("fuzz-ranges", _state, _field.ranges_str)
+
+/* A consumed piece of the input, see aspfuzz_mmio_input_log() */
+typedef struct AspfuzzMmioInputRecord {
+    uint32_t input_off;
+    uint16_t device;
+    uint8_t size;
+    uint8_t reserved;
+    uint64_t addr;
+} AspfuzzMmioInputRecord;
+
+bool psp_fuzz_mmio_realize(PSPFuzzMmio *f, const char *name, Error **errp);
+
+bool psp_fuzz_mmio_consume(PSPFuzzMmio *f, hwaddr addr, unsigned int size,
+                           bool implemented, uint64_t *val);
+
+/*
+ * Returns true and the fuzzed value in "val" if this read is selected and
+ * the input is not exhausted.
+ */
+static inline bool psp_fuzz_mmio_read(PSPFuzzMmio *f, hwaddr addr,
+                                      unsigned int size, bool implemented,
+                                      uint64_t *val)
+{
+    if (likely(!f->active)) {
+        return false;
+    }
+    return psp_fuzz_mmio_consume(f, addr, size, implemented, val);
+}
+
+#endif
@@ -20,12 +20,33 @@
 #define AMD_PSP_MISC_H
 
 
+#include "hw/arm/psp-fuzz-mmio.h"
+
 #define TYPE_PSP_MISC "amd_psp.misc"
 #define PSP_MISC(obj) OBJECT_CHECK(PSPMiscState, (obj), TYPE_PSP_MISC)
 
+/* Upper bound of registers per instance, keeps the state fixed-size */
+#define PSP_MISC_MAX_REGS 256
+
+/* Open addressing table of at least twice PSP_MISC_MAX_REGS slots */
+#define PSP_MISC_HASH_BITS 9
+#define PSP_MISC_HASH_SIZE (1 << PSP_MISC_HASH_BITS)
+
+/* "psp_misc_gen" of instances that only use the common registers */
+#define PSP_MISC_GEN_NONE (-1)
+
+/* How a register reacts to writes */
+typedef enum PSPMiscRegMode {
+    PSP_MISC_REG_RO = 0,    /* Writes are ignored */
+    PSP_MISC_REG_RW,        /* Writes replace the value */
+    PSP_MISC_REG_W1C,       /* Bits written as 1 are cleared */
+    PSP_MISC_REG_STICKY,    /* Bits written as 1 are set and stay set */
+} PSPMiscRegMode;
+
 typedef struct PSPMiscReg {
-    uint32_t addr;
-    uint32_t val;
+    hwaddr addr;
+    uint32_t val;   /* Reset value */
+    uint32_t mode;  /* PSPMiscRegMode */
 } PSPMiscReg;
 
 
@@ -39,6 +60,27 @@ typedef struct PSPMiscState {
     /* Identifier of this instance */
     char *ident;
 
+    /* PspGeneration whose registers are used, or PSP_MISC_GEN_NONE */
+    int32_t gen;
+
+    /* Optional register file overriding the built-in values */
+    char *regs_file;
+
+    /* Register table, built at realize time */
+    PSPMiscReg regs[PSP_MISC_MAX_REGS];
+    uint32_t nregs;
+
+    /* Index into "regs" by address hash, -1 if empty */
+    int16_t hash[PSP_MISC_HASH_SIZE];
+
+    /* Current register values, indexed like "regs" */
+    uint32_t values[PSP_MISC_MAX_REGS];
+
+    //// +++ Begin ASPFuzz code +++
+    /* Reads answered from the fuzz input, matched on the register address */
+    PSPFuzzMmio fuzz;
+    //// +++ End ASPFuzz code +++
+
 } PSPMiscState;
 
 
@@ -23,8 +23,8 @@
 #include "exec/memory.h"
 
 /* TODO: Configurable size based on image */
-#define PSP_SMN_FLASH_SIZE_16 16 * 1024 * 1024
-#define PSP_SMN_FLASH_SIZE_32 2 * PSP_SMN_FLASH_SIZE_16
+#define PSP_SMN_FLASH_SIZE_16 (16 * 1024 * 1024)
+#define PSP_SMN_FLASH_SIZE_32 (2 * PSP_SMN_FLASH_SIZE_16)
 
 #define TYPE_PSP_SMN_FLASH "amd_psp.smnflash"
 #define PSP_SMN_FLASH(obj) OBJECT_CHECK(PSPSmnFlashState, (obj), TYPE_PSP_SMN_FLASH)
@@ -36,6 +36,19 @@ typedef struct PSPSmnFlashState {
 
     char * flash_img;
 
+    //// +++ Begin ASPFuzz code +++
+    /* Back the flash with a memfd the fuzzer can map and write directly.
+     * The mapping is shared, so this does not work with the fork server.
+     */
+    bool flash_memfd;
+    int flash_fd;
+
+    /* Flash contents right after loading "flash_img" */
+    uint8_t *pristine;
+
+    /* AspfuzzFlashRange extents written since the last restore */
+    GArray *dirty;
+    //// +++ End ASPFuzz code +++
 
 } PSPSmnFlashState;
 #endif
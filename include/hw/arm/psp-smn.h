@@ -26,7 +26,7 @@
 #include "hw/arm/psp-smn-misc.h"
 
 #define PSP_SMN_CTRL_SIZE 16 * 4
-#define PSP_SMN_SLOT_SIZE 1024 * 1024 /* 1M */
+#define PSP_SMN_SLOT_SIZE (1024 * 1024) /* 1M */
 #define PSP_SMN_SLOT_COUNT 32
 #define PSP_SMN_SLOT_NAME_LEN  20
 #define PSP_SMN_SLOT_NAME "smn-slot_"
@@ -48,11 +48,15 @@ typedef struct PSPSmnState {
     /* MemoryRegion containing the MMIO control registers */
     MemoryRegion psp_smn_control;
 
-    /* MemoryRegions containing the SMN slots */
+    /* MMIO window covering all SMN slots, dispatched through the slot table */
+    MemoryRegion psp_smn_window;
+
+    /* Direct aliases for slots that target RAM (e.g. the flash) */
     MemoryRegion psp_smn_containers[PSP_SMN_SLOT_COUNT];
 
     /* Full 32bit SMN address space */
     MemoryRegion psp_smn_space;
+    AddressSpace psp_smn_as;
 
     /* PSP Misc device that covers the whole SMN address space */
     //PSPMiscState psp_smn_misc;
@@ -61,8 +65,19 @@ typedef struct PSPSmnState {
     /* Base address of the smn range. */
     hwaddr psp_smn_base;
 
+    /* PSP address space the slots are mapped into, system memory if unset */
+    MemoryRegion *psp_mem;
+
+    /* With several PSPs, the SMN whose address space (misc and flash) is
+     * shared with this one. Unset for the PSP that owns it.
+     */
+    struct PSPSmnState *fabric;
+
     /* Current SMN state */
-    PSPSmnAddr psp_smn_slots[32];
+    PSPSmnAddr psp_smn_slots[PSP_SMN_SLOT_COUNT];
+
+    /* Bitmap of the slots that have been programmed at least once */
+    uint32_t psp_smn_slots_mapped;
 
     /* The SMN attached flash */
     PSPSmnFlashState psp_smn_flash;
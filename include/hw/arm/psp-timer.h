@@ -28,6 +28,12 @@
 /* PSP Timer iomem size */
 #define PSP_TIMER_SIZE 0x24
 
+/* Control register: the counter runs while this bit is set */
+#define PSP_TIMER_CTRL_EN 0x1
+
+/* Upper bound of a single fast-forward step, in ticks */
+#define PSP_TIMER_FF_MAX_STEP (1 << 20)
+
 typedef struct PSPTimerState {
     SysBusDevice parent_obj;
 
@@ -35,8 +41,29 @@ typedef struct PSPTimerState {
     MemoryRegion psp_timer_iomem;
 
     uint32_t psp_timer_control;
+    /* With "virtual_clock" the count at "base_ns" */
     uint32_t psp_timer_count;
 
+    /* Derive the count from QEMU_CLOCK_VIRTUAL instead of counting reads.
+     * Without icount that clock follows host time, so runs only repeat
+     * with "-icount" given as well.
+     */
+    bool virtual_clock;
+    uint32_t ns_per_tick;
+    int64_t base_ns;
+
+    /* Busy-wait fast-forward: after "ff_threshold" count reads that are at
+     * most "ff_window_ns" apart, each further read advances the count by a
+     * doubling step, so a delay loop finishes after log2(delay) iterations.
+     * The window is measured in QEMU_CLOCK_VIRTUAL, which only ignores host
+     * speed under icount, so this is off by default.
+     */
+    bool fast_forward;
+    uint32_t ff_threshold;
+    uint64_t ff_window_ns;
+    uint32_t ff_streak;
+    uint32_t ff_step;
+    int64_t ff_last_read_ns;
 
 } PSPTimerState;
 #endif
@@ -28,9 +28,9 @@
 #define PSP_X86_SLOT_NAME_LEN  20
 #define PSP_X86_SLOT_NAME "x86-slot_"
 
-#define PSP_X86_SLOT_SIZE 64 * 1024 * 1024 /* 64M */
+#define PSP_X86_SLOT_SIZE (64 * 1024 * 1024) /* 64M */
 #define PSP_X86_SLOT_COUNT 62
-#define PSP_X86_CONTAINER_SIZE PSP_X86_SLOT_SIZE * PSP_X86_SLOT_COUNT
+#define PSP_X86_CONTAINER_SIZE ((uint64_t)PSP_X86_SLOT_SIZE * PSP_X86_SLOT_COUNT)
 #define PSP_X86_REG_COUNT 6
 
 #define PSP_X86_CTLR1_SIZE PSP_X86_SLOT_COUNT * 4 * 4
@@ -76,7 +76,8 @@ typedef struct PSPX86State {
     /* Base address of the x86 container range. */
     hwaddr psp_x86_base;
 
-    MemoryRegion psp_x86_containers[PSP_X86_SLOT_COUNT];
+    /* MMIO window covering all x86 slots, dispatched through the slot table */
+    MemoryRegion psp_x86_window;
 
     PSPX86Slot psp_x86_slots[PSP_X86_SLOT_COUNT];
 
@@ -85,6 +86,7 @@ typedef struct PSPX86State {
 
     /* The X86 address space */
     MemoryRegion psp_x86_space;
+    AddressSpace psp_x86_as;
 
 } PSPX86State;
 #endif
@@ -98,6 +98,9 @@ typedef struct AmdPspConfiguration {
     uint32_t smn_flash_base;
 } AmdPspConfiguration;
 
+/* Server parts have up to this many dies, each with its own PSP */
+#define AMD_PSP_MAX_DIES 8
+
 typedef struct AmdPspState {
   /*< private >*/
   DeviceState parent_obj;
@@ -109,6 +112,23 @@ typedef struct AmdPspState {
   bool dbg_mode;
   ARMCPU cpu;
 
+  /* PSP address space, the system memory if not linked */
+  MemoryRegion *memory;
+
+  /* Die this PSP sits on. Die 0 is the master */
+  uint32_t die_id;
+
+  /* Only set on the other dies: the SMN of the master, whose address space
+   * is shared by all PSPs, and the master's on-chip ROM.
+   */
+  PSPSmnState *smn_fabric;
+  MemoryRegion *rom_source;
+
+  /* "start-end[,start-end...]" SRAM offsets (inclusive) that are poisoned in
+   * the shadow memory of the LibAFL sanitizer, e.g. unused gaps.
+   */
+  char *sram_poison;
+
   /* This device covers every MMIO address we have not covered somewhere else */
   PSPMiscState base_mem;
 
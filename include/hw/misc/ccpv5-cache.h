@@ -0,0 +1,76 @@
+/*
+ * AMD PSP emulation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CCP5 result cache
+ *
+ * The firmware verifies and decompresses the same flash blobs on every boot.
+ * Operations whose result only depends on their input bytes (RSA, single
+ * descriptor SHA, zlib) can be memoized: the key is the engine, the function
+ * field and a hash over all input bytes, the value is the produced output.
+ */
+#ifndef AMD_CCP_V5_CACHE_H
+#define AMD_CCP_V5_CACHE_H
+
+#include "qapi/error.h"
+#include "qemu/thread.h"
+
+typedef struct CcpV5CacheKey {
+    uint32_t engine;
+    uint32_t function;
+    uint64_t in_len;
+    uint64_t hash[2];
+} CcpV5CacheKey;
+
+typedef struct CcpV5Cache {
+    /* Configuration, set through the CCP device properties */
+    bool enabled;
+    uint64_t max_size;
+    char *path;
+
+    /* Statistics */
+    uint64_t hits;
+    uint64_t misses;
+
+    /* Queues running on worker threads share the cache */
+    QemuMutex lock;
+
+    /* Bytes of output currently held */
+    uint64_t size;
+
+    GHashTable *entries;
+    /* Insertion order, oldest first, for eviction */
+    GQueue *order;
+
+    /* Shared backing file, -1 if none */
+    int fd;
+    /* Offset up to which the backing file has been read */
+    off_t file_off;
+} CcpV5Cache;
+
+void ccp_cache_init(CcpV5Cache *c, Error **errp);
+
+void ccp_cache_key_init(CcpV5CacheKey *key, uint32_t engine, uint32_t function);
+void ccp_cache_key_add(CcpV5CacheKey *key, const void *buf, size_t len);
+
+/* Copies the stored output for "key" to "out" if it is there and at most
+ * "max_len" bytes long, and counts the hit/miss.
+ */
+bool ccp_cache_lookup(CcpV5Cache *c, const CcpV5CacheKey *key, void *out,
+                      uint32_t max_len, uint32_t *out_len);
+void ccp_cache_insert(CcpV5Cache *c, const CcpV5CacheKey *key,
+                      const void *out, uint32_t out_len);
+
+#endif
@@ -23,7 +23,10 @@
 #include "exec/memory.h"
 #include "hw/misc/ccpv5-nettle.h"
 #include "hw/misc/ccpv5-zlib.h"
+#include "hw/misc/ccpv5-cache.h"
 #include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qemu/notify.h"
 
 #define TYPE_CCP_V5 "amd.ccpV5"
 #define CCP_V5(obj) OBJECT_CHECK(CcpV5State, (obj), TYPE_CCP_V5)
@@ -49,6 +52,8 @@
 #define CCP_Q_CTRL_OFFSET    0x0    /* Control register offset */
 #define CCP_Q_HEAD_LO_OFFSET 0x4    /* Queue head register offset */
 #define CCP_Q_TAIL_LO_OFFSET 0x8    /* Queue tail register offset */ 
+#define CCP_Q_INT_ENABLE_OFFSET 0xc /* Interrupt enable register offset */
+#define CCP_Q_INT_STATUS_OFFSET 0x10 /* Interrupt status register offset */
 #define CCP_Q_STATUS_OFFSET  0x100  /* Queue status register offset */
 
 /* Global registers */
@@ -69,6 +74,14 @@
 #define CCP_Q_STATUS_SUCCESS                0
 #define CCP_Q_STATUS_ERROR                  1
 
+/* Interrupt status/enable bit for a completed queue run */
+#define CCP_Q_INT_COMPLETION                BIT(0)
+
+/* Queue execution modes, see the "async" property */
+#define CCP_ASYNC_OFF     0   /* Descriptors run inside the MMIO access */
+#define CCP_ASYNC_THREAD  1   /* Completes as soon as the worker is done */
+#define CCP_ASYNC_VIRTUAL 2   /* Completes "async-delay" virtual ns later */
+
 /* Total size of the CCP MMIO region */
 #define CCP_MMIO_SIZE CCP_Q_COUNT * CCP_Q_SIZE + \
         CCP_CTRL_SIZE + CCP_CONFIG_SIZE
@@ -85,6 +98,8 @@ typedef struct CcpV5Lsb {
     } u;
 } CcpV5Lsb;
 
+struct CcpV5State;
+
 typedef struct CcpV5QState {
   uint32_t ccp_q_control;
   uint32_t ccp_q_tail;
@@ -93,18 +108,71 @@ typedef struct CcpV5QState {
 
   uint32_t ccp_q_id;
 
+  uint32_t ccp_q_int_enable;
+  uint32_t ccp_q_int_status;
+
+  /* The engine contexts are per queue, so that queues can run in parallel */
+  CcpV5ShaCtx sha_ctx;
+
+  /* Size of the live nettle context behind "sha_ctx", 0 if there is none */
+  uint32_t sha_ctx_len;
+
+  /* Migration copy of the live nettle context, see ccp_pre_save() */
+  uint8_t sha_ctx_data[sizeof(struct sha512_ctx)];
+
+  /* Only INIT=1/EOM=1 inflates are supported, so the zlib stream never
+   * lives across two descriptors and is not part of the migration state.
+   */
+  CcpV5ZlibState zlib_state;
+
+  /* Asynchronous execution. While "busy" the worker owns the engine
+   * contexts above and the range [job_tail, job_head) of descriptors.
+   */
+  struct CcpV5State *ccp;
+  bool busy;
+  uint32_t job_tail;
+  uint32_t job_head;
+  /* Set until the thread pool ran ccp_q_worker_done() for the run */
+  bool job_pending;
+  /* Set by the worker once the last descriptor has been executed */
+  bool job_finished;
+  QemuEvent job_done;
+  /* Completion timer of the virtual-time mode */
+  QEMUTimer job_timer;
+  /* Migration copy of the time left on job_timer, see ccp_pre_save() */
+  int64_t job_delay;
+
 } CcpV5QState;
 
 typedef struct CcpV5State {
     SysBusDevice parent_obj;
     MemoryRegion iomem;
 
+    /* Memory seen by the DMA engine, the system memory if not linked */
+    MemoryRegion *dma_mr;
+    AddressSpace dma_as;
+
+    /* Raised while any queue has an enabled interrupt pending */
+    qemu_irq irq;
+
     CcpV5QState q_states[CCP_Q_COUNT];
 
     CcpV5Lsb lsb;
+    /* Serializes the descriptors of parallel queue runs that use the LSB */
+    QemuMutex lsb_lock;
 
-    CcpV5ShaCtx sha_ctx;
-    CcpV5ZlibState zlib_state;
+    /* Memoized results of RSA, SHA and zlib operations */
+    CcpV5Cache cache;
+
+    /* "async" property ("off", "thread" or "virtual") and its parsed
+     * CCP_ASYNC_* value. "async_delay" is the completion delay in ns of
+     * CCP_ASYNC_VIRTUAL.
+     */
+    char *async;
+    int async_mode;
+    uint64_t async_delay;
+    /* Lets the queue workers finish before a fork server fork() */
+    Notifier fork_notifier;
 
     /* Timer to process QUEUE events "asynchronously" */
     QEMUTimer dma_timer;
@@ -1669,3 +1669,205 @@ TargetFdTrans target_inotify_trans = {
     .host_to_target_data = host_to_target_data_inotify,
 };
 #endif
+
+//// --- Begin LibAFL code ---
+
+struct libafl_vfd **libafl_vfd_table;
+QemuMutex libafl_vfd_lock;
+unsigned int libafl_vfd_max;
+
+static struct libafl_vfd *libafl_vfd_lookup_unsafe(int fd)
+{
+    if (fd < 0 || fd >= libafl_vfd_max) {
+        return NULL;
+    }
+    return libafl_vfd_table[fd];
+}
+
+static void libafl_vfd_put_unsafe(int fd)
+{
+    struct libafl_vfd *vfd = libafl_vfd_lookup_unsafe(fd);
+
+    if (!vfd) {
+        return;
+    }
+    libafl_vfd_table[fd] = NULL;
+    if (--vfd->refs == 0) {
+        g_free(vfd);
+    }
+}
+
+static void libafl_vfd_set_unsafe(int fd, struct libafl_vfd *vfd)
+{
+    unsigned int oldmax, newmax;
+
+    if (fd >= libafl_vfd_max) {
+        oldmax = libafl_vfd_max;
+        newmax = ((fd >> 6) + 1) << 6; /* by slice of 64 entries */
+        libafl_vfd_table = g_renew(struct libafl_vfd *,
+                                   libafl_vfd_table, newmax);
+        memset((void *)(libafl_vfd_table + oldmax), 0,
+               (newmax - oldmax) * sizeof(struct libafl_vfd *));
+        qatomic_set(&libafl_vfd_max, newmax);
+    }
+    vfd->refs++;
+    libafl_vfd_put_unsafe(fd);
+    libafl_vfd_table[fd] = vfd;
+}
+
+void libafl_vfd_register(int fd, const uint8_t *buf, const size_t *len)
+{
+    struct libafl_vfd *vfd;
+
+    if (fd < 0) {
+        return;
+    }
+
+    vfd = g_new0(struct libafl_vfd, 1);
+    vfd->buf = buf;
+    vfd->len = len;
+
+    QEMU_LOCK_GUARD(&libafl_vfd_lock);
+    libafl_vfd_set_unsafe(fd, vfd);
+}
+
+void libafl_vfd_unregister(int fd)
+{
+    if (fd < 0 || likely(!qatomic_read(&libafl_vfd_max))) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&libafl_vfd_lock);
+    libafl_vfd_put_unsafe(fd);
+}
+
+void libafl_vfd_dup(int oldfd, int newfd)
+{
+    struct libafl_vfd *vfd;
+
+    if (oldfd == newfd || newfd < 0 ||
+        likely(!qatomic_read(&libafl_vfd_max))) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&libafl_vfd_lock);
+    vfd = libafl_vfd_lookup_unsafe(oldfd);
+    if (vfd) {
+        libafl_vfd_set_unsafe(newfd, vfd);
+    } else {
+        libafl_vfd_put_unsafe(newfd);
+    }
+}
+
+/* Rewind all virtual fds for the next run, e.g. stdin in persistent mode */
+void libafl_rewind_virtual_fds(void);
+void libafl_rewind_virtual_fds(void) {
+    unsigned int i;
+
+    QEMU_LOCK_GUARD(&libafl_vfd_lock);
+    for (i = 0; i < libafl_vfd_max; i++) {
+        if (libafl_vfd_table[i]) {
+            libafl_vfd_table[i]->pos = 0;
+        }
+    }
+}
+
+static size_t libafl_vfd_copy(struct libafl_vfd *vfd, void *p, size_t count,
+                              uint64_t offset)
+{
+    size_t len = *vfd->len;
+
+    if (offset >= len) {
+        return 0;
+    }
+    count = MIN(count, len - offset);
+    memcpy(p, vfd->buf + offset, count);
+    return count;
+}
+
+abi_long libafl_vfd_read(int fd, void *p, size_t count)
+{
+    struct libafl_vfd *vfd;
+    size_t n;
+
+    QEMU_LOCK_GUARD(&libafl_vfd_lock);
+    vfd = libafl_vfd_lookup_unsafe(fd);
+    if (!vfd) {
+        return -TARGET_EBADF;
+    }
+    n = libafl_vfd_copy(vfd, p, count, vfd->pos);
+    vfd->pos += n;
+    return n;
+}
+
+abi_long libafl_vfd_pread(int fd, void *p, size_t count, int64_t offset)
+{
+    struct libafl_vfd *vfd;
+
+    if (offset < 0) {
+        return -TARGET_EINVAL;
+    }
+
+    QEMU_LOCK_GUARD(&libafl_vfd_lock);
+    vfd = libafl_vfd_lookup_unsafe(fd);
+    if (!vfd) {
+        return -TARGET_EBADF;
+    }
+    return libafl_vfd_copy(vfd, p, count, offset);
+}
+
+int64_t libafl_vfd_lseek(int fd, int64_t offset, int whence)
+{
+    struct libafl_vfd *vfd;
+    uint64_t base, len;
+
+    QEMU_LOCK_GUARD(&libafl_vfd_lock);
+    vfd = libafl_vfd_lookup_unsafe(fd);
+    if (!vfd) {
+        return -TARGET_EBADF;
+    }
+    len = *vfd->len;
+
+    switch (whence) {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = vfd->pos;
+        break;
+    case SEEK_END:
+        base = len;
+        break;
+    case SEEK_DATA:
+    case SEEK_HOLE:
+        /* The whole buffer is data, with the only hole at its end */
+        if (offset < 0 || offset >= len) {
+            return -TARGET_ENXIO;
+        }
+        vfd->pos = whence == SEEK_DATA ? offset : len;
+        return vfd->pos;
+    default:
+        return -TARGET_EINVAL;
+    }
+
+    if (offset < 0 ? -(uint64_t)offset > base : offset > INT64_MAX - base) {
+        return -TARGET_EINVAL;
+    }
+    vfd->pos = base + offset;
+    return vfd->pos;
+}
+
+abi_long libafl_vfd_size(int fd, uint64_t *size)
+{
+    struct libafl_vfd *vfd;
+
+    QEMU_LOCK_GUARD(&libafl_vfd_lock);
+    vfd = libafl_vfd_lookup_unsafe(fd);
+    if (!vfd) {
+        return -TARGET_EBADF;
+    }
+    *size = *vfd->len;
+    return 0;
+}
+
+//// --- End LibAFL code ---
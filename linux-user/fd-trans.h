@@ -31,9 +31,56 @@ extern QemuMutex target_fd_trans_lock;
 
 extern unsigned int target_fd_max;
 
+//// --- Begin LibAFL code ---
+
+/*
+ * Virtual files: guest fds whose contents come from a buffer in QEMU's memory
+ * (usually the fuzzer's input in shared memory) instead of the host kernel.
+ * The fuzzer rewrites buf and *len in place between runs. The guest fd is
+ * still a real host fd, opened on /dev/null, so fd numbers stay unique and
+ * whatever is not served from the buffer keeps working on it. As with an
+ * open file description, dups share the position.
+ */
+struct libafl_vfd {
+    const uint8_t *buf;
+    const size_t *len;
+    uint64_t pos;
+    unsigned int refs;
+};
+
+extern struct libafl_vfd **libafl_vfd_table;
+extern QemuMutex libafl_vfd_lock;
+
+extern unsigned int libafl_vfd_max;
+
+void libafl_vfd_register(int fd, const uint8_t *buf, const size_t *len);
+void libafl_vfd_unregister(int fd);
+void libafl_vfd_dup(int oldfd, int newfd);
+
+/* These return -TARGET_EBADF if fd is not (or no longer) virtual */
+abi_long libafl_vfd_read(int fd, void *p, size_t count);
+abi_long libafl_vfd_pread(int fd, void *p, size_t count, int64_t offset);
+int64_t libafl_vfd_lseek(int fd, int64_t offset, int whence);
+abi_long libafl_vfd_size(int fd, uint64_t *size);
+
+static inline bool libafl_vfd_is_virtual(int fd)
+{
+    if (fd < 0 || likely(!qatomic_read(&libafl_vfd_max))) {
+        return false;
+    }
+
+    QEMU_LOCK_GUARD(&libafl_vfd_lock);
+    return fd < libafl_vfd_max && libafl_vfd_table[fd];
+}
+
+//// --- End LibAFL code ---
+
 static inline void fd_trans_init(void)
 {
     qemu_mutex_init(&target_fd_trans_lock);
+    //// --- Begin LibAFL code ---
+    qemu_mutex_init(&libafl_vfd_lock);
+    //// --- End LibAFL code ---
 }
 
 static inline TargetFdDataFunc fd_trans_target_to_host_data(int fd)
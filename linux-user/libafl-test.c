@@ -0,0 +1,209 @@
+/*
+ * Test driver for the LibAFL extensions of linux-user
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu.h"
+#include "user-internals.h"
+#include "fd-trans.h"
+
+//// --- Begin LibAFL code ---
+
+/*
+ * With QEMU_LIBAFL_TEST set in the environment, the guest programs in
+ * tests/tcg/multiarch/linux/libafl-*.c stand in for a fuzzer: they drive
+ * the LibAFL entry points through syscall LIBAFL_SYSCALL_BASE + 1023,
+ * which no target defines. The first argument selects the request below,
+ * keep the numbers in sync with tests/tcg/multiarch/linux/libafl-test.h.
+ */
+#define LIBAFL_TEST_NR 1023
+
+enum {
+    /* Returns 0, to tell the driver is there */
+    LIBAFL_TEST_PING,
+    /* Snapshot memory and CPU, returns 0 now and 1 once restored */
+    LIBAFL_TEST_SNAPSHOT,
+    /* Roll back to the last snapshot, does not return */
+    LIBAFL_TEST_RESTORE,
+    /* Serve fd from a copy of the guest buffer (addr, len) */
+    LIBAFL_TEST_VFD,
+    /* Turn the shadow memory checks on or off, reporting to the driver */
+    LIBAFL_TEST_SHADOW_ENABLE,
+    /* (Un)poison the guest range (addr, len) */
+    LIBAFL_TEST_SHADOW_POISON,
+    LIBAFL_TEST_SHADOW_UNPOISON,
+    /* Returns the number of invalid accesses since the last request */
+    LIBAFL_TEST_SHADOW_REPORTS,
+};
+
+struct syshook_ret {
+    uint64_t retval;
+    bool skip_syscall;
+};
+
+size_t libafl_add_syscall_hook(int num,
+                               struct syshook_ret (*pre)(uint64_t, int,
+                                   uint64_t, uint64_t, uint64_t, uint64_t,
+                                   uint64_t, uint64_t, uint64_t, uint64_t),
+                               uint64_t (*post)(uint64_t, uint64_t, int,
+                                   uint64_t, uint64_t, uint64_t, uint64_t,
+                                   uint64_t, uint64_t, uint64_t, uint64_t),
+                               uint64_t data);
+
+struct libafl_user_snapshot;
+struct libafl_user_snapshot *libafl_qemu_user_snapshot_new(void);
+void libafl_qemu_user_snapshot_restore(struct libafl_user_snapshot *s);
+void libafl_qemu_user_snapshot_free(struct libafl_user_snapshot *s);
+
+void libafl_shadow_poison(target_ulong addr, size_t len);
+void libafl_shadow_unpoison(target_ulong addr, size_t len);
+int libafl_shadow_enable(bool enable);
+extern void (*libafl_shadow_report_hook)(target_ulong addr, size_t size,
+                                         bool is_write, target_ulong pc);
+
+size_t libafl_qemu_cpu_state_size(CPUState* cpu);
+size_t libafl_qemu_save_cpu_state(CPUState* cpu, void* buf);
+int libafl_qemu_restore_cpu_state(CPUState* cpu, const void* buf);
+
+void libafl_test_init(void);
+
+static struct libafl_user_snapshot* libafl_test_snapshot;
+static void* libafl_test_cpu_state;
+static abi_long libafl_test_shadow_reports;
+
+static abi_long libafl_test_take_snapshot(void)
+{
+    size_t size = libafl_qemu_cpu_state_size(thread_cpu);
+
+    if (size == 0) {
+        return -TARGET_ENOSYS;
+    }
+
+    if (libafl_test_snapshot) {
+        libafl_qemu_user_snapshot_free(libafl_test_snapshot);
+    }
+    g_free(libafl_test_cpu_state);
+
+    /* Saved in the middle of this syscall, see libafl_test_restore() */
+    libafl_test_cpu_state = g_malloc(size);
+    libafl_qemu_save_cpu_state(thread_cpu, libafl_test_cpu_state);
+    libafl_test_snapshot = libafl_qemu_user_snapshot_new();
+    return 0;
+}
+
+/*
+ * The CPU goes back to where it was inside the snapshot request. Once this
+ * request returns, the guest therefore sees the snapshot request return,
+ * with the result of this one.
+ */
+static abi_long libafl_test_restore(void)
+{
+    if (libafl_test_snapshot == NULL) {
+        return -TARGET_EINVAL;
+    }
+
+    libafl_qemu_user_snapshot_restore(libafl_test_snapshot);
+    libafl_qemu_restore_cpu_state(thread_cpu, libafl_test_cpu_state);
+    return 1;
+}
+
+/* The copy is never freed, the fd and its duplicates may still use it */
+static abi_long libafl_test_vfd(int fd, abi_ulong addr, abi_ulong len)
+{
+    struct libafl_test_vfd {
+        size_t len;
+        uint8_t buf[];
+    } *vfd;
+    void *p;
+
+    p = lock_user(VERIFY_READ, addr, len, 1);
+    if (p == NULL) {
+        return -TARGET_EFAULT;
+    }
+    vfd = g_malloc(sizeof(*vfd) + len);
+    vfd->len = len;
+    memcpy(vfd->buf, p, len);
+    unlock_user(p, addr, 0);
+
+    libafl_vfd_register(fd, vfd->buf, &vfd->len);
+    return 0;
+}
+
+static void libafl_test_shadow_report(target_ulong addr, size_t size,
+                                      bool is_write, target_ulong pc)
+{
+    libafl_test_shadow_reports++;
+}
+
+static abi_long libafl_test_shadow_enable(bool enable)
+{
+    libafl_shadow_report_hook = libafl_test_shadow_report;
+    return libafl_shadow_enable(enable) ? 0 : -TARGET_ENOMEM;
+}
+
+static struct syshook_ret libafl_test_syscall(uint64_t data, int num,
+                                              uint64_t a1, uint64_t a2,
+                                              uint64_t a3, uint64_t a4,
+                                              uint64_t a5, uint64_t a6,
+                                              uint64_t a7, uint64_t a8)
+{
+    struct syshook_ret r = { .skip_syscall = true };
+    abi_long ret;
+
+    switch ((abi_long)a1) {
+    case LIBAFL_TEST_PING:
+        ret = 0;
+        break;
+    case LIBAFL_TEST_SNAPSHOT:
+        ret = libafl_test_take_snapshot();
+        break;
+    case LIBAFL_TEST_RESTORE:
+        ret = libafl_test_restore();
+        break;
+    case LIBAFL_TEST_VFD:
+        ret = libafl_test_vfd(a2, a3, a4);
+        break;
+    case LIBAFL_TEST_SHADOW_ENABLE:
+        ret = libafl_test_shadow_enable(a2 != 0);
+        break;
+    case LIBAFL_TEST_SHADOW_POISON:
+        libafl_shadow_poison(a2, a3);
+        ret = 0;
+        break;
+    case LIBAFL_TEST_SHADOW_UNPOISON:
+        libafl_shadow_unpoison(a2, a3);
+        ret = 0;
+        break;
+    case LIBAFL_TEST_SHADOW_REPORTS:
+        ret = libafl_test_shadow_reports;
+        libafl_test_shadow_reports = 0;
+        break;
+    default:
+        ret = -TARGET_EINVAL;
+        break;
+    }
+
+    r.retval = (uint64_t)ret;
+    return r;
+}
+
+void libafl_test_init(void)
+{
+    int base = 0;
+
+#if defined(TARGET_SYSCALL_OFFSET)
+    base = TARGET_SYSCALL_OFFSET;
+#elif defined(TARGET_MIPS)
+    base = 4000;
+#endif
+
+    if (!libafl_add_syscall_hook(base + LIBAFL_TEST_NR, libafl_test_syscall,
+                                 NULL, 0)) {
+        error_report("libafl: cannot install the test driver");
+        exit(EXIT_FAILURE);
+    }
+}
+
+//// --- End LibAFL code ---
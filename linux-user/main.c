@@ -653,6 +653,7 @@ static int parse_args(int argc, char **argv)
 uint64_t libafl_load_addr(void);
 int libafl_qemu_main(void);
 int libafl_qemu_run(void);
+void libafl_test_init(void);
 
 __thread CPUArchState *libafl_qemu_env;
 
@@ -973,6 +974,11 @@ int main(int argc, char **argv, char **envp)
 
     libafl_qemu_env = env;
 
+    /* See linux-user/libafl-test.c */
+    if (getenv("QEMU_LIBAFL_TEST")) {
+        libafl_test_init();
+    }
+
 #ifndef AS_LIB
     return libafl_qemu_main();
 #endif
@@ -62,6 +62,698 @@ void mmap_fork_end(int child)
         pthread_mutex_unlock(&mmap_mutex);
 }
 
+//// --- Begin LibAFL code ---
+
+/*
+ * Index of the guest mappings, kept up to date by target_mmap() and friends
+ * so harnesses can look them up and walk them without parsing
+ * /proc/self/maps. Mappings never overlap, so ordering them by start also
+ * orders them by end. The index is a treap: split and merge keep an update
+ * at O(log n) plus the number of mappings it replaces, and lookups at
+ * O(log n). Protected by mmap_lock.
+ */
+struct libafl_map_node {
+    abi_ulong start;
+    abi_ulong last;         /* Inclusive, the mapping may end at the top */
+    abi_ulong offset;
+    const char *path;       /* Interned, NULL for anonymous mappings */
+    int prot;
+    bool is_priv;
+    uint32_t prio;
+    struct libafl_map_node *left, *right;
+};
+
+static struct libafl_map_node *libafl_maps_root;
+static size_t libafl_maps_num;
+
+static void libafl_user_snapshot_touch(abi_ulong start, abi_ulong last);
+void libafl_shadow_unpoison(target_ulong addr, size_t len);
+
+static uint32_t libafl_maps_prio(void)
+{
+    static uint32_t x = 2463534242u;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+/* Split t into the mappings starting below addr and the others */
+static void libafl_maps_split(struct libafl_map_node *t, abi_ulong addr,
+                              struct libafl_map_node **l,
+                              struct libafl_map_node **r)
+{
+    if (t == NULL) {
+        *l = *r = NULL;
+    } else if (t->start < addr) {
+        libafl_maps_split(t->right, addr, &t->right, r);
+        *l = t;
+    } else {
+        libafl_maps_split(t->left, addr, l, &t->left);
+        *r = t;
+    }
+}
+
+/* All mappings in l lie below the ones in r */
+static struct libafl_map_node *libafl_maps_merge(struct libafl_map_node *l,
+                                                 struct libafl_map_node *r)
+{
+    if (l == NULL) {
+        return r;
+    }
+    if (r == NULL) {
+        return l;
+    }
+    if (l->prio > r->prio) {
+        l->right = libafl_maps_merge(l->right, r);
+        return l;
+    }
+    r->left = libafl_maps_merge(l, r->left);
+    return r;
+}
+
+static void libafl_maps_free(struct libafl_map_node *t)
+{
+    if (t) {
+        libafl_maps_free(t->left);
+        libafl_maps_free(t->right);
+        g_free(t);
+        libafl_maps_num--;
+    }
+}
+
+/* The mapping containing addr, else the first one above it */
+static struct libafl_map_node *libafl_maps_lower_bound(abi_ulong addr)
+{
+    struct libafl_map_node *t = libafl_maps_root;
+    struct libafl_map_node *n = NULL;
+
+    while (t) {
+        if (t->last >= addr) {
+            n = t;
+            t = t->left;
+        } else {
+            t = t->right;
+        }
+    }
+    return n;
+}
+
+static void libafl_maps_insert(struct libafl_map_node *n)
+{
+    struct libafl_map_node *l, *r;
+
+    n->prio = libafl_maps_prio();
+    n->left = n->right = NULL;
+    libafl_maps_split(libafl_maps_root, n->start, &l, &r);
+    libafl_maps_root = libafl_maps_merge(libafl_maps_merge(l, n), r);
+    libafl_maps_num++;
+}
+
+/* Make sure no mapping crosses addr */
+static void libafl_maps_cut(abi_ulong addr)
+{
+    struct libafl_map_node *n = libafl_maps_lower_bound(addr);
+    struct libafl_map_node *m;
+
+    if (n == NULL || n->start >= addr) {
+        return;
+    }
+
+    m = g_new(struct libafl_map_node, 1);
+    *m = *n;
+    m->start = addr;
+    if (m->path) {
+        m->offset += addr - n->start;
+    }
+    n->last = addr - 1;
+    libafl_maps_insert(m);
+}
+
+/* Drop the mappings in [start, last] */
+static void libafl_maps_remove(abi_ulong start, abi_ulong last)
+{
+    struct libafl_map_node *l, *m, *r = NULL;
+
+    libafl_maps_cut(start);
+    if (last != (abi_ulong)-1) {
+        libafl_maps_cut(last + 1);
+    }
+
+    libafl_maps_split(libafl_maps_root, start, &l, &m);
+    if (last != (abi_ulong)-1) {
+        libafl_maps_split(m, last + 1, &m, &r);
+    }
+    libafl_maps_free(m);
+    libafl_maps_root = libafl_maps_merge(l, r);
+
+    /* Poisoned shadow does not outlive the mapping, see translate-all.c */
+    libafl_shadow_unpoison(start, last - start + 1);
+}
+
+static void libafl_maps_map(abi_ulong start, abi_ulong len, int prot,
+                            bool is_priv, const char *path, abi_ulong offset)
+{
+    struct libafl_map_node *n;
+
+    libafl_maps_remove(start, start + len - 1);
+
+    n = g_new(struct libafl_map_node, 1);
+    n->start = start;
+    n->last = start + len - 1;
+    n->offset = path ? offset : 0;
+    n->path = path;
+    n->prot = prot & (PROT_READ | PROT_WRITE | PROT_EXEC);
+    n->is_priv = is_priv;
+    libafl_maps_insert(n);
+
+    libafl_user_snapshot_touch(n->start, n->last);
+}
+
+static void libafl_maps_protect(abi_ulong start, abi_ulong len, int prot)
+{
+    abi_ulong last = start + len - 1;
+    struct libafl_map_node *n;
+
+    libafl_maps_cut(start);
+    if (last != (abi_ulong)-1) {
+        libafl_maps_cut(last + 1);
+    }
+
+    for (n = libafl_maps_lower_bound(start); n && n->start <= last;
+         n = n->last == (abi_ulong)-1 ? NULL :
+             libafl_maps_lower_bound(n->last + 1)) {
+        n->prot = prot & (PROT_READ | PROT_WRITE | PROT_EXEC);
+    }
+
+    /* Pages made writable are no longer write protected */
+    libafl_user_snapshot_touch(start, last);
+}
+
+static void libafl_maps_move(abi_ulong old_addr, abi_ulong old_size,
+                             abi_ulong new_addr, abi_ulong new_size)
+{
+    struct libafl_map_node *n = libafl_maps_lower_bound(old_addr);
+    struct libafl_map_node old = { .prot = PROT_READ | PROT_WRITE,
+                                   .is_priv = true };
+
+    if (n && n->start <= old_addr) {
+        old = *n;
+        if (old.path) {
+            old.offset += old_addr - n->start;
+        }
+    }
+
+    libafl_maps_remove(old_addr, old_addr + old_size - 1);
+    libafl_maps_map(new_addr, new_size, old.prot, old.is_priv, old.path,
+                    old.offset);
+}
+
+/* Path of the file behind fd, for the index */
+static const char *libafl_maps_fd_path(int fd)
+{
+    char proc[32], buf[PATH_MAX];
+    ssize_t n;
+
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    n = readlink(proc, buf, sizeof(buf) - 1);
+    if (n < 0) {
+        return NULL;
+    }
+    buf[n] = '\0';
+    return g_intern_string(buf);
+}
+
+/* shmat() and shmdt() do not go through target_mmap() */
+void libafl_maps_shm_attach(abi_ulong start, abi_ulong len, int prot)
+{
+    libafl_maps_map(start, len, prot, false, NULL, 0);
+}
+
+void libafl_maps_shm_detach(abi_ulong start, abi_ulong len)
+{
+    libafl_maps_remove(start, start + len - 1);
+}
+
+static void libafl_maps_fill(const struct libafl_map_node *n,
+                             struct libafl_mapinfo *ret)
+{
+    ret->start = n->start;
+    ret->end = (target_ulong)n->last + 1;
+    ret->offset = n->offset;
+    ret->path = n->path;
+    ret->flags = n->prot;
+    ret->is_priv = n->is_priv;
+}
+
+/* Fill ret with the mapping containing addr. Returns 0 if there is none */
+int libafl_maps_lookup(target_ulong addr, struct libafl_mapinfo *ret);
+int libafl_maps_lookup(target_ulong addr, struct libafl_mapinfo *ret)
+{
+    struct libafl_map_node *n;
+    int found = 0;
+
+    mmap_lock();
+    n = libafl_maps_lower_bound(addr);
+    if (n && n->start <= addr) {
+        libafl_maps_fill(n, ret);
+        found = 1;
+    }
+    mmap_unlock();
+    return found;
+}
+
+/*
+ * Fill ret with the mapping containing addr or the first one above it.
+ * Returns 0 if there is none. To walk all mappings start at 0 and continue
+ * at ret->end, until ret->end wraps to 0 or 0 is returned.
+ */
+int libafl_maps_find_next(target_ulong addr, struct libafl_mapinfo *ret);
+int libafl_maps_find_next(target_ulong addr, struct libafl_mapinfo *ret)
+{
+    struct libafl_map_node *n;
+    int found = 0;
+
+    mmap_lock();
+    n = libafl_maps_lower_bound(addr);
+    if (n) {
+        libafl_maps_fill(n, ret);
+        found = 1;
+    }
+    mmap_unlock();
+    return found;
+}
+
+size_t libafl_maps_count(void);
+size_t libafl_maps_count(void)
+{
+    return libafl_maps_num;
+}
+
+//// --- End LibAFL code ---
+
+//// --- Begin LibAFL code ---
+
+#include "qemu/bitmap.h"
+#include "qemu/error-report.h"
+#include "exec/translate-all.h"
+
+/*
+ * Snapshots of the guest memory layout, the private writable memory and
+ * brk. Writable pages are write protected like pages holding translated
+ * code (PAGE_WRITE_ORG without PAGE_WRITE), so the first write to one,
+ * from the guest or from a syscall, goes through page_unprotect(), which
+ * saves the page contents and marks it dirty. mmap(), munmap(), mremap()
+ * and mprotect() do the same for their range before changing it. Only pages
+ * written since the snapshot are copied, and each one only once.
+ * A restore unmaps what was mapped since, maps again what was removed,
+ * resets changed protections and copies back the dirty pages only.
+ *
+ * Writes are only tracked for the most recent snapshot. Snapshots must be
+ * taken and restored while no other guest thread runs.
+ */
+struct libafl_user_snapshot_map {
+    abi_ulong start;
+    abi_ulong last;
+    abi_ulong offset;
+    const char *path;
+    int prot;
+    bool is_priv;
+    /*
+     * Private writable mappings only: the saved target pages, their
+     * contents (NULL if there was nothing to read) and the pages changed
+     * since the last restore
+     */
+    unsigned long *saved;
+    uint8_t **pages;
+    unsigned long *dirty;
+};
+
+struct libafl_user_snapshot {
+    struct libafl_user_snapshot_map *maps;
+    size_t num_maps;
+    abi_ulong brk;
+    abi_ulong brk_page;
+};
+
+extern void (*libafl_page_unprotect_hook)(target_ulong host_start);
+
+static struct libafl_user_snapshot *libafl_user_snapshot_active;
+
+static bool
+libafl_user_snapshot_tracked(const struct libafl_user_snapshot_map *m)
+{
+    return (m->prot & PROT_WRITE) && m->is_priv;
+}
+
+/* Index of the first mapping of s ending at or above addr */
+static size_t libafl_user_snapshot_find(struct libafl_user_snapshot *s,
+                                        abi_ulong addr)
+{
+    size_t lo = 0, hi = s->num_maps;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (s->maps[mid].last < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* /proc/self/mem of this process, reopened after a fork() */
+static int libafl_user_snapshot_mem_fd(void)
+{
+    static int fd = -1;
+    static pid_t fd_pid;
+
+    if (fd < 0 || fd_pid != getpid()) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        fd = open("/proc/self/mem", O_RDONLY | O_CLOEXEC);
+        fd_pid = getpid();
+    }
+    return fd;
+}
+
+/*
+ * Copy of the target page at addr, NULL if there is nothing to read. The
+ * page may be read protected or lie past the end of the file it maps,
+ * where a direct access raises SIGBUS, so it is read through
+ * /proc/self/mem. Without /proc only readable pages are copied.
+ */
+static uint8_t *libafl_user_snapshot_copy(abi_ulong addr)
+{
+    uint8_t *data = g_malloc(TARGET_PAGE_SIZE);
+    int fd = libafl_user_snapshot_mem_fd();
+
+    if (fd >= 0) {
+        if (pread(fd, data, TARGET_PAGE_SIZE,
+                  (off_t)(uintptr_t)g2h_untagged(addr)) == TARGET_PAGE_SIZE) {
+            return data;
+        }
+    } else if (page_get_flags(addr) & PAGE_READ) {
+        memcpy(data, g2h_untagged(addr), TARGET_PAGE_SIZE);
+        return data;
+    }
+    g_free(data);
+    return NULL;
+}
+
+/*
+ * Save the tracked pages in [start, last] that were not saved yet and mark
+ * them dirty. Must be called before their contents can change.
+ */
+static void libafl_user_snapshot_touch(abi_ulong start, abi_ulong last)
+{
+    struct libafl_user_snapshot *s = libafl_user_snapshot_active;
+    struct libafl_user_snapshot_map *m;
+    abi_ulong first, end, page;
+    size_t i;
+
+    if (s == NULL) {
+        return;
+    }
+
+    for (i = libafl_user_snapshot_find(s, start);
+         i < s->num_maps && s->maps[i].start <= last; i++) {
+        m = &s->maps[i];
+        if (!libafl_user_snapshot_tracked(m)) {
+            continue;
+        }
+        first = (MAX(start, m->start) - m->start) >> TARGET_PAGE_BITS;
+        end = (MIN(last, m->last) - m->start) >> TARGET_PAGE_BITS;
+        for (page = first; page <= end; page++) {
+            if (!test_and_set_bit(page, m->saved)) {
+                m->pages[page] = libafl_user_snapshot_copy(
+                    m->start + (page << TARGET_PAGE_BITS));
+            }
+        }
+        bitmap_set(m->dirty, first, end - first + 1);
+    }
+}
+
+/* Called by page_unprotect() with mmap_lock held */
+static void libafl_user_snapshot_unprotect(target_ulong host_start)
+{
+    libafl_user_snapshot_touch(host_start,
+                               host_start + qemu_host_page_size - 1);
+}
+
+static void libafl_user_snapshot_collect(struct libafl_map_node *t,
+                                         struct libafl_user_snapshot_map **m)
+{
+    if (t == NULL) {
+        return;
+    }
+    libafl_user_snapshot_collect(t->left, m);
+    (*m)->start = t->start;
+    (*m)->last = t->last;
+    (*m)->offset = t->offset;
+    (*m)->path = t->path;
+    (*m)->prot = t->prot;
+    (*m)->is_priv = t->is_priv;
+    (*m)++;
+    libafl_user_snapshot_collect(t->right, m);
+}
+
+/* Write protect the tracked pages of m, their next write marks them dirty */
+static void libafl_user_snapshot_protect(struct libafl_user_snapshot_map *m)
+{
+    abi_ulong addr = m->start;
+
+    /* Already protected pages are skipped quickly */
+    while (1) {
+        page_protect(addr);
+        if (m->last - addr < TARGET_PAGE_SIZE) {
+            break;
+        }
+        addr += TARGET_PAGE_SIZE;
+    }
+}
+
+struct libafl_user_snapshot *libafl_qemu_user_snapshot_new(void);
+struct libafl_user_snapshot *libafl_qemu_user_snapshot_new(void)
+{
+    struct libafl_user_snapshot *s = g_new0(struct libafl_user_snapshot, 1);
+    struct libafl_user_snapshot_map *m;
+    size_t i, npages;
+
+    mmap_lock();
+
+    s->num_maps = libafl_maps_num;
+    s->maps = g_new0(struct libafl_user_snapshot_map, s->num_maps);
+    m = s->maps;
+    libafl_user_snapshot_collect(libafl_maps_root, &m);
+
+    for (i = 0; i < s->num_maps; i++) {
+        m = &s->maps[i];
+        if (!libafl_user_snapshot_tracked(m)) {
+            continue;
+        }
+        npages = (m->last - m->start + 1) >> TARGET_PAGE_BITS;
+        m->saved = bitmap_new(npages);
+        m->pages = g_new0(uint8_t *, npages);
+        m->dirty = bitmap_new(npages);
+        libafl_user_snapshot_protect(m);
+    }
+
+    libafl_brk_get_state(&s->brk, &s->brk_page);
+
+    libafl_user_snapshot_active = s;
+    libafl_page_unprotect_hook = libafl_user_snapshot_unprotect;
+
+    mmap_unlock();
+    return s;
+}
+
+/*
+ * Compare a mapping of the snapshot with the current layout. Returns 0 if
+ * it is unchanged, 1 if only its protection changed and 2 if it has to be
+ * mapped again.
+ */
+static int libafl_user_snapshot_check(const struct libafl_user_snapshot_map *m)
+{
+    struct libafl_map_node *n = libafl_maps_lower_bound(m->start);
+    abi_ulong addr = m->start;
+    int r = 0;
+
+    while (1) {
+        if (n == NULL || n->start != addr || n->last > m->last ||
+            n->path != m->path || n->is_priv != m->is_priv ||
+            (m->path && n->offset != m->offset + (addr - m->start))) {
+            return 2;
+        }
+        if (n->prot != m->prot) {
+            r = 1;
+        }
+        if (n->last == m->last) {
+            return r;
+        }
+        addr = n->last + 1;
+        n = libafl_maps_lower_bound(addr);
+    }
+}
+
+static void libafl_user_snapshot_remap(const struct libafl_user_snapshot_map *m)
+{
+    int flags = MAP_FIXED | (m->is_priv ? MAP_PRIVATE : MAP_SHARED);
+    int fd = -1;
+
+    if (m->path) {
+        fd = open(m->path, !m->is_priv && (m->prot & PROT_WRITE) ?
+                           O_RDWR : O_RDONLY);
+    }
+    if (fd < 0) {
+        flags |= MAP_ANONYMOUS;
+    }
+
+    if (target_mmap(m->start, m->last - m->start + 1, m->prot, flags, fd,
+                    fd < 0 ? 0 : m->offset) == -1) {
+        error_report("libafl: snapshot could not map 0x" TARGET_ABI_FMT_lx
+                     " again", m->start);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/* Unmap everything that is not part of the snapshot */
+static void libafl_user_snapshot_unmap_new(struct libafl_user_snapshot *s)
+{
+    struct libafl_user_snapshot_map *cur, *c;
+    size_t i, j, num = libafl_maps_num;
+    abi_ulong addr;
+
+    cur = g_new(struct libafl_user_snapshot_map, num);
+    c = cur;
+    libafl_user_snapshot_collect(libafl_maps_root, &c);
+
+    for (i = 0; i < num; i++) {
+        addr = cur[i].start;
+        j = libafl_user_snapshot_find(s, addr);
+        while (1) {
+            if (j == s->num_maps || s->maps[j].start > cur[i].last) {
+                target_munmap(addr, cur[i].last - addr + 1);
+                break;
+            }
+            if (s->maps[j].start > addr) {
+                target_munmap(addr, s->maps[j].start - addr);
+            }
+            if (s->maps[j].last >= cur[i].last) {
+                break;
+            }
+            addr = s->maps[j].last + 1;
+            j++;
+        }
+    }
+
+    g_free(cur);
+}
+
+void libafl_qemu_user_snapshot_restore(struct libafl_user_snapshot *s);
+void libafl_qemu_user_snapshot_restore(struct libafl_user_snapshot *s)
+{
+    struct libafl_user_snapshot_map *m;
+    abi_ulong addr;
+    size_t i, npages;
+    long page;
+
+    mmap_lock();
+
+    /* Changes to the layout mark the pages they cover dirty */
+    libafl_user_snapshot_active = s;
+    libafl_page_unprotect_hook = libafl_user_snapshot_unprotect;
+
+    libafl_user_snapshot_unmap_new(s);
+    for (i = 0; i < s->num_maps; i++) {
+        m = &s->maps[i];
+        switch (libafl_user_snapshot_check(m)) {
+        case 1:
+            target_mprotect(m->start, m->last - m->start + 1, m->prot);
+            break;
+        case 2:
+            libafl_user_snapshot_remap(m);
+            break;
+        }
+    }
+
+    /*
+     * Copy back first and protect afterwards, unprotecting a page to write
+     * it would mark the pages sharing its host page dirty again.
+     */
+    for (i = 0; i < s->num_maps; i++) {
+        m = &s->maps[i];
+        if (!libafl_user_snapshot_tracked(m)) {
+            continue;
+        }
+        npages = (m->last - m->start + 1) >> TARGET_PAGE_BITS;
+        for (page = find_first_bit(m->dirty, npages); page < npages;
+             page = find_next_bit(m->dirty, npages, page + 1)) {
+            if (m->pages[page] == NULL) {
+                continue;
+            }
+            addr = m->start + ((abi_ulong)page << TARGET_PAGE_BITS);
+            if (!(page_get_flags(addr) & PAGE_WRITE)) {
+                page_unprotect(addr, 0);
+            }
+            memcpy(g2h_untagged(addr), m->pages[page], TARGET_PAGE_SIZE);
+        }
+    }
+    for (i = 0; i < s->num_maps; i++) {
+        m = &s->maps[i];
+        if (!libafl_user_snapshot_tracked(m)) {
+            continue;
+        }
+        npages = (m->last - m->start + 1) >> TARGET_PAGE_BITS;
+        for (page = find_first_bit(m->dirty, npages); page < npages;
+             page = find_next_bit(m->dirty, npages, page + 1)) {
+            page_protect(m->start + ((abi_ulong)page << TARGET_PAGE_BITS));
+        }
+        bitmap_zero(m->dirty, npages);
+    }
+
+    libafl_brk_set_state(s->brk, s->brk_page);
+
+    mmap_unlock();
+}
+
+void libafl_qemu_user_snapshot_free(struct libafl_user_snapshot *s);
+void libafl_qemu_user_snapshot_free(struct libafl_user_snapshot *s)
+{
+    struct libafl_user_snapshot_map *m;
+    size_t i, page, npages;
+
+    mmap_lock();
+    if (libafl_user_snapshot_active == s) {
+        libafl_user_snapshot_active = NULL;
+        libafl_page_unprotect_hook = NULL;
+    }
+    mmap_unlock();
+
+    for (i = 0; i < s->num_maps; i++) {
+        m = &s->maps[i];
+        if (!libafl_user_snapshot_tracked(m)) {
+            continue;
+        }
+        npages = (m->last - m->start + 1) >> TARGET_PAGE_BITS;
+        for (page = 0; page < npages; page++) {
+            g_free(m->pages[page]);
+        }
+        g_free(m->pages);
+        g_free(m->saved);
+        g_free(m->dirty);
+    }
+    g_free(s->maps);
+    g_free(s);
+}
+
+//// --- End LibAFL code ---
+
 /*
  * Validate target prot bitmask.
  * Return the prot bitmask for the host in *HOST_PROT.
@@ -185,6 +877,10 @@ int target_mprotect(abi_ulong start, abi_ulong len, int target_prot)
     tb_invalidate_phys_range(start, start + len);
     ret = 0;
 
+    //// --- Begin LibAFL code ---
+    libafl_maps_protect(start, len, target_prot);
+    //// --- End LibAFL code ---
+
 error:
     mmap_unlock();
     return ret;
@@ -492,6 +1188,12 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int target_prot,
         }
     }
 
+    //// --- Begin LibAFL code ---
+    if (flags & MAP_FIXED) {
+        libafl_user_snapshot_touch(start, start + len - 1);
+    }
+    //// --- End LibAFL code ---
+
     /* When mapping files into a memory area larger than the file, accesses
        to pages beyond the file size will cause a SIGBUS. 
 
@@ -653,6 +1355,11 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int target_prot,
         }
     }
  the_end:
+    //// --- Begin LibAFL code ---
+    libafl_maps_map(start, len, target_prot, (flags & MAP_TYPE) != MAP_SHARED,
+                    flags & MAP_ANONYMOUS ? NULL : libafl_maps_fd_path(fd),
+                    offset);
+    //// --- End LibAFL code ---
     trace_target_mmap_complete(start);
     if (qemu_loglevel_mask(CPU_LOG_PAGE)) {
         FILE *f = qemu_log_trylock();
@@ -730,6 +1437,10 @@ int target_munmap(abi_ulong start, abi_ulong len)
     real_start = start & qemu_host_page_mask;
     real_end = HOST_PAGE_ALIGN(end);
 
+    //// --- Begin LibAFL code ---
+    libafl_user_snapshot_touch(start, end - 1);
+    //// --- End LibAFL code ---
+
     if (start > real_start) {
         /* handle host page containing start */
         prot = 0;
@@ -767,6 +1478,9 @@ int target_munmap(abi_ulong start, abi_ulong len)
     if (ret == 0) {
         page_set_flags(start, start + len, 0);
         tb_invalidate_phys_range(start, start + len);
+        //// --- Begin LibAFL code ---
+        libafl_maps_remove(start, start + len - 1);
+        //// --- End LibAFL code ---
     }
     mmap_unlock();
     return ret;
@@ -790,6 +1504,15 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
 
     mmap_lock();
 
+    //// --- Begin LibAFL code ---
+    if (old_size) {
+        libafl_user_snapshot_touch(old_addr, old_addr + old_size - 1);
+    }
+    if ((flags & MREMAP_FIXED) && new_size) {
+        libafl_user_snapshot_touch(new_addr, new_addr + new_size - 1);
+    }
+    //// --- End LibAFL code ---
+
     if (flags & MREMAP_FIXED) {
         host_addr = mremap(g2h_untagged(old_addr), old_size, new_size,
                            flags, g2h_untagged(new_addr));
@@ -855,6 +1578,9 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
         page_set_flags(old_addr, old_addr + old_size, 0);
         page_set_flags(new_addr, new_addr + new_size,
                        prot | PAGE_VALID | PAGE_RESET);
+        //// --- Begin LibAFL code ---
+        libafl_maps_move(old_addr, old_size, new_addr, new_size);
+        //// --- End LibAFL code ---
     }
     tb_invalidate_phys_range(new_addr, new_addr + new_size);
     mmap_unlock();
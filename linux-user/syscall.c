@@ -828,6 +828,17 @@ uint64_t libafl_set_brk(uint64_t new_brk) {
   return old_brk;
 }
 
+/* For the linux-user snapshots, which also need the mapped heap end */
+void libafl_brk_get_state(abi_ulong *brk, abi_ulong *page) {
+  *brk = target_brk;
+  *page = brk_page;
+}
+
+void libafl_brk_set_state(abi_ulong brk, abi_ulong page) {
+  target_brk = brk;
+  brk_page = page;
+}
+
 //// --- End LibAFL code ---
 
 //#define DEBUGF_BRK(message, args...) do { fprintf(stderr, (message), ## args); } while (0)
@@ -4594,6 +4605,12 @@ static inline abi_ulong do_shmat(CPUArchState *cpu_env,
                    PAGE_VALID | PAGE_RESET | PAGE_READ |
                    (shmflg & SHM_RDONLY ? 0 : PAGE_WRITE));
 
+    //// --- Begin LibAFL code ---
+    libafl_maps_shm_attach(raddr, TARGET_PAGE_ALIGN(shm_info.shm_segsz),
+                           PROT_READ |
+                           (shmflg & SHM_RDONLY ? 0 : PROT_WRITE));
+    //// --- End LibAFL code ---
+
     for (i = 0; i < N_SHM_REGIONS; i++) {
         if (!shm_regions[i].in_use) {
             shm_regions[i].in_use = true;
@@ -4621,6 +4638,10 @@ static inline abi_long do_shmdt(abi_ulong shmaddr)
         if (shm_regions[i].in_use && shm_regions[i].start == shmaddr) {
             shm_regions[i].in_use = false;
             page_set_flags(shmaddr, shmaddr + shm_regions[i].size, 0);
+            //// --- Begin LibAFL code ---
+            libafl_maps_shm_detach(shmaddr,
+                                   TARGET_PAGE_ALIGN(shm_regions[i].size));
+            //// --- End LibAFL code ---
             break;
         }
     }
@@ -7176,6 +7197,13 @@ static abi_long do_fcntl(int fd, int cmd, abi_ulong arg)
         ret = get_errno(safe_fcntl(fd, cmd, arg));
         break;
     }
+
+    //// --- Begin LibAFL code ---
+    if ((cmd == TARGET_F_DUPFD || cmd == TARGET_F_DUPFD_CLOEXEC) && ret >= 0) {
+        libafl_vfd_dup(fd, ret);
+    }
+    //// --- End LibAFL code ---
+
     return ret;
 }
 
@@ -8261,6 +8289,205 @@ static int open_hardware(CPUArchState *cpu_env, int fd)
 }
 #endif
 
+//// --- Begin LibAFL code ---
+
+struct libafl_virtual_path {
+    char* path;
+    const uint8_t* buf;
+    const size_t* len;
+    struct libafl_virtual_path* next;
+};
+
+/*
+ * Entries are only ever added, at the head, and updated in place, so opens
+ * walk the list without taking the lock.
+ */
+static struct libafl_virtual_path* libafl_virtual_paths;
+static pthread_mutex_t libafl_virtual_paths_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Serve the guest's opens of "path" from buf instead of the host file, see
+ * fd-trans.h. The path is compared as the guest passes it, without any
+ * normalization. *len is the current size; buf and *len may be rewritten in
+ * place between runs. Registering a path again replaces its buffer for
+ * later opens.
+ */
+int libafl_add_virtual_file(const char* path, const uint8_t* buf,
+                            const size_t* len);
+int libafl_add_virtual_file(const char* path, const uint8_t* buf,
+                            const size_t* len) {
+    struct libafl_virtual_path* vp;
+
+    if (!path || !buf || !len) return 0;
+
+    pthread_mutex_lock(&libafl_virtual_paths_lock);
+    for (vp = libafl_virtual_paths; vp; vp = vp->next) {
+        if (!strcmp(vp->path, path)) break;
+    }
+    if (!vp) {
+        vp = malloc(sizeof(struct libafl_virtual_path));
+        if (!vp || !(vp->path = strdup(path))) {
+            free(vp);
+            pthread_mutex_unlock(&libafl_virtual_paths_lock);
+            return 0;
+        }
+        vp->buf = buf;
+        vp->len = len;
+        vp->next = libafl_virtual_paths;
+        qatomic_rcu_set(&libafl_virtual_paths, vp);
+    } else {
+        vp->buf = buf;
+        vp->len = len;
+    }
+    pthread_mutex_unlock(&libafl_virtual_paths_lock);
+    return 1;
+}
+
+/* Serve an already open guest fd, e.g. 0 for stdin, from buf */
+int libafl_set_virtual_fd(int fd, const uint8_t* buf, const size_t* len);
+int libafl_set_virtual_fd(int fd, const uint8_t* buf, const size_t* len) {
+    if (fd < 0 || !buf || !len) return 0;
+    libafl_vfd_register(fd, buf, len);
+    return 1;
+}
+
+static bool libafl_open_virtual_file(const char* pathname, int flags,
+                                     int* fd)
+{
+    struct libafl_virtual_path* vp;
+
+    for (vp = qatomic_rcu_read(&libafl_virtual_paths); vp; vp = vp->next) {
+        if (!strcmp(vp->path, pathname)) break;
+    }
+    if (!vp) return false;
+
+    /* Only a placeholder for the fd number, the data comes from vp->buf */
+    *fd = safe_openat(AT_FDCWD, "/dev/null", flags & (O_ACCMODE | O_CLOEXEC),
+                      0);
+    if (*fd >= 0) {
+        libafl_vfd_register(*fd, vp->buf, vp->len);
+    }
+    return true;
+}
+
+static abi_long libafl_vfd_readv(int fd, const struct iovec* vec, int count)
+{
+    abi_long total = 0;
+    abi_long ret;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        ret = libafl_vfd_read(fd, vec[i].iov_base, vec[i].iov_len);
+        if (ret < 0) return total ? total : ret;
+        total += ret;
+        if (ret < vec[i].iov_len) break;
+    }
+    return total;
+}
+
+#if defined(TARGET_NR_preadv)
+static abi_long libafl_vfd_preadv(int fd, const struct iovec* vec, int count,
+                                  int64_t offset)
+{
+    abi_long total = 0;
+    abi_long ret;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        ret = libafl_vfd_pread(fd, vec[i].iov_base, vec[i].iov_len,
+                               offset + total);
+        if (ret < 0) return total ? total : ret;
+        total += ret;
+        if (ret < vec[i].iov_len) break;
+    }
+    return total;
+}
+#endif
+
+/*
+ * For syscalls that would otherwise read the /dev/null placeholder behind
+ * a virtual fd and report a silent EOF
+ */
+static inline abi_long libafl_vfd_unsupported(const char* name)
+{
+    qemu_log_mask(LOG_UNIMP, "libafl: %s on a virtual fd is not supported\n",
+                  name);
+    return -TARGET_EINVAL;
+}
+
+#if defined(TARGET_NR_fstat) || defined(TARGET_NR_fstat64) || \
+    defined(TARGET_NR_fstatat64) || defined(TARGET_NR_newfstatat) || \
+    defined(TARGET_NR_statx)
+/* A virtual fd looks like a read-only regular file of the buffer's size */
+static void libafl_vfd_fix_stat(int fd, struct stat* st)
+{
+    uint64_t size;
+
+    if (libafl_vfd_size(fd, &size)) return;
+    st->st_mode = S_IFREG | 0444;
+    st->st_rdev = 0;
+    st->st_size = size;
+    st->st_blocks = DIV_ROUND_UP(size, 512);
+}
+#endif
+
+#if defined(TARGET_NR_statx) && defined(__NR_statx)
+static void libafl_vfd_fix_statx(int fd, struct target_statx* stx)
+{
+    uint64_t size;
+
+    if (libafl_vfd_size(fd, &size)) return;
+    stx->stx_mode = S_IFREG | 0444;
+    stx->stx_rdev_major = 0;
+    stx->stx_rdev_minor = 0;
+    stx->stx_size = size;
+    stx->stx_blocks = DIV_ROUND_UP(size, 512);
+}
+#endif
+
+/*
+ * target_mmap() that maps virtual fds as an anonymous private copy of the
+ * buffer. Stores through a MAP_SHARED mapping therefore do not reach the
+ * buffer, and pages past its end read as zeros instead of raising SIGBUS.
+ */
+static abi_long libafl_target_mmap(abi_ulong start, abi_ulong len,
+                                   int prot, int flags, int fd,
+                                   abi_ulong offset)
+{
+    abi_long ret;
+    abi_long n;
+    int e;
+
+    if ((flags & MAP_ANONYMOUS) || !libafl_vfd_is_virtual(fd)) {
+        return target_mmap(start, len, prot, flags, fd, offset);
+    }
+
+    if (offset & ~TARGET_PAGE_MASK) {
+        errno = EINVAL;
+        return -1;
+    }
+    ret = target_mmap(start, len, prot | PROT_WRITE,
+                      (flags & ~MAP_TYPE) | MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+    if (ret == -1) return ret;
+
+    n = libafl_vfd_pread(fd, g2h_untagged(ret), len, offset);
+    if (n < 0) {
+        target_munmap(ret, len);
+        errno = EBADF;
+        return -1;
+    }
+    if (!(prot & PROT_WRITE) && target_mprotect(ret, len, prot)) {
+        e = errno;
+        target_munmap(ret, len);
+        errno = e;
+        return -1;
+    }
+    return ret;
+}
+
+//// --- End LibAFL code ---
+
 static int do_openat(CPUArchState *cpu_env, int dirfd, const char *pathname, int flags, mode_t mode)
 {
     struct fake_open {
@@ -8286,6 +8513,14 @@ static int do_openat(CPUArchState *cpu_env, int dirfd, const char *pathname, int
         { NULL, NULL, NULL }
     };
 
+    //// --- Begin LibAFL code ---
+    int libafl_fd;
+
+    if (libafl_open_virtual_file(pathname, flags, &libafl_fd)) {
+        return libafl_fd;
+    }
+    //// --- End LibAFL code ---
+
     if (is_proc_myself(pathname, "exe")) {
         int execfd = qemu_getauxval(AT_EXECFD);
         return execfd ? execfd : safe_openat(dirfd, exec_path, flags, mode);
@@ -8644,6 +8879,18 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
         _exit(arg1);
         return 0; /* avoid warning */
     case TARGET_NR_read:
+        //// --- Begin LibAFL code ---
+        if (libafl_vfd_is_virtual(arg1)) {
+            if (arg3 == 0) {
+                return 0;
+            }
+            if (!(p = lock_user(VERIFY_WRITE, arg2, arg3, 0)))
+                return -TARGET_EFAULT;
+            ret = libafl_vfd_read(arg1, p, arg3);
+            unlock_user(p, arg2, ret);
+            return ret;
+        }
+        //// --- End LibAFL code ---
         if (arg2 == 0 && arg3 == 0) {
             return get_errno(safe_read(arg1, 0, 0));
         } else {
@@ -8734,6 +8981,9 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
 #endif
     case TARGET_NR_close:
         fd_trans_unregister(arg1);
+        //// --- Begin LibAFL code ---
+        libafl_vfd_unregister(arg1);
+        //// --- End LibAFL code ---
         return get_errno(close(arg1));
 
     case TARGET_NR_brk:
@@ -8963,6 +9213,11 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
 #endif
 #ifdef TARGET_NR_lseek
     case TARGET_NR_lseek:
+        //// --- Begin LibAFL code ---
+        if (libafl_vfd_is_virtual(arg1)) {
+            return libafl_vfd_lseek(arg1, arg2, arg3);
+        }
+        //// --- End LibAFL code ---
         return get_errno(lseek(arg1, arg2, arg3));
 #endif
 #if defined(TARGET_NR_getxpid) && defined(TARGET_ALPHA)
@@ -9233,6 +9488,9 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
         ret = get_errno(dup(arg1));
         if (ret >= 0) {
             fd_trans_dup(arg1, ret);
+            //// --- Begin LibAFL code ---
+            libafl_vfd_dup(arg1, ret);
+            //// --- End LibAFL code ---
         }
         return ret;
 #ifdef TARGET_NR_pipe
@@ -9302,6 +9560,9 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
         ret = get_errno(dup2(arg1, arg2));
         if (ret >= 0) {
             fd_trans_dup(arg1, arg2);
+            //// --- Begin LibAFL code ---
+            libafl_vfd_dup(arg1, arg2);
+            //// --- End LibAFL code ---
         }
         return ret;
 #endif
@@ -9317,6 +9578,9 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
         ret = get_errno(dup3(arg1, arg2, host_flags));
         if (ret >= 0) {
             fd_trans_dup(arg1, arg2);
+            //// --- Begin LibAFL code ---
+            libafl_vfd_dup(arg1, arg2);
+            //// --- End LibAFL code ---
         }
         return ret;
     }
@@ -10023,13 +10287,13 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
             v5 = tswapal(v[4]);
             v6 = tswapal(v[5]);
             unlock_user(v, arg1, 0);
-            ret = get_errno(target_mmap(v1, v2, v3,
+            ret = get_errno(libafl_target_mmap(v1, v2, v3,
                                         target_to_host_bitmask(v4, mmap_flags_tbl),
                                         v5, v6));
         }
 #else
         /* mmap pointers are always untagged */
-        ret = get_errno(target_mmap(arg1, arg2, arg3,
+        ret = get_errno(libafl_target_mmap(arg1, arg2, arg3,
                                     target_to_host_bitmask(arg4, mmap_flags_tbl),
                                     arg5,
                                     arg6));
@@ -10041,9 +10305,9 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
 #ifndef MMAP_SHIFT
 #define MMAP_SHIFT 12
 #endif
-        ret = target_mmap(arg1, arg2, arg3,
-                          target_to_host_bitmask(arg4, mmap_flags_tbl),
-                          arg5, arg6 << MMAP_SHIFT);
+        ret = libafl_target_mmap(arg1, arg2, arg3,
+                                 target_to_host_bitmask(arg4, mmap_flags_tbl),
+                                 arg5, arg6 << MMAP_SHIFT);
         return get_errno(ret);
 #endif
     case TARGET_NR_munmap:
@@ -10398,6 +10662,11 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
     case TARGET_NR_fstat:
         {
             ret = get_errno(fstat(arg1, &st));
+            //// --- Begin LibAFL code ---
+            if (!is_error(ret)) {
+                libafl_vfd_fix_stat(arg1, &st);
+            }
+            //// --- End LibAFL code ---
 #if defined(TARGET_NR_stat) || defined(TARGET_NR_lstat)
         do_stat:
 #endif
@@ -10680,6 +10949,17 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
     case TARGET_NR__llseek:
         {
             int64_t res;
+            //// --- Begin LibAFL code ---
+            if (libafl_vfd_is_virtual(arg1)) {
+                res = libafl_vfd_lseek(arg1,
+                                       ((uint64_t)arg2 << 32) | (abi_ulong)arg3,
+                                       arg5);
+                if (res < 0) {
+                    return res;
+                }
+                return put_user_s64(res, arg4) ? -TARGET_EFAULT : 0;
+            }
+            //// --- End LibAFL code ---
 #if !defined(__NR_llseek)
             res = lseek(arg1, ((uint64_t)arg2 << 32) | (abi_ulong)arg3, arg5);
             if (res == -1) {
@@ -10728,6 +11008,13 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
         {
             struct iovec *vec = lock_iovec(VERIFY_WRITE, arg2, arg3, 0);
             if (vec != NULL) {
+                //// --- Begin LibAFL code ---
+                if (libafl_vfd_is_virtual(arg1)) {
+                    ret = libafl_vfd_readv(arg1, vec, arg3);
+                    unlock_iovec(vec, arg2, arg3, 1);
+                    return ret;
+                }
+                //// --- End LibAFL code ---
                 ret = get_errno(safe_readv(arg1, vec, arg3));
                 unlock_iovec(vec, arg2, arg3, 1);
             } else {
@@ -10754,6 +11041,17 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
                 unsigned long low, high;
 
                 target_to_host_low_high(arg4, arg5, &low, &high);
+                //// --- Begin LibAFL code ---
+                if (libafl_vfd_is_virtual(arg1)) {
+                    uint64_t off = (uint64_t)low |
+                        ((uint64_t)high << HOST_LONG_BITS / 2) <<
+                        HOST_LONG_BITS / 2;
+
+                    ret = libafl_vfd_preadv(arg1, vec, arg3, off);
+                    unlock_iovec(vec, arg2, arg3, 1);
+                    return ret;
+                }
+                //// --- End LibAFL code ---
                 ret = get_errno(safe_preadv(arg1, vec, arg3, low, high));
                 unlock_iovec(vec, arg2, arg3, 1);
             } else {
@@ -11060,6 +11358,13 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
                 return -TARGET_EFAULT;
             }
         }
+        //// --- Begin LibAFL code ---
+        if (libafl_vfd_is_virtual(arg1)) {
+            ret = libafl_vfd_pread(arg1, p, arg3, target_offset64(arg4, arg5));
+            unlock_user(p, arg2, ret);
+            return ret;
+        }
+        //// --- End LibAFL code ---
         ret = get_errno(pread64(arg1, p, arg3, target_offset64(arg4, arg5)));
         unlock_user(p, arg2, ret);
         return ret;
@@ -11166,6 +11471,11 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
     {
         off_t *offp = NULL;
         off_t off;
+        //// --- Begin LibAFL code ---
+        if (libafl_vfd_is_virtual(arg2)) {
+            return libafl_vfd_unsupported("sendfile");
+        }
+        //// --- End LibAFL code ---
         if (arg3) {
             ret = get_user_sal(off, arg3);
             if (is_error(ret)) {
@@ -11188,6 +11498,11 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
     {
         off_t *offp = NULL;
         off_t off;
+        //// --- Begin LibAFL code ---
+        if (libafl_vfd_is_virtual(arg2)) {
+            return libafl_vfd_unsupported("sendfile64");
+        }
+        //// --- End LibAFL code ---
         if (arg3) {
             ret = get_user_s64(off, arg3);
             if (is_error(ret)) {
@@ -11266,6 +11581,11 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
 #ifdef TARGET_NR_fstat64
     case TARGET_NR_fstat64:
         ret = get_errno(fstat(arg1, &st));
+        //// --- Begin LibAFL code ---
+        if (!is_error(ret)) {
+            libafl_vfd_fix_stat(arg1, &st);
+        }
+        //// --- End LibAFL code ---
         if (!is_error(ret))
             ret = host_to_target_stat64(cpu_env, arg2, &st);
         return ret;
@@ -11281,6 +11601,11 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
             return -TARGET_EFAULT;
         }
         ret = get_errno(fstatat(arg1, path(p), &st, arg4));
+        //// --- Begin LibAFL code ---
+        if (!is_error(ret) && (arg4 & AT_EMPTY_PATH) && !*p) {
+            libafl_vfd_fix_stat(arg1, &st);
+        }
+        //// --- End LibAFL code ---
         unlock_user(p, arg2, 0);
         if (!is_error(ret))
             ret = host_to_target_stat64(cpu_env, arg3, &st);
@@ -11307,6 +11632,11 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
 
                 ret = get_errno(sys_statx(dirfd, p, flags, mask, &host_stx));
                 if (!is_error(ret)) {
+                    //// --- Begin LibAFL code ---
+                    if ((flags & AT_EMPTY_PATH) && !*p) {
+                        libafl_vfd_fix_statx(dirfd, &host_stx);
+                    }
+                    //// --- End LibAFL code ---
                     if (host_to_target_statx(&host_stx, arg5) != 0) {
                         unlock_user(p, arg2, 0);
                         return -TARGET_EFAULT;
@@ -11320,6 +11650,11 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
             }
 #endif
             ret = get_errno(fstatat(dirfd, path(p), &st, flags));
+            //// --- Begin LibAFL code ---
+            if (!is_error(ret) && (flags & AT_EMPTY_PATH) && !*p) {
+                libafl_vfd_fix_stat(dirfd, &st);
+            }
+            //// --- End LibAFL code ---
             unlock_user(p, arg2, 0);
 
             if (!is_error(ret)) {
@@ -12579,6 +12914,11 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
         {
             loff_t loff_in, loff_out;
             loff_t *ploff_in = NULL, *ploff_out = NULL;
+            //// --- Begin LibAFL code ---
+            if (libafl_vfd_is_virtual(arg1) || libafl_vfd_is_virtual(arg3)) {
+                return libafl_vfd_unsupported("splice");
+            }
+            //// --- End LibAFL code ---
             if (arg2) {
                 if (get_user_u64(loff_in, arg2)) {
                     return -TARGET_EFAULT;
@@ -13188,6 +13528,12 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
             loff_t inoff, outoff;
             loff_t *pinoff = NULL, *poutoff = NULL;
 
+            //// --- Begin LibAFL code ---
+            if (libafl_vfd_is_virtual(arg1) || libafl_vfd_is_virtual(arg3)) {
+                return libafl_vfd_unsupported("copy_file_range");
+            }
+            //// --- End LibAFL code ---
+
             if (arg2) {
                 if (get_user_u64(inoff, arg2)) {
                     return -TARGET_EFAULT;
@@ -13245,12 +13591,10 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
 
 //// --- Begin LibAFL code ---
 
-struct libafl_mapinfo {
-    target_ulong start, end;
-    target_ulong offset;
-    const char* path;
-    int flags, is_priv;
-};
+/*
+ * Walks the list of read_self_maps(). libafl_maps_lookup() and
+ * libafl_maps_find_next() in mmap.c answer from an index instead.
+ */
 GSList * libafl_maps_next(GSList *map_info, struct libafl_mapinfo* ret);
 
 GSList * libafl_maps_next(GSList *map_info, struct libafl_mapinfo* ret) {
@@ -13302,6 +13646,181 @@ uint64_t (*libafl_post_syscall_hook)(uint64_t, int, uint64_t, uint64_t,
                                      uint64_t, uint64_t, uint64_t, uint64_t,
                                      uint64_t, uint64_t);
 
+#include "qemu/rcu.h"
+
+/*
+ * Hooks subscribed to a single syscall number. They run nested inside the
+ * global hooks above: after the pre hook and before the post hook. Each
+ * syscall has its own list, so a syscall nobody subscribed to costs one
+ * load. Lists are read under RCU while guest threads run and
+ * changed under libafl_syscall_hooks_lock.
+ */
+#define LIBAFL_SYSCALL_HOOKS_SIZE 1024
+
+/* MIPS numbers its syscalls from 4000 (o32), 5000 (n64) or 6000 (n32) */
+#if defined(TARGET_SYSCALL_OFFSET)
+#define LIBAFL_SYSCALL_BASE TARGET_SYSCALL_OFFSET
+#elif defined(TARGET_MIPS)
+#define LIBAFL_SYSCALL_BASE 4000
+#else
+#define LIBAFL_SYSCALL_BASE 0
+#endif
+
+struct libafl_syscall_hook {
+    struct syshook_ret (*pre)(uint64_t data, int num, uint64_t, uint64_t,
+                              uint64_t, uint64_t, uint64_t, uint64_t,
+                              uint64_t, uint64_t);
+    uint64_t (*post)(uint64_t data, uint64_t ret, int num, uint64_t,
+                     uint64_t, uint64_t, uint64_t, uint64_t, uint64_t,
+                     uint64_t, uint64_t);
+    uint64_t data;
+    size_t id;
+    struct libafl_syscall_hook* next;
+    struct rcu_head rcu;
+};
+
+static struct libafl_syscall_hook* libafl_syscall_hooks[LIBAFL_SYSCALL_HOOKS_SIZE];
+static size_t libafl_syscall_hooks_id = 0;
+static pthread_mutex_t libafl_syscall_hooks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Index of syscall num in libafl_syscall_hooks, -1 if it has no slot */
+static inline int libafl_syscall_slot(int num)
+{
+    unsigned int slot = (unsigned int)num - LIBAFL_SYSCALL_BASE;
+
+    return slot < LIBAFL_SYSCALL_HOOKS_SIZE ? (int)slot : -1;
+}
+
+/*
+ * Subscribe to syscall num. pre can skip the syscall like the global hook,
+ * post can replace its result; either may be NULL. Hooks run in the order
+ * they were added. Returns the id of the hook, or 0 if num is out of range.
+ */
+size_t libafl_add_syscall_hook(int num,
+                               struct syshook_ret (*pre)(uint64_t, int,
+                                   uint64_t, uint64_t, uint64_t, uint64_t,
+                                   uint64_t, uint64_t, uint64_t, uint64_t),
+                               uint64_t (*post)(uint64_t, uint64_t, int,
+                                   uint64_t, uint64_t, uint64_t, uint64_t,
+                                   uint64_t, uint64_t, uint64_t, uint64_t),
+                               uint64_t data);
+size_t libafl_add_syscall_hook(int num,
+                               struct syshook_ret (*pre)(uint64_t, int,
+                                   uint64_t, uint64_t, uint64_t, uint64_t,
+                                   uint64_t, uint64_t, uint64_t, uint64_t),
+                               uint64_t (*post)(uint64_t, uint64_t, int,
+                                   uint64_t, uint64_t, uint64_t, uint64_t,
+                                   uint64_t, uint64_t, uint64_t, uint64_t),
+                               uint64_t data)
+{
+    struct libafl_syscall_hook** tail;
+    struct libafl_syscall_hook* hook;
+    int slot = libafl_syscall_slot(num);
+
+    if (slot < 0) {
+        return 0;
+    }
+
+    hook = malloc(sizeof(struct libafl_syscall_hook));
+    hook->pre = pre;
+    hook->post = post;
+    hook->data = data;
+    hook->next = NULL;
+
+    pthread_mutex_lock(&libafl_syscall_hooks_lock);
+    hook->id = ++libafl_syscall_hooks_id;
+    tail = &libafl_syscall_hooks[slot];
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    qatomic_rcu_set(tail, hook);
+    pthread_mutex_unlock(&libafl_syscall_hooks_lock);
+
+    return hook->id;
+}
+
+static void libafl_syscall_hook_free(struct rcu_head* rcu)
+{
+    free(container_of(rcu, struct libafl_syscall_hook, rcu));
+}
+
+int libafl_remove_syscall_hook(size_t id);
+int libafl_remove_syscall_hook(size_t id)
+{
+    struct libafl_syscall_hook** hk;
+    struct libafl_syscall_hook* target;
+    int slot;
+
+    pthread_mutex_lock(&libafl_syscall_hooks_lock);
+    for (slot = 0; slot < LIBAFL_SYSCALL_HOOKS_SIZE; slot++) {
+        for (hk = &libafl_syscall_hooks[slot]; *hk; hk = &(*hk)->next) {
+            if ((*hk)->id == id) {
+                target = *hk;
+                qatomic_rcu_set(hk, target->next);
+                pthread_mutex_unlock(&libafl_syscall_hooks_lock);
+                call_rcu1(&target->rcu, libafl_syscall_hook_free);
+                return 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&libafl_syscall_hooks_lock);
+    return 0;
+}
+
+static inline bool libafl_syscall_hooked(int num)
+{
+    int slot = libafl_syscall_slot(num);
+
+    return slot >= 0 && qatomic_read(&libafl_syscall_hooks[slot]) != NULL;
+}
+
+/*
+ * Only called for syscalls libafl_syscall_hooked() accepted, which have a
+ * slot. Returns true if a hook skips the syscall, with its result in *ret.
+ */
+static bool libafl_run_pre_syscall_hooks(int num, uint64_t *ret,
+                                         uint64_t a1, uint64_t a2,
+                                         uint64_t a3, uint64_t a4,
+                                         uint64_t a5, uint64_t a6,
+                                         uint64_t a7, uint64_t a8)
+{
+    struct libafl_syscall_hook* hk;
+    struct syshook_ret hook_ret;
+    int slot = libafl_syscall_slot(num);
+
+    RCU_READ_LOCK_GUARD();
+    for (hk = qatomic_rcu_read(&libafl_syscall_hooks[slot]); hk;
+         hk = qatomic_rcu_read(&hk->next)) {
+        if (hk->pre) {
+            hook_ret = hk->pre(hk->data, num, a1, a2, a3, a4, a5, a6, a7, a8);
+            if (hook_ret.skip_syscall) {
+                *ret = hook_ret.retval;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static uint64_t libafl_run_post_syscall_hooks(int num, uint64_t ret,
+                                              uint64_t a1, uint64_t a2,
+                                              uint64_t a3, uint64_t a4,
+                                              uint64_t a5, uint64_t a6,
+                                              uint64_t a7, uint64_t a8)
+{
+    struct libafl_syscall_hook* hk;
+    int slot = libafl_syscall_slot(num);
+
+    RCU_READ_LOCK_GUARD();
+    for (hk = qatomic_rcu_read(&libafl_syscall_hooks[slot]); hk;
+         hk = qatomic_rcu_read(&hk->next)) {
+        if (hk->post) {
+            ret = hk->post(hk->data, ret, num, a1, a2, a3, a4, a5, a6, a7, a8);
+        }
+    }
+    return ret;
+}
+
 //// --- End LibAFL code ---
 
 abi_long do_syscall(CPUArchState *cpu_env, int num, abi_long arg1,
@@ -13351,6 +13870,18 @@ abi_long do_syscall(CPUArchState *cpu_env, int num, abi_long arg1,
       }
     }
 
+    if (unlikely(libafl_syscall_hooked(num))) {
+        uint64_t hook_retval;
+        if (libafl_run_pre_syscall_hooks(num, &hook_retval, (uint64_t)arg1,
+                                         (uint64_t)arg2, (uint64_t)arg3,
+                                         (uint64_t)arg4, (uint64_t)arg5,
+                                         (uint64_t)arg6, (uint64_t)arg7,
+                                         (uint64_t)arg8)) {
+            ret = (abi_ulong)hook_retval;
+            goto after_syscall;
+        }
+    }
+
     //// --- End LibAFL code ---
 
     ret = do_syscall1(cpu_env, num, arg1, arg2, arg3, arg4,
@@ -13359,6 +13890,18 @@ abi_long do_syscall(CPUArchState *cpu_env, int num, abi_long arg1,
     //// --- Begin LibAFL code ---
 
 after_syscall:
+    if (unlikely(libafl_syscall_hooked(num))) {
+        ret = (abi_ulong)libafl_run_post_syscall_hooks(num, (uint64_t)ret,
+                                                       (uint64_t)arg1,
+                                                       (uint64_t)arg2,
+                                                       (uint64_t)arg3,
+                                                       (uint64_t)arg4,
+                                                       (uint64_t)arg5,
+                                                       (uint64_t)arg6,
+                                                       (uint64_t)arg7,
+                                                       (uint64_t)arg8);
+    }
+
     if (libafl_post_syscall_hook) {
         ret = (abi_ulong)libafl_post_syscall_hook((uint64_t)ret, num,
                                                   (uint64_t)arg1,
@@ -32,4 +32,21 @@ abi_ulong mmap_find_vma(abi_ulong, abi_ulong, abi_ulong);
 void mmap_fork_start(void);
 void mmap_fork_end(int child);
 
+//// --- Begin LibAFL code ---
+
+struct libafl_mapinfo {
+    target_ulong start, end;
+    target_ulong offset;
+    const char* path;
+    int flags, is_priv;
+};
+
+void libafl_maps_shm_attach(abi_ulong start, abi_ulong len, int prot);
+void libafl_maps_shm_detach(abi_ulong start, abi_ulong len);
+
+void libafl_brk_get_state(abi_ulong *brk, abi_ulong *page);
+void libafl_brk_set_state(abi_ulong brk, abi_ulong page);
+
+//// --- End LibAFL code ---
+
 #endif /* LINUX_USER_USER_MMAP_H */
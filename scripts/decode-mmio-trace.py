@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+#
+# Decoder for the LibAFL binary MMIO trace, see libafl_qemu_mmio_trace_start()
+# in accel/tcg/cputlb.c
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+import argparse
+import heapq
+import struct
+import sys
+
+TRACE_MAGIC = 0x544d4d4c
+TRACE_VERSION = 1
+TRACE_MAX_CPUS = 64
+
+HEADER_ICOUNT = 1
+
+EVENT_WRITE = 1
+EVENT_FAILED = 2
+
+header_fmt = '=8IQQ%dQ' % TRACE_MAX_CPUS
+event_fmt = '=QQQQHBBI'
+
+
+def read_header(buf):
+    '''Parse the trace header and sanity check it'''
+    fields = struct.unpack_from(header_fmt, buf, 0)
+    (magic, version, flags, num_cpus, entries, event_size, num_devices,
+     name_len, names_offset, rings_offset) = fields[:10]
+    heads = fields[10:10 + num_cpus]
+
+    if magic != TRACE_MAGIC:
+        raise ValueError('not an MMIO trace (magic 0x%x)' % magic)
+    if version != TRACE_VERSION:
+        raise ValueError('unsupported trace version %d' % version)
+    if event_size != struct.calcsize(event_fmt):
+        raise ValueError('unexpected event size %d' % event_size)
+
+    names = []
+    for i in range(num_devices):
+        off = names_offset + i * name_len
+        raw = buf[off:off + name_len]
+        names.append(raw.split(b'\0', 1)[0].decode('utf-8', 'replace'))
+
+    return {
+        'icount': bool(flags & HEADER_ICOUNT),
+        'num_cpus': num_cpus,
+        'entries': entries,
+        'event_size': event_size,
+        'rings_offset': rings_offset,
+        'heads': heads,
+        'names': names,
+    }
+
+
+def read_ring(buf, hdr, cpu):
+    '''Yield the events still held in the ring of a vCPU, oldest first'''
+    entries = hdr['entries']
+    head = hdr['heads'][cpu]
+    first = max(0, head - entries)
+    base = hdr['rings_offset'] + cpu * entries * hdr['event_size']
+
+    for seq in range(first, head):
+        off = base + (seq % entries) * hdr['event_size']
+        (icount, pc, offset, value, device, size, flags,
+         _) = struct.unpack_from(event_fmt, buf, off)
+        yield (icount, cpu, seq, pc, device, offset, size, value, flags)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode a binary MMIO trace')
+    parser.add_argument('trace', help='trace file written by QEMU')
+    parser.add_argument('--cpu', type=int, action='append',
+                        help='only show this vCPU (may be repeated)')
+    parser.add_argument('--device', action='append',
+                        help='only show this device name (may be repeated)')
+    parser.add_argument('--stats', action='store_true',
+                        help='print per device access counts instead')
+    args = parser.parse_args()
+
+    with open(args.trace, 'rb') as f:
+        buf = f.read()
+    hdr = read_header(buf)
+    names = hdr['names']
+
+    cpus = range(hdr['num_cpus'])
+    if args.cpu:
+        cpus = [c for c in args.cpu if c < hdr['num_cpus']]
+
+    for cpu in cpus:
+        if hdr['heads'][cpu] > hdr['entries']:
+            sys.stderr.write('cpu %d: %d oldest events were overwritten\n' %
+                             (cpu, hdr['heads'][cpu] - hdr['entries']))
+
+    # Rings are ordered by time on their own, merge them by timestamp
+    events = heapq.merge(*[read_ring(buf, hdr, c) for c in cpus])
+
+    clock = 'icount' if hdr['icount'] else 'ns'
+    stats = {}
+    for icount, cpu, seq, pc, device, offset, size, value, flags in events:
+        name = names[device] if device < len(names) else '#%d' % device
+        if args.device and name not in args.device:
+            continue
+        if args.stats:
+            r, w = stats.get(name, (0, 0))
+            stats[name] = (r, w + 1) if flags & EVENT_WRITE else (r + 1, w)
+            continue
+        print('%s=%d cpu=%d pc=0x%08x %s %s+0x%x size=%d value=0x%x%s' %
+              (clock, icount, cpu, pc,
+               'W' if flags & EVENT_WRITE else 'R',
+               name, offset, size, value,
+               ' FAILED' if flags & EVENT_FAILED else ''))
+
+    if args.stats:
+        for name, (r, w) in sorted(stats.items(), key=lambda i: -sum(i[1])):
+            print('%-40s reads=%d writes=%d' % (name, r, w))
+
+
+if __name__ == '__main__':
+    main()
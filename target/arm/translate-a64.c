@@ -4304,9 +4304,8 @@ static void disas_add_sub_imm(DisasContext *s, uint32_t insn)
 //// --- Begin LibAFL code ---
 
     if (rd == 31 && sub_op) { // cmp xX, imm
-      TCGv_i64 tcg_imm = tcg_const_i64(imm);
-      libafl_gen_cmp(s->pc_curr, tcg_rn, tcg_imm, is_64bit ? MO_64 : MO_32);
-      tcg_temp_free_i64(tcg_imm);
+      libafl_gen_cmp(s->pc_curr, tcg_rn, tcg_constant_i64(imm),
+                     is_64bit ? MO_64 : MO_32);
     }
 
 //// --- End LibAFL code ---
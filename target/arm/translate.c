@@ -5549,12 +5549,9 @@ static bool op_s_rri_rot(DisasContext *s, arg_s_rri_rot *a,
     if (gen == gen_sub_CC || /*gen == gen_add_CC ||*/ gen == gen_rsb_CC) {
 #ifdef TARGET_AARCH64
       TCGv tmp1_64 = tcg_temp_new();
-      TCGv tmp2_64 = tcg_temp_new();
       tcg_gen_extu_i32_i64(tmp1_64, tmp1);
-      tcg_gen_extu_i32_i64(tmp2_64, tcg_constant_i32(imm));
-      libafl_gen_cmp(s->pc_curr, tmp1_64, tmp2_64, MO_32);
+      libafl_gen_cmp(s->pc_curr, tmp1_64, tcg_constant_i64(imm), MO_32);
       tcg_temp_free(tmp1_64);
-      tcg_temp_free(tmp2_64);
 #else
       libafl_gen_cmp(s->pc_curr, tmp1, tcg_constant_i32(imm), MO_32);
 #endif
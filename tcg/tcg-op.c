@@ -2902,6 +2902,7 @@ static void plugin_gen_mem_callbacks(TCGv vaddr, MemOpIdx oi,
 
 void libafl_gen_read(TCGv addr, MemOp ot);
 void libafl_gen_write(TCGv addr, MemOp ot);
+void libafl_gen_shadow_check(TCGv addr, MemOp ot, bool is_write);
 
 //// --- End LibAFL code ---
 
@@ -2928,6 +2929,7 @@ void tcg_gen_qemu_ld_i32(TCGv_i32 val, TCGv addr, TCGArg idx, MemOp memop)
 //// --- Begin LibAFL code ---
 
     libafl_gen_read(addr, memop);
+    libafl_gen_shadow_check(addr, memop, false);
 
 //// --- End LibAFL code ---
 
@@ -2980,6 +2982,7 @@ void tcg_gen_qemu_st_i32(TCGv_i32 val, TCGv addr, TCGArg idx, MemOp memop)
 //// --- Begin LibAFL code ---
 
     libafl_gen_write(addr, memop);
+    libafl_gen_shadow_check(addr, memop, true);
 
 //// --- End LibAFL code ---
 
@@ -3028,6 +3031,7 @@ void tcg_gen_qemu_ld_i64(TCGv_i64 val, TCGv addr, TCGArg idx, MemOp memop)
 //// --- Begin LibAFL code ---
 
     libafl_gen_read(addr, memop);
+    libafl_gen_shadow_check(addr, memop, false);
 
 //// --- End LibAFL code ---
 
@@ -3092,6 +3096,7 @@ void tcg_gen_qemu_st_i64(TCGv_i64 val, TCGv addr, TCGArg idx, MemOp memop)
 //// --- Begin LibAFL code ---
 
     libafl_gen_write(addr, memop);
+    libafl_gen_shadow_check(addr, memop, true);
 
 //// --- End LibAFL code ---
 
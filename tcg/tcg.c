@@ -571,10 +571,51 @@ static TCGTemp *tcg_global_reg_new_internal(TCGContext *s, TCGType type,
 
 //// --- Begin LibAFL code ---
 
+#include "qemu/qht.h"
+#include "qemu/xxhash.h"
+
+/*
+ * Helpers of hooks registered at runtime. They can be added while other
+ * vCPU threads translate, so they go into a qht, which can be looked up
+ * without a lock, rather than into helper_table. The table holds copies
+ * that are never freed, one per function: a hook may be removed while a
+ * TB calling it is still being generated.
+ */
+static struct qht libafl_helper_qht;
+
+static bool libafl_helper_cmp(const void *a, const void *b)
+{
+    return ((const TCGHelperInfo *)a)->func == ((const TCGHelperInfo *)b)->func;
+}
+
+static uint32_t libafl_helper_hash(void *func)
+{
+    return qemu_xxhash2((uint64_t)(uintptr_t)func);
+}
+
+static const TCGHelperInfo *libafl_helper_lookup(void *func)
+{
+    TCGHelperInfo key = { .func = func };
+
+    RCU_READ_LOCK_GUARD();
+    return qht_lookup(&libafl_helper_qht, &key, libafl_helper_hash(func));
+}
+
 void libafl_helper_table_add(TCGHelperInfo* info);
 void libafl_helper_table_add(TCGHelperInfo* info) {
-    g_hash_table_insert(helper_table, (gpointer)info->func,
-                        (gpointer)info);
+    uint32_t hash = libafl_helper_hash(info->func);
+    TCGHelperInfo *copy;
+
+    if (libafl_helper_lookup(info->func)) {
+        return;
+    }
+
+    copy = malloc(sizeof(TCGHelperInfo));
+    *copy = *info;
+    if (!qht_insert(&libafl_helper_qht, copy, hash, NULL)) {
+        /* Someone else was faster */
+        free(copy);
+    }
 }
 
 //// --- End LibAFL code ---
@@ -617,6 +658,10 @@ static void tcg_context_init(unsigned max_cpus)
                             (gpointer)&all_helpers[i]);
     }
 
+    //// --- Begin LibAFL code ---
+    qht_init(&libafl_helper_qht, libafl_helper_cmp, 64, QHT_MODE_AUTO_RESIZE);
+    //// --- End LibAFL code ---
+
 #ifdef CONFIG_TCG_INTERPRETER
     /* g_direct_hash/equal for direct comparisons on uint32_t.  */
     ffi_table = g_hash_table_new(NULL, NULL);
@@ -1488,6 +1533,11 @@ void tcg_gen_callN(void *func, TCGTemp *ret, int nargs, TCGTemp **args)
     TCGOp *op;
 
     info = g_hash_table_lookup(helper_table, (gpointer)func);
+    //// --- Begin LibAFL code ---
+    if (info == NULL) {
+        info = libafl_helper_lookup(func);
+    }
+    //// --- End LibAFL code ---
     typemask = info->typemask;
 
 #ifdef CONFIG_PLUGIN
@@ -0,0 +1,97 @@
+/*
+ * Shadow memory checks: accesses touching a poisoned byte are reported,
+ * including unaligned ones reaching into a poisoned granule, and
+ * unpoisoning or unmapping a range makes it valid again.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "libafl-test.h"
+
+static volatile uint32_t sink;
+
+static long reports(void)
+{
+    return libafl_test(LIBAFL_TEST_SHADOW_REPORTS, 0, 0, 0);
+}
+
+static void read8(const volatile char *p)
+{
+    sink = *p;
+}
+
+static void write8(volatile char *p)
+{
+    *p = 1;
+}
+
+/* A single unaligned load where the target allows it */
+static void read32(const char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    sink = v;
+}
+
+int main(void)
+{
+    long pagesize = getpagesize();
+    char *page, *p;
+
+    libafl_test_require();
+
+    page = mmap(NULL, pagesize, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(page != MAP_FAILED);
+
+    assert(libafl_test(LIBAFL_TEST_SHADOW_ENABLE, 1, 0, 0) == 0);
+    assert(libafl_test(LIBAFL_TEST_SHADOW_POISON, (long)page + 16, 8, 0) == 0);
+    assert(reports() == 0);
+
+    read8(page + 16);
+    assert(reports() == 1);
+    write8(page + 23);
+    assert(reports() == 1);
+
+    /* The neighbouring granules stay valid */
+    read8(page + 15);
+    write8(page + 24);
+    read32(page + 8);
+    assert(reports() == 0);
+
+    /* Starts in a valid granule and ends in the poisoned one */
+    read32(page + 14);
+    assert(reports() > 0);
+
+    /* Only the last 4 bytes of this granule are poisoned */
+    assert(libafl_test(LIBAFL_TEST_SHADOW_POISON, (long)page + 36, 4, 0) == 0);
+    read8(page + 35);
+    assert(reports() == 0);
+    read8(page + 36);
+    assert(reports() == 1);
+
+    assert(libafl_test(LIBAFL_TEST_SHADOW_UNPOISON, (long)page + 16, 24,
+                       0) == 0);
+    read8(page + 16);
+    read8(page + 39);
+    read32(page + 14);
+    assert(reports() == 0);
+
+    /* Poison does not outlive the mapping */
+    assert(libafl_test(LIBAFL_TEST_SHADOW_POISON, (long)page, 64, 0) == 0);
+    assert(munmap(page, pagesize) == 0);
+    p = mmap(page, pagesize, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    assert(p == page);
+    read8(p);
+    write8(p + 63);
+    assert(reports() == 0);
+
+    assert(libafl_test(LIBAFL_TEST_SHADOW_ENABLE, 0, 0, 0) == 0);
+    printf("PASS\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,88 @@
+/*
+ * User-mode snapshots: private memory, the memory layout and brk go back
+ * to their state at the snapshot when it is restored.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "libafl-test.h"
+
+#define ARENA_PAGES 256
+
+static volatile int counter = 1;
+
+int main(void)
+{
+    long pagesize = getpagesize();
+    char path[] = "/tmp/libafl-snapshot-XXXXXX";
+    char *arena, *gone, *file, *p;
+    void *brk0;
+    long i, r;
+    int fd;
+
+    libafl_test_require();
+
+    /* A large arena, of which only a single page is ever written */
+    arena = mmap(NULL, ARENA_PAGES * pagesize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(arena != MAP_FAILED);
+    arena[pagesize] = 'a';
+
+    gone = mmap(NULL, pagesize, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(gone != MAP_FAILED);
+    memset(gone, 'g', pagesize);
+
+    /* A private file mapping reaching past the end of its file */
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+    assert(write(fd, "file", 4) == 4);
+    file = mmap(NULL, 2 * pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                fd, 0);
+    assert(file != MAP_FAILED);
+    close(fd);
+
+    brk0 = sbrk(0);
+
+    r = libafl_test(LIBAFL_TEST_SNAPSHOT, 0, 0, 0);
+    if (r < 0 && errno == ENOSYS) {
+        printf("SKIP: no CPU snapshots for this target\n");
+        return EXIT_SUCCESS;
+    }
+    if (r == 0) {
+        counter = 2;
+        arena[pagesize] = 'b';
+        arena[3 * pagesize] = 'c';
+        memcpy(file, "elif", 4);
+
+        /* Replaced by a mapping with other contents */
+        assert(munmap(gone, pagesize) == 0);
+        p = mmap(gone, pagesize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        assert(p == gone);
+        memset(p, 'n', pagesize);
+
+        assert(sbrk(pagesize) != (void *)-1);
+
+        libafl_test(LIBAFL_TEST_RESTORE, 0, 0, 0);
+        assert(!"restore returned");
+    }
+
+    /* Back from the snapshot request */
+    assert(r == 1);
+    assert(counter == 1);
+    assert(arena[pagesize] == 'a');
+    assert(arena[3 * pagesize] == 0);
+    for (i = 0; i < pagesize; i++) {
+        assert(gone[i] == 'g');
+    }
+    assert(memcmp(file, "file", 4) == 0);
+    assert(sbrk(0) == brk0);
+
+    printf("PASS\n");
+    return EXIT_SUCCESS;
+}
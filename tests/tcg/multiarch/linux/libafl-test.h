@@ -0,0 +1,48 @@
+/*
+ * Requests to the LibAFL test driver of linux-user, see
+ * linux-user/libafl-test.c. QEMU only installs it when QEMU_LIBAFL_TEST is
+ * set; without it the tests pass without checking anything.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#ifndef LIBAFL_TEST_H
+#define LIBAFL_TEST_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* MIPS numbers its syscalls from the base of the ABI */
+#ifdef __NR_Linux
+#define LIBAFL_TEST_NR (__NR_Linux + 1023)
+#else
+#define LIBAFL_TEST_NR 1023
+#endif
+
+enum {
+    LIBAFL_TEST_PING,
+    LIBAFL_TEST_SNAPSHOT,
+    LIBAFL_TEST_RESTORE,
+    LIBAFL_TEST_VFD,
+    LIBAFL_TEST_SHADOW_ENABLE,
+    LIBAFL_TEST_SHADOW_POISON,
+    LIBAFL_TEST_SHADOW_UNPOISON,
+    LIBAFL_TEST_SHADOW_REPORTS,
+};
+
+static inline long libafl_test(long req, long a, long b, long c)
+{
+    return syscall(LIBAFL_TEST_NR, req, a, b, c);
+}
+
+static inline void libafl_test_require(void)
+{
+    if (libafl_test(LIBAFL_TEST_PING, 0, 0, 0) != 0) {
+        printf("SKIP: QEMU_LIBAFL_TEST is not set\n");
+        exit(EXIT_SUCCESS);
+    }
+}
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Virtual fds: an fd served from a buffer behaves like a read-only regular
+ * file holding that buffer, across dup(), lseek() and mmap().
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "libafl-test.h"
+
+static const char data[] = "0123456789abcdefghij";
+#define LEN ((long)sizeof(data) - 1)
+
+int main(void)
+{
+    long pagesize = getpagesize();
+    char buf[64], buf2[64];
+    struct iovec iov[2];
+    struct stat st;
+    int fd, fd2, fd3, out;
+    char *map;
+    long i;
+
+    libafl_test_require();
+
+    fd = open("/dev/null", O_RDONLY);
+    assert(fd >= 0);
+    assert(libafl_test(LIBAFL_TEST_VFD, fd, (long)data, LEN) == 0);
+
+    assert(fstat(fd, &st) == 0);
+    assert(S_ISREG(st.st_mode));
+    assert(st.st_size == LEN);
+
+    /* read() moves the offset that lseek() reports and changes */
+    assert(read(fd, buf, 4) == 4);
+    assert(memcmp(buf, "0123", 4) == 0);
+    assert(lseek(fd, 0, SEEK_CUR) == 4);
+    assert(lseek(fd, 6, SEEK_CUR) == 10);
+    assert(read(fd, buf, 3) == 3);
+    assert(memcmp(buf, "abc", 3) == 0);
+    assert(lseek(fd, -2, SEEK_END) == LEN - 2);
+    assert(read(fd, buf, sizeof(buf)) == 2);
+    assert(memcmp(buf, "ij", 2) == 0);
+    assert(read(fd, buf, sizeof(buf)) == 0);
+
+    /* Positional reads leave the offset alone */
+    assert(lseek(fd, 0, SEEK_SET) == 0);
+    assert(pread(fd, buf, 5, 15) == 5);
+    assert(memcmp(buf, "fghij", 5) == 0);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = 3;
+    iov[1].iov_base = buf2;
+    iov[1].iov_len = 3;
+    assert(preadv(fd, iov, 2, 7) == 6);
+    assert(memcmp(buf, "789", 3) == 0);
+    assert(memcmp(buf2, "abc", 3) == 0);
+    assert(lseek(fd, 0, SEEK_CUR) == 0);
+
+    assert(readv(fd, iov, 2) == 6);
+    assert(memcmp(buf, "012", 3) == 0);
+    assert(memcmp(buf2, "345", 3) == 0);
+
+    /* Duplicates share the offset */
+    fd2 = dup(fd);
+    assert(fd2 >= 0);
+    assert(read(fd2, buf, 2) == 2);
+    assert(memcmp(buf, "67", 2) == 0);
+    fd3 = fcntl(fd, F_DUPFD, 100);
+    assert(fd3 >= 100);
+    assert(read(fd3, buf, 2) == 2);
+    assert(memcmp(buf, "89", 2) == 0);
+    assert(lseek(fd, 0, SEEK_CUR) == 10);
+
+    /* The mapping holds the buffer, the rest of the page reads as zeros */
+    map = mmap(NULL, pagesize, PROT_READ, MAP_PRIVATE, fd, 0);
+    assert(map != MAP_FAILED);
+    assert(memcmp(map, data, LEN) == 0);
+    for (i = LEN; i < pagesize; i++) {
+        assert(map[i] == 0);
+    }
+    assert(munmap(map, pagesize) == 0);
+
+    /* Calls that need a real file on the reading side fail loudly */
+    out = open("/dev/null", O_WRONLY);
+    assert(out >= 0);
+    assert(sendfile(out, fd, NULL, 4) == -1 && errno == EINVAL);
+    close(out);
+
+    /* Closing one duplicate leaves the others virtual */
+    close(fd);
+    assert(pread(fd2, buf, 4, 0) == 4);
+    assert(memcmp(buf, "0123", 4) == 0);
+    close(fd2);
+    close(fd3);
+
+    /* A new fd with the same number is a plain file again */
+    fd = open("/dev/null", O_RDONLY);
+    assert(fd >= 0);
+    assert(read(fd, buf, sizeof(buf)) == 0);
+    close(fd);
+
+    printf("PASS\n");
+    return EXIT_SUCCESS;
+}